@@ -0,0 +1,122 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "log.h"
+#include "util.h"
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+static uint8_t* base;
+static size_t size;
+static size_t used;
+static size_t last; /* offset of the last allocation, it can grow */
+
+bool arena_init(size_t len)
+{
+	base = malloc(len);
+	if (base == NULL) {
+		LOG_ERR("Could not allocate %zu bytes of memory", len);
+		return false;
+	}
+	/* touch it now, so it is part of the footprint from the start */
+	memset(base, 0, len);
+	size = len;
+	used = last = 0;
+	return true;
+}
+
+void arena_free(void)
+{
+	free(base);
+	base = NULL;
+	size = used = last = 0;
+}
+
+bool arena_active(void)
+{
+	return base != NULL;
+}
+
+void* arena_alloc(size_t len)
+{
+	if (base == NULL) {
+		return malloc(len);
+	}
+
+	size_t start = (used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (start + len > size) {
+		LOG_ERR("Arena of -M is too small, %zu bytes missing",
+				start + len - size);
+		return NULL;
+	}
+	last = start;
+	used = start + len;
+	return base + start;
+}
+
+/* the last allocation grows in place, others are copied and their space is
+ * lost */
+void* arena_realloc(void* p, size_t old_len, size_t len)
+{
+	if (base == NULL) {
+		return realloc(p, len);
+	}
+
+	if (p != NULL && (uint8_t*)p == base + last) {
+		if (last + len > size) {
+			LOG_ERR("Arena of -M is too small, %zu bytes missing",
+					last + len - size);
+			return NULL;
+		}
+		used = last + len;
+		return p;
+	}
+
+	void* n = arena_alloc(len);
+	if (n != NULL && p != NULL) {
+		memcpy(n, p, MIN(old_len, len));
+	}
+	return n;
+}
+
+void arena_release(void* p)
+{
+	uint8_t* b = p;
+
+	if (base == NULL || b < base || b >= base + size) {
+		free(p);
+	}
+}
+
+size_t arena_size(void)
+{
+	return size;
+}
+
+/* nothing is freed, so what was used is also the peak */
+size_t arena_peak(void)
+{
+	return used;
+}
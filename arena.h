@@ -0,0 +1,43 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Low memory mode (-M): the buffers of the images and of the serial port
+ * come from one block which is allocated at the start, so the footprint of
+ * nrfdfu does not grow with the package. It is only used by one session,
+ * and nothing is freed until arena_free().
+ *
+ * Without arena_init() these are just malloc(), realloc() and free().
+ */
+bool arena_init(size_t size);
+void arena_free(void);
+bool arena_active(void);
+void* arena_alloc(size_t len);
+void* arena_realloc(void* p, size_t old_len, size_t len);
+void arena_release(void* p);
+size_t arena_size(void);
+size_t arena_peak(void);
+
+#endif
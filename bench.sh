@@ -0,0 +1,67 @@
+#!/bin/bash
+#
+# Throughput benchmark of nrfdfu against the emulated Bootloader: flashes a
+# package of random data through nrfdfu-emu and reports the time, the
+# throughput after entering the Bootloader and the CPU time used by nrfdfu.
+#
+# usage: bench.sh [-s <bytes>] [-r <runs>] [-e "<emu options>"] [-- <nrfdfu options>]
+#    eg: bench.sh -s 262144 -e "-b 1000000 -x 20" -- -n 8 -S
+#
+# nrfdfu and nrfdfu-emu are taken from $BUILD (build).
+
+BUILD=${BUILD:-build}
+SIZE=131072
+RUNS=3
+EMU_OPTS=""
+
+while getopts "s:r:e:" o; do
+	case $o in
+	s) SIZE=$OPTARG ;;
+	r) RUNS=$OPTARG ;;
+	e) EMU_OPTS=$OPTARG ;;
+	*) exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+TMP=$(mktemp -d)
+EMU=
+trap '[ -n "$EMU" ] && kill $EMU; rm -rf $TMP' EXIT
+
+head -c $SIZE /dev/urandom > $TMP/app.bin
+head -c 141 /dev/urandom > $TMP/app.dat
+echo '{"manifest": {"application": {"bin_file": "app.bin", "dat_file": "app.dat"}}}' \
+	> $TMP/manifest.json
+(cd $TMP && python3 -m zipfile -c pkg.zip manifest.json app.dat app.bin) || exit 1
+
+echo "$SIZE bytes, nrfdfu $*, nrfdfu-emu $EMU_OPTS"
+TIMEFORMAT="%R %U %S"
+
+for i in $(seq $RUNS); do
+	# a fresh Bootloader each run, so nothing can be resumed
+	rm -f $TMP/pty $TMP/out.bin
+	$BUILD/nrfdfu-emu -w $TMP/out.bin $EMU_OPTS > $TMP/pty &
+	EMU=$!
+	while [ ! -s $TMP/pty ]; do sleep 0.1; done
+
+	T=$( { time $BUILD/nrfdfu serial -p $(cat $TMP/pty) -j $TMP/stats.json \
+		"$@" $TMP/pkg.zip > $TMP/log 2>&1; } 2>&1 )
+	RET=$?
+	kill $EMU
+	wait $EMU 2>/dev/null
+	EMU=
+
+	if [ $RET -ne 0 ] || ! cmp -s $TMP/app.bin $TMP/out.bin; then
+		cat $TMP/log
+		echo "run $i: FAILED"
+		exit 1
+	fi
+
+	read REAL USER SYS <<< "$T"
+	RATE=$(python3 -c 'import json, sys
+d = json.load(open(sys.argv[1]))["devices"][0]
+t = d["time_ms"] - d["ops"]["enter"]["total_ms"]
+print(int(d["bytes"] * 1000 / t))' $TMP/stats.json)
+	printf "run %d: %6.2f s, %8d bytes/s, CPU user %.3f s sys %.3f s\n" \
+		$i $REAL $RATE $USER $SYS
+done
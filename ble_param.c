@@ -0,0 +1,393 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2020 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Parameters of the connection to a BLE device. These are not available
+ * through blzlib: the ATT MTU is read from BlueZ over D-Bus and the link
+ * layer is tuned with HCI commands directly */
+
+#ifdef BLE_SUPPORT
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <systemd/sd-bus.h>
+
+#include "ble_param.h"
+#include "log.h"
+#include "util.h"
+
+/* from the kernel, which does not export them, and BlueZ <bluetooth/hci.h>
+ * which we don't want to depend on for this */
+#ifndef AF_BLUETOOTH
+#define AF_BLUETOOTH 31
+#endif
+#define BTPROTO_HCI			1
+#define SOL_HCI				0
+#define HCI_FILTER			2
+#define HCI_COMMAND_PKT		0x01
+#define HCI_EVENT_PKT		0x04
+#define EVT_CMD_COMPLETE	0x0e
+#define EVT_CMD_STATUS		0x0f
+#define EVT_NUM_COMP_PKTS	0x13
+#define LE_LINK				0x80
+#define HCIGETCONNINFO		_IOR('H', 213, int)
+
+#define HCI_OPCODE(ogf, ocf) ((ocf) | (ogf) << 10)
+#define OGF_INFO_PARAM			0x04
+#define OCF_READ_BUFFER_SIZE	0x0005
+#define OGF_LE_CTL				0x08
+#define OCF_LE_READ_BUFFER_SIZE	0x0002
+#define OCF_LE_CONN_UPDATE		0x0013
+#define OCF_LE_SET_DATA_LENGTH	0x0022
+#define OCF_LE_SET_PHY			0x0032
+
+#define HCI_TIMEOUT 1000 /* ms */
+
+struct sockaddr_hci {
+	sa_family_t hci_family;
+	unsigned short hci_dev;
+	unsigned short hci_channel;
+};
+
+struct hci_filter {
+	uint32_t type_mask;
+	uint32_t event_mask[2];
+	uint16_t opcode;
+};
+
+struct hci_conn_info {
+	uint16_t handle;
+	uint8_t bdaddr[6];
+	uint8_t type;
+	uint8_t out;
+	uint16_t state;
+	uint32_t link_mode;
+};
+
+struct hci_conn_info_req {
+	uint8_t bdaddr[6];
+	uint8_t type;
+	struct hci_conn_info conn_info[1];
+};
+
+/* read the UUID and MTU properties of a GattCharacteristic1, m is at the
+ * interfaces of an object. returns the MTU if it is the one with uuid */
+static uint16_t ble_param_char_mtu(sd_bus_message* m, const char* uuid)
+{
+	const char* iface;
+	const char* name;
+	const char* val;
+	uint16_t mtu = 0;
+	bool match = false;
+
+	sd_bus_message_enter_container(m, 'a', "{sa{sv}}");
+	while (sd_bus_message_enter_container(m, 'e', "sa{sv}") > 0) {
+		sd_bus_message_read(m, "s", &iface);
+		if (strcmp(iface, "org.bluez.GattCharacteristic1") != 0) {
+			sd_bus_message_skip(m, "a{sv}");
+		} else {
+			sd_bus_message_enter_container(m, 'a', "{sv}");
+			while (sd_bus_message_enter_container(m, 'e', "sv") > 0) {
+				sd_bus_message_read(m, "s", &name);
+				if (strcmp(name, "UUID") == 0) {
+					sd_bus_message_read(m, "v", "s", &val);
+					match = strcasecmp(val, uuid) == 0;
+				} else if (strcmp(name, "MTU") == 0) {
+					sd_bus_message_read(m, "v", "q", &mtu);
+				} else {
+					sd_bus_message_skip(m, "v");
+				}
+				sd_bus_message_exit_container(m);
+			}
+			sd_bus_message_exit_container(m);
+		}
+		sd_bus_message_exit_container(m);
+	}
+	sd_bus_message_exit_container(m);
+
+	return match ? mtu : 0;
+}
+
+/** the ATT MTU BlueZ negotiated for the characteristic with uuid of the
+ * connected device. Needs BlueZ 5.62 or later, returns 0 when unknown */
+uint16_t ble_param_att_mtu(const char* interface, const uint8_t addr[6],
+						   const char* uuid)
+{
+	sd_bus* bus = NULL;
+	sd_bus_message* reply = NULL;
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+	char dev_path[64];
+	uint16_t mtu = 0;
+
+	snprintf(dev_path, sizeof(dev_path),
+			 "/org/bluez/%s/dev_%02X_%02X_%02X_%02X_%02X_%02X/", interface,
+			 addr[5], addr[4], addr[3], addr[2], addr[1], addr[0]);
+
+	/* our own connection, the one of blzlib belongs to its context */
+	if (sd_bus_open_system(&bus) < 0) {
+		LOG_INF("Could not connect to system bus");
+		return 0;
+	}
+
+	int r = sd_bus_call_method(bus, "org.bluez", "/",
+							   "org.freedesktop.DBus.ObjectManager",
+							   "GetManagedObjects", &err, &reply, "");
+	if (r < 0) {
+		LOG_INF("Could not get BlueZ objects: %s", err.message);
+		goto exit;
+	}
+
+	r = sd_bus_message_enter_container(reply, 'a', "{oa{sa{sv}}}");
+	while (r > 0 && mtu == 0
+		   && sd_bus_message_enter_container(reply, 'e', "oa{sa{sv}}") > 0) {
+		const char* path;
+		sd_bus_message_read(reply, "o", &path);
+		if (strncmp(path, dev_path, strlen(dev_path)) == 0) {
+			mtu = ble_param_char_mtu(reply, uuid);
+		} else {
+			sd_bus_message_skip(reply, "a{sa{sv}}");
+		}
+		sd_bus_message_exit_container(reply);
+	}
+
+exit:
+	sd_bus_error_free(&err);
+	sd_bus_message_unref(reply);
+	sd_bus_flush_close_unref(bus);
+	return mtu;
+}
+
+/* open a raw HCI socket on interface which receives the given events and
+ * find the handle of the LE connection to addr. returns -1 on error */
+static int hci_open(const char* interface, const uint8_t addr[6],
+					uint32_t events, uint16_t* handle)
+{
+	struct hci_conn_info_req req = {.type = LE_LINK};
+	struct sockaddr_hci sa = {.hci_family = AF_BLUETOOTH};
+	struct hci_filter flt = {
+		.type_mask = 1 << HCI_EVENT_PKT,
+		.event_mask = {events, 0},
+	};
+
+	/* hciN */
+	if (strncmp(interface, "hci", 3) != 0) {
+		LOG_INF("Unknown HCI interface %s", interface);
+		return -1;
+	}
+	sa.hci_dev = atoi(interface + 3);
+
+	int sock = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+	if (sock < 0) {
+		LOG_INF("No HCI socket");
+		return -1;
+	}
+
+	memcpy(req.bdaddr, addr, 6);
+	if (bind(sock, (struct sockaddr*)&sa, sizeof(sa)) < 0
+		|| setsockopt(sock, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0
+		|| ioctl(sock, HCIGETCONNINFO, &req) < 0) {
+		LOG_INF("Connection not found on HCI");
+		close(sock);
+		return -1;
+	}
+
+	*handle = req.conn_info[0].handle;
+	return sock;
+}
+
+/* send a controller command and wait for its status. The returned
+ * parameters after the status are copied to ret. returns the HCI status
+ * code, 0 is success, or -1 on error */
+static int hci_cmd(int sock, uint16_t opcode, const uint8_t* param,
+				   uint8_t len, uint8_t* ret, size_t ret_len)
+{
+	uint8_t buf[260] = {HCI_COMMAND_PKT, opcode & 0xff, opcode >> 8, len};
+
+	memcpy(buf + 4, param, len);
+	if (write(sock, buf, len + 4) != len + 4) {
+		return -1;
+	}
+
+	struct pollfd pfd = {.fd = sock, .events = POLLIN};
+	while (poll(&pfd, 1, HCI_TIMEOUT) > 0) {
+		ssize_t n = read(sock, buf, sizeof(buf));
+		if (n < 7 || buf[0] != HCI_EVENT_PKT) {
+			continue;
+		}
+		if (buf[1] == EVT_CMD_STATUS && (buf[5] | buf[6] << 8) == opcode) {
+			return buf[3];
+		}
+		if (buf[1] == EVT_CMD_COMPLETE && (buf[4] | buf[5] << 8) == opcode) {
+			if (ret != NULL) {
+				memset(ret, 0, ret_len);
+				memcpy(ret, buf + 7, MIN(ret_len, (size_t)n - 7));
+			}
+			return buf[6];
+		}
+	}
+	return -1;
+}
+
+static int hci_le_cmd(int sock, uint16_t ocf, const uint8_t* param,
+					  uint8_t len)
+{
+	return hci_cmd(sock, HCI_OPCODE(OGF_LE_CTL, ocf), param, len, NULL, 0);
+}
+
+static void hci_le_report(const char* what, int status)
+{
+	if (status == 0) {
+		LOG_INF("Requested %s", what);
+	} else if (status < 0) {
+		LOG_INF("Could not request %s", what);
+	} else {
+		LOG_INF("Controller rejected %s (0x%02x)", what, status);
+	}
+}
+
+/** ask the controller for LE Data Length Extension, the 2M PHY and, if
+ * interval is not 0, for that connection interval (in 1.25 ms units).
+ * These are only requests which the controller or the device may reject,
+ * so failures are not errors */
+void ble_param_tune(const char* interface, const uint8_t addr[6],
+					int interval)
+{
+	uint16_t h;
+	int sock = hci_open(interface, addr,
+						1 << EVT_CMD_COMPLETE | 1 << EVT_CMD_STATUS, &h);
+	if (sock < 0) {
+		LOG_INF("Not tuning connection");
+		return;
+	}
+
+	/* 251 bytes in 2120 us, the maximum for the 1M PHY */
+	uint8_t dle[] = {h & 0xff, h >> 8, 251, 0, 0x48, 0x08};
+	hci_le_report("data length extension",
+				  hci_le_cmd(sock, OCF_LE_SET_DATA_LENGTH, dle, sizeof(dle)));
+
+	/* all_phys 0: TX and RX preference given, 2M only */
+	uint8_t phy[] = {h & 0xff, h >> 8, 0, 0x02, 0x02, 0, 0};
+	hci_le_report("2M PHY", hci_le_cmd(sock, OCF_LE_SET_PHY, phy, sizeof(phy)));
+
+	if (interval > 0) {
+		/* supervision timeout in 10 ms units, at least 4s and more than
+		 * three intervals */
+		int to = MIN(3200, MAX(400, interval * 3 / 8 + 1));
+		uint8_t cu[] = {h & 0xff, h >> 8, interval & 0xff, interval >> 8,
+						interval & 0xff, interval >> 8, 0, 0, to & 0xff,
+						to >> 8, 0, 0, 0, 0};
+		hci_le_report("connection interval",
+					  hci_le_cmd(sock, OCF_LE_CONN_UPDATE, cu, sizeof(cu)));
+	}
+
+	close(sock);
+}
+
+/** start watching the Number Of Completed Packets events of the
+ * connection to addr and find the size and number of the ACL buffers of
+ * the controller. Without this there is no TX flow control */
+bool ble_param_tx_open(struct ble_tx_mon* m, const char* interface,
+					   const uint8_t addr[6])
+{
+	uint8_t ret[5];
+
+	m->sock = hci_open(interface, addr, 1 << EVT_CMD_COMPLETE, &m->handle);
+	if (m->sock < 0) {
+		return false;
+	}
+
+	/* LE buffers, if the controller has none it uses the ACL buffers */
+	if (hci_cmd(m->sock, HCI_OPCODE(OGF_LE_CTL, OCF_LE_READ_BUFFER_SIZE),
+				NULL, 0, ret, 3)
+		== 0) {
+		m->frag = ret[0] | ret[1] << 8;
+		m->bufs = ret[2];
+	}
+	if (m->frag == 0
+		&& hci_cmd(m->sock, HCI_OPCODE(OGF_INFO_PARAM, OCF_READ_BUFFER_SIZE),
+				   NULL, 0, ret, 5)
+			   == 0) {
+		m->frag = ret[0] | ret[1] << 8;
+		m->bufs = ret[3] | ret[4] << 8;
+	}
+
+	struct hci_filter flt = {
+		.type_mask = 1 << HCI_EVENT_PKT,
+		.event_mask = {1 << EVT_NUM_COMP_PKTS, 0},
+	};
+	if (m->frag == 0 || m->bufs == 0
+		|| setsockopt(m->sock, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0) {
+		LOG_INF("Could not get HCI buffer size");
+		ble_param_tx_close(m);
+		return false;
+	}
+
+	LOG_INF("HCI handle %d, %d buffers of %d bytes", m->handle, m->bufs,
+			m->frag);
+	return true;
+}
+
+/** wait up to timeout ms for the controller to complete packets of our
+ * connection. returns their number, 0 on timeout or -1 on error */
+int ble_param_tx_completed(struct ble_tx_mon* m, int timeout)
+{
+	uint8_t buf[260];
+	struct pollfd pfd = {.fd = m->sock, .events = POLLIN};
+	int done = 0;
+
+	while (done == 0) {
+		int r = poll(&pfd, 1, timeout);
+		if (r <= 0) {
+			return r;
+		}
+
+		ssize_t n = read(m->sock, buf, sizeof(buf));
+		if (n < 4) {
+			return -1;
+		}
+		if (buf[0] != HCI_EVENT_PKT || buf[1] != EVT_NUM_COMP_PKTS) {
+			continue;
+		}
+
+		/* pairs of handle and count */
+		for (int i = 0; i < buf[3] && 4 + i * 4 + 4 <= n; i++) {
+			uint8_t* p = buf + 4 + i * 4;
+			if (((p[0] | p[1] << 8) & 0x0fff) == m->handle) {
+				done += p[2] | p[3] << 8;
+			}
+		}
+	}
+	return done;
+}
+
+void ble_param_tx_close(struct ble_tx_mon* m)
+{
+	if (m->sock >= 0) {
+		close(m->sock);
+	}
+	m->sock = -1;
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2020 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLE_PARAM_H
+#define BLE_PARAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* bytes of a Write Command used by the ATT header */
+#define BLE_ATT_WRITE_HDR 3
+
+/* addr is in the order of blz_string_to_mac(): least significant byte
+ * first, like the HCI address */
+uint16_t ble_param_att_mtu(const char* interface, const uint8_t addr[6],
+						   const char* uuid);
+void ble_param_tune(const char* interface, const uint8_t addr[6],
+					int interval);
+
+/* Link layer TX flow of a connection: the controller reports when it has
+ * sent our ACL packets, so we know how many it still holds */
+struct ble_tx_mon {
+	int sock;
+	uint16_t handle;
+	uint16_t frag; /* size of the ACL buffers of the controller */
+	uint16_t bufs; /* number of ACL buffers */
+};
+
+bool ble_param_tx_open(struct ble_tx_mon* m, const char* interface,
+					   const uint8_t addr[6]);
+int ble_param_tx_completed(struct ble_tx_mon* m, int timeout);
+void ble_param_tx_close(struct ble_tx_mon* m);
+
+#endif
@@ -0,0 +1,553 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <json-c/json.h>
+
+#include "campaign.h"
+#include "conf.h"
+#include "dfu.h"
+#include "dfu_ble.h"
+#include "log.h"
+#include "package.h"
+#include "stats.h"
+#include "util.h"
+
+#define CAMPAIGN_ADAPTERS 8	   /* BLE interfaces */
+#define CAMPAIGN_BLE_MAX  3	   /* sessions per interface by default */
+#define CAMPAIGN_RETRIES  1	   /* queuing a failed device again by default */
+#define CAMPAIGN_SCAN_MS  3000 /* listening for the devices on each interface */
+#define CAMPAIGN_POLL_MS  100
+#define CAMPAIGN_NO_RSSI  INT_MIN
+
+enum job_state { JOB_QUEUED, JOB_RUNNING, JOB_OK, JOB_FAILED };
+
+/* a package, loaded once for all devices which get it */
+struct camp_pkg {
+	struct camp_pkg* next;
+	char* path;
+	struct dfu_package pkg;
+};
+
+/* a BLE interface, its config differs from the others only by the name */
+struct camp_adapter {
+	struct dfu_config conf;
+	int max;
+	int running;
+};
+
+struct camp_job {
+	struct dfu_session s;
+	const char* target;
+	struct camp_pkg* cp;
+	struct camp_adapter* ad; /* the session runs on, NULL for serial */
+	bool ble;
+	int rssi[CAMPAIGN_ADAPTERS]; /* as heard on each adapter */
+	int tries;
+	bool started;
+	pthread_t thread;
+	atomic_int state;
+};
+
+static json_object* root; /* the campaign, the strings point into it */
+static struct camp_job* jobs;
+static int num_jobs;
+static struct camp_pkg* pkgs;
+static struct camp_adapter adapters[CAMPAIGN_ADAPTERS];
+static int num_adapters;
+static struct dfu_config ser_conf;
+static int ser_max;
+static int ser_running;
+static int retries;
+
+/* jobs waiting to be started, in order. Each is in it at most once */
+static int* queue;
+static int queue_head;
+static int queue_len;
+
+static volatile sig_atomic_t stop;
+
+static void campaign_signal(__attribute__((unused)) int signo)
+{
+	stop = 1;
+}
+
+static const char* json_str(json_object* obj, const char* key)
+{
+	json_object* val;
+	if (!json_object_object_get_ex(obj, key, &val)) {
+		return NULL;
+	}
+	return json_object_get_string(val);
+}
+
+static int json_int(json_object* obj, const char* key, int def)
+{
+	json_object* val;
+	if (!json_object_object_get_ex(obj, key, &val)) {
+		return def;
+	}
+	return json_object_get_int(val);
+}
+
+static bool is_ble_addr(const char* target)
+{
+	unsigned int b[6];
+	char c;
+
+	return sscanf(target, "%2x:%2x:%2x:%2x:%2x:%2x%c", &b[0], &b[1], &b[2],
+				  &b[3], &b[4], &b[5], &c)
+		   == 6;
+}
+
+static void queue_push(int idx)
+{
+	queue[(queue_head + queue_len++) % num_jobs] = idx;
+}
+
+static int queue_pop(void)
+{
+	int idx = queue[queue_head];
+	queue_head = (queue_head + 1) % num_jobs;
+	queue_len--;
+	return idx;
+}
+
+/* the package at path, each file is only loaded once */
+static struct camp_pkg* pkg_get(const char* path)
+{
+	char real[PATH_MAX];
+	struct camp_pkg* cp;
+
+	if (realpath(path, real) == NULL) {
+		LOG_ERR("Could not find package '%s'", path);
+		return NULL;
+	}
+	for (cp = pkgs; cp != NULL; cp = cp->next) {
+		if (strcmp(cp->path, real) == 0) {
+			return cp;
+		}
+	}
+
+	cp = calloc(1, sizeof(*cp));
+	if (cp == NULL) {
+		return NULL;
+	}
+	LOG_INF("DFU Package: %s", real);
+	if (!package_load(&cp->pkg, real, true)) {
+		package_free(&cp->pkg);
+		free(cp);
+		return NULL;
+	}
+	cp->path = strdup(real);
+	cp->next = pkgs;
+	pkgs = cp;
+	return cp;
+}
+
+static void pkgs_free(void)
+{
+	while (pkgs != NULL) {
+		struct camp_pkg* cp = pkgs;
+		pkgs = cp->next;
+		package_free(&cp->pkg);
+		free(cp->path);
+		free(cp);
+	}
+}
+
+/* the BLE interfaces, or the one of the command line */
+static bool adapters_load(json_object* list, const struct dfu_config* conf)
+{
+	size_t n = list != NULL ? json_object_array_length(list) : 0;
+
+	if (n > CAMPAIGN_ADAPTERS) {
+		LOG_ERR("More than %d BLE interfaces", CAMPAIGN_ADAPTERS);
+		return false;
+	}
+
+	for (size_t i = 0; i < MAX(n, 1); i++) {
+		json_object* a = n > 0 ? json_object_array_get_idx(list, i) : NULL;
+		struct camp_adapter* ad = &adapters[num_adapters++];
+		ad->conf = *conf;
+		ad->conf.dfu_type = DFU_BLE;
+		ad->max = CAMPAIGN_BLE_MAX;
+		if (a == NULL) {
+			continue;
+		}
+
+		const char* intf = json_str(a, "interface");
+		if (intf == NULL) {
+			LOG_ERR("BLE interface %zu has no name", i);
+			return false;
+		}
+		ad->conf.interface = (char*)intf;
+		ad->max = json_int(a, "max", CAMPAIGN_BLE_MAX);
+		if (ad->max <= 0) {
+			LOG_ERR("Sessions on %s must be positive", intf);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool jobs_load(json_object* list)
+{
+	size_t n = list != NULL ? json_object_array_length(list) : 0;
+
+	if (n == 0) {
+		LOG_ERR("No devices in the campaign");
+		return false;
+	}
+
+	jobs = calloc(n, sizeof(*jobs));
+	queue = calloc(n, sizeof(*queue));
+	if (jobs == NULL || queue == NULL) {
+		LOG_ERR("Could not allocate %zu devices", n);
+		return false;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		json_object* d = json_object_array_get_idx(list, i);
+		const char* target = json_str(d, "target");
+		const char* path = json_str(d, "package");
+		if (target == NULL || path == NULL) {
+			LOG_ERR("Device %zu needs target and package", i);
+			return false;
+		}
+		for (int k = 0; k < num_jobs; k++) {
+			if (strcmp(jobs[k].target, target) == 0) {
+				LOG_ERR("%s is listed twice", target);
+				return false;
+			}
+		}
+
+		struct camp_job* j = &jobs[num_jobs];
+		j->target = target;
+		j->ble = is_ble_addr(target);
+#ifndef BLE_SUPPORT
+		if (j->ble) {
+			LOG_ERR("BLE Support is not compiled in, for %s", target);
+			return false;
+		}
+#endif
+		j->cp = pkg_get(path);
+		if (j->cp == NULL) {
+			return false;
+		}
+		for (int a = 0; a < CAMPAIGN_ADAPTERS; a++) {
+			j->rssi[a] = CAMPAIGN_NO_RSSI;
+		}
+		queue_push(num_jobs++);
+	}
+	return true;
+}
+
+static void survey_seen(const char* addr, int rssi, void* user)
+{
+	int a = (struct camp_adapter*)user - adapters;
+
+	for (int i = 0; i < num_jobs; i++) {
+		if (jobs[i].ble && strcasecmp(jobs[i].target, addr) == 0) {
+			jobs[i].rssi[a] = MAX(jobs[i].rssi[a], rssi);
+		}
+	}
+}
+
+/* with several BLE interfaces, find out how well each of them hears each
+ * device, before any session runs */
+static void survey(void)
+{
+	int ble = 0;
+
+	for (int i = 0; i < num_jobs; i++) {
+		ble += jobs[i].ble;
+	}
+	if (ble == 0 || num_adapters < 2) {
+		return;
+	}
+
+	LOG_NOTI("Listening for %d BLE devices on %d interfaces", ble,
+			 num_adapters);
+	for (int a = 0; a < num_adapters; a++) {
+		ble_scan(adapters[a].conf.interface, CAMPAIGN_SCAN_MS, survey_seen,
+				 &adapters[a]);
+	}
+
+	for (int i = 0; i < num_jobs; i++) {
+		struct camp_job* j = &jobs[i];
+		for (int a = 0; a < num_adapters && j->ble; a++) {
+			if (j->rssi[a] != CAMPAIGN_NO_RSSI) {
+				LOG_INF("%s: RSSI %d on %s", j->target, j->rssi[a],
+						adapters[a].conf.interface);
+			}
+		}
+	}
+}
+
+/* the free adapter which hears the device best. Adapters which did not
+ * hear it are only used when none did */
+static struct camp_adapter* adapter_pick(const struct camp_job* j)
+{
+	struct camp_adapter* best = NULL;
+	int best_rssi = CAMPAIGN_NO_RSSI;
+	bool heard = false;
+
+	for (int a = 0; a < num_adapters; a++) {
+		heard |= j->rssi[a] != CAMPAIGN_NO_RSSI;
+		if (adapters[a].running < adapters[a].max
+			&& (best == NULL || j->rssi[a] > best_rssi)) {
+			best = &adapters[a];
+			best_rssi = j->rssi[a];
+		}
+	}
+	if (heard && best_rssi == CAMPAIGN_NO_RSSI) {
+		return NULL; // wait for one which hears it
+	}
+	return best;
+}
+
+static void* job_run(void* arg)
+{
+	struct camp_job* j = arg;
+
+	log_set_prefix(j->target);
+	j->s.stats.start_us = stats_now_us();
+	bool ok = dfu_flash(&j->s, &j->cp->pkg);
+	j->s.stats.end_us = stats_now_us();
+
+	dfu_session_fini(&j->s);
+	atomic_store(&j->state, ok ? JOB_OK : JOB_FAILED);
+	return NULL;
+}
+
+/* start the session if there is a free slot for it, false if it has to
+ * wait */
+static bool job_start(struct camp_job* j)
+{
+	const struct dfu_config* c = &ser_conf;
+
+	if (j->ble) {
+		j->ad = adapter_pick(j);
+		if (j->ad == NULL) {
+			return false;
+		}
+		c = &j->ad->conf;
+	} else if (ser_max > 0 && ser_running >= ser_max) {
+		return false;
+	}
+
+	/* only the statistics of the last try are kept */
+	stats_free(&j->s.stats);
+	dfu_session_init(&j->s, j->target, c);
+	j->tries++;
+	atomic_store(&j->state, JOB_RUNNING);
+	if (pthread_create(&j->thread, NULL, job_run, j) != 0) {
+		LOG_ERR("Could not start session for %s", j->target);
+		atomic_store(&j->state, JOB_FAILED);
+		return true;
+	}
+
+	j->started = true;
+	if (j->ad != NULL) {
+		j->ad->running++;
+	} else {
+		ser_running++;
+	}
+	return true;
+}
+
+/* collect the sessions which ended and queue failed devices again,
+ * returns the number still running */
+static int jobs_reap(void)
+{
+	int running = 0;
+
+	for (int i = 0; i < num_jobs; i++) {
+		struct camp_job* j = &jobs[i];
+		if (!j->started) {
+			continue;
+		}
+		int state = atomic_load(&j->state);
+		if (state == JOB_RUNNING) {
+			running++;
+			continue;
+		}
+
+		pthread_join(j->thread, NULL);
+		j->started = false;
+		if (j->ad != NULL) {
+			j->ad->running--;
+		} else {
+			ser_running--;
+		}
+
+		if (state == JOB_FAILED && !stop && j->tries <= retries) {
+			LOG_INF("%s failed, queuing it again (%d of %d)", j->target,
+					j->tries, retries);
+			atomic_store(&j->state, JOB_QUEUED);
+			queue_push(i);
+		}
+	}
+	return running;
+}
+
+static void campaign_progress(void)
+{
+	int running = 0;
+	int ok = 0;
+	int failed = 0;
+
+	for (int i = 0; i < num_jobs; i++) {
+		int state = atomic_load(&jobs[i].state);
+		running += state == JOB_RUNNING;
+		ok += state == JOB_OK;
+		failed += state == JOB_FAILED;
+	}
+	LOG_NOTI_("\rCampaign: %d running, %d queued, %d done, %d failed ",
+			  running, queue_len, ok, failed);
+}
+
+/* start what fits in the order of the queue, until all ended */
+static void campaign_schedule(void)
+{
+	while (jobs_reap() > 0 || (queue_len > 0 && !stop)) {
+		for (int n = queue_len; n > 0 && !stop; n--) {
+			int idx = queue_pop();
+			if (!job_start(&jobs[idx])) {
+				queue_push(idx);
+			}
+		}
+		if (stop) {
+			for (int i = 0; i < num_jobs; i++) {
+				jobs[i].s.terminate = true;
+			}
+		}
+		campaign_progress();
+		usleep(CAMPAIGN_POLL_MS * 1000);
+	}
+	campaign_progress();
+	LOG_NL(LL_NOTICE);
+}
+
+/* statistics of the last try of each device which was started */
+static void campaign_stats_json(const char* file, const char* path)
+{
+	json_object* devs = json_object_new_array();
+	for (int i = 0; i < num_jobs; i++) {
+		struct camp_job* j = &jobs[i];
+		if (j->tries == 0) {
+			continue;
+		}
+		json_object* dev = stats_json(&j->s, j->state == JOB_OK);
+		json_object_object_add(dev, "package",
+							   json_object_new_string(j->cp->path));
+		json_object_object_add(dev, "attempts", json_object_new_int(j->tries));
+		json_object_array_add(devs, dev);
+	}
+
+	json_object* json = json_object_new_object();
+	json_object_object_add(json, "campaign", json_object_new_string(path));
+	json_object_object_add(json, "devices", devs);
+
+	if (json_object_to_file_ext(file, json, JSON_C_TO_STRING_PRETTY) < 0) {
+		LOG_ERR("Could not write statistics to '%s'", file);
+	}
+	json_object_put(json);
+}
+
+static void campaign_free(void)
+{
+	ble_ctx_fini();
+	for (int i = 0; i < num_jobs; i++) {
+		stats_free(&jobs[i].s.stats);
+	}
+	free(jobs);
+	free(queue);
+	jobs = NULL;
+	queue = NULL;
+	num_jobs = queue_head = queue_len = num_adapters = 0;
+	pkgs_free();
+	json_object_put(root);
+	root = NULL;
+}
+
+bool campaign_run(const char* path, const struct dfu_config* conf)
+{
+	json_object* val;
+	int ok = 0;
+
+	root = json_object_from_file(path);
+	if (root == NULL) {
+		LOG_ERR("Could not read campaign '%s'", path);
+		return false;
+	}
+
+	ser_conf = *conf;
+	ser_conf.dfu_type = DFU_SERIAL;
+	ser_max = json_int(root, "serial_max", 0);
+	retries = json_int(root, "retries", CAMPAIGN_RETRIES);
+
+	if (!json_object_object_get_ex(root, "adapters", &val)) {
+		val = NULL;
+	}
+	bool loaded = adapters_load(val, conf);
+	if (!json_object_object_get_ex(root, "devices", &val)) {
+		val = NULL;
+	}
+	if (!loaded || !jobs_load(val)) {
+		campaign_free();
+		return false;
+	}
+
+	struct sigaction act = {.sa_handler = campaign_signal};
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+
+	survey();
+	LOG_NOTI("Updating %d devices:", num_jobs);
+	campaign_schedule();
+
+	for (int i = 0; i < num_jobs; i++) {
+		struct camp_job* j = &jobs[i];
+		bool success = atomic_load(&j->state) == JOB_OK;
+		LOG_NOTI("%s: %s%s", j->target, success ? "OK" : "FAILED",
+				 j->tries == 0 ? " (not started)" : "");
+		ok += success;
+	}
+	LOG_NOTI("%d of %d devices updated", ok, num_jobs);
+	bool ret = ok == num_jobs;
+
+	if (conf->stats_json) {
+		campaign_stats_json(conf->stats_json, path);
+	}
+	campaign_free();
+	return ret;
+}
@@ -0,0 +1,50 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAMPAIGN_H
+#define CAMPAIGN_H
+
+#include <stdbool.h>
+
+#include "conf.h"
+
+/*
+ * Campaign mode: the devices of a fleet are listed in a JSON file, with
+ * their serial port or BLE address and package, e.g.
+ *
+ *	{
+ *		"adapters": [{"interface": "hci0", "max": 3},
+ *					 {"interface": "hci1", "max": 3}],
+ *		"serial_max": 8,
+ *		"retries": 1,
+ *		"devices": [
+ *			{"target": "/dev/ttyUSB0", "package": "app.zip"},
+ *			{"target": "00:11:22:33:44:55", "package": "app.zip"}
+ *		]
+ *	}
+ *
+ * and flashed in parallel over all transports, at most "max" sessions on
+ * each BLE interface and "serial_max" serial ports at once (0 = all). BLE
+ * devices are flashed through the interface which hears them best. Failed
+ * devices are queued again up to "retries" times. Each package is loaded
+ * once for all devices.
+ */
+bool campaign_run(const char* path, const struct dfu_config* conf);
+
+#endif
@@ -27,14 +27,30 @@
 
 enum DFU_TYPE { DFU_SERIAL, DFU_BLE };
 
+/* how the serial port and its driver are set up, see ser_profiles */
+enum SER_PROFILE {
+	SER_PROF_AUTO,
+	SER_PROF_PLAIN,
+	SER_PROF_LOWLAT,
+	SER_PROF_HWFC
+};
+
 /* same as enum blz_addr_type */
 enum BLE_ATYPE { BAT_UNKNOWN, BAT_PUBLIC, BAT_RANDOM };
 
-struct config {
-	int loglevel;
+/* Options of the update, the library reads them through the session. The
+ * serial port, BLE address, ZIP or raw files and the rest are only for
+ * main.c */
+struct dfu_config {
 	char* serport;
 	int serspeed;
+	int dfuspeed; /* 0 = auto probe */
+	enum SER_PROFILE ser_profile;
 	char* zipfile;
+	char* raw_init; /* .dat and .bin files instead of the ZIP file */
+	char* raw_bin;
+	char* raw_sd_init;
+	char* raw_sd_bin;
 	char* dfucmd;
 	bool dfucmd_hex;
 	int timeout;
@@ -42,8 +58,22 @@ struct config {
 	char* interface;
 	char* ble_addr;
 	enum BLE_ATYPE ble_atype;
+	int ble_interval;	 /* in 1.25 ms units, 0 = don't change */
+	int ble_window;		 /* writes in flight, 0 = controller buffers */
+	int dfutarg_timeout; /* in seconds */
+	int prn;
+	int object_retries;	 /* sending a failed object again */
+	int op_timeout_ms;	 /* for responses, 0 = default of the transport */
+	int exec_timeout_ms; /* create and execute, per KiB of the object */
+	int deadline;		 /* of the whole update in seconds, 0 = none */
+	bool slip_pack;
+	bool resume_stats;
+	bool skip_current; /* don't update images which are installed */
+	char* stats_json; /* file for statistics */
+	char* daemon;	  /* socket to accept jobs on */
+	char* campaign;	  /* JSON file with the devices to update */
+	char* trace;	  /* file for the binary trace */
+	int low_mem;	  /* arena for all buffers in KiB, 0 = off */
 };
 
-extern struct config conf;
-
 #endif
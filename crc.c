@@ -0,0 +1,204 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "crc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC_PCLMUL
+#endif
+
+#if defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define CRC_ARMV8
+#endif
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const uint8_t* data, size_t len);
+
+static crc_fn crc_impl;
+static const char* crc_name;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_zlib(uint32_t crc, const uint8_t* data, size_t len)
+{
+	return crc32(crc, data, len);
+}
+
+#ifdef CRC_PCLMUL
+/* shorter data is not worth the setup, the rest of it goes to zlib */
+#define CRC_PCLMUL_MIN 64
+
+/*
+ * Folding 64 bytes at a time with carry-less multiplication, as described
+ * in "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction" by Intel. len is at least 64 and a multiple of 16, crc is
+ * not inverted.
+ */
+__attribute__((target("pclmul,sse4.1"))) static uint32_t
+crc_pclmul_fold(uint32_t crc, const uint8_t* buf, size_t len)
+{
+	/* constants of the paper for the reflected polynomial */
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	buf += 64;
+	len -= 64;
+
+	/* fold four blocks of 16 in parallel */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+						   _mm_loadu_si128((const __m128i*)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+						   _mm_loadu_si128((const __m128i*)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+						   _mm_loadu_si128((const __m128i*)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+						   _mm_loadu_si128((const __m128i*)(buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	/* into one block */
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* remaining blocks of 16 */
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+						   _mm_loadu_si128((const __m128i*)buf));
+		buf += 16;
+		len -= 16;
+	}
+
+	/* 128 to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), poly, 0x10);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc_pclmul(uint32_t crc, const uint8_t* data, size_t len)
+{
+	if (len >= CRC_PCLMUL_MIN) {
+		size_t n = len & ~(size_t)15;
+		crc = ~crc_pclmul_fold(~crc, data, n);
+		data += n;
+		len -= n;
+	}
+	return crc_zlib(crc, data, len);
+}
+#endif
+
+#ifdef CRC_ARMV8
+__attribute__((target("+crc"))) static uint32_t
+crc_armv8(uint32_t crc, const uint8_t* data, size_t len)
+{
+	uint64_t v;
+
+	crc = ~crc;
+	while (len > 0 && ((uintptr_t)data & 7)) {
+		crc = __crc32b(crc, *data++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, data, sizeof(v));
+		crc = __crc32d(crc, v);
+		data += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc = __crc32b(crc, *data++);
+		len--;
+	}
+	return ~crc;
+}
+#endif
+
+static void crc_select(void)
+{
+	crc_impl = crc_zlib;
+	crc_name = "zlib";
+
+#ifdef CRC_PCLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+		crc_impl = crc_pclmul;
+		crc_name = "pclmul";
+	}
+#endif
+#ifdef CRC_ARMV8
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		crc_impl = crc_armv8;
+		crc_name = "armv8";
+	}
+#endif
+}
+
+uint32_t crc_update(uint32_t crc, const uint8_t* data, size_t len)
+{
+	pthread_once(&crc_once, crc_select);
+	return crc_impl(crc, data, len);
+}
+
+const char* crc_backend(void)
+{
+	pthread_once(&crc_once, crc_select);
+	return crc_name;
+}
@@ -0,0 +1,36 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32 as zlib crc32() computes it, using the CRC32 instructions of ARMv8
+ * or carry-less multiplication (PCLMULQDQ) on x86 when the CPU has them,
+ * and zlib otherwise. The backend is chosen on the first call.
+ */
+
+uint32_t crc_update(uint32_t crc, const uint8_t* data, size_t len);
+
+const char* crc_backend(void);
+
+#endif
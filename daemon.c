@@ -0,0 +1,514 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <json-c/json.h>
+
+#include "conf.h"
+#include "daemon.h"
+#include "dfu.h"
+#include "log.h"
+#include "package.h"
+#include "sha256.h"
+#include "stats.h"
+#include "util.h"
+
+#define DAEMON_CACHE	   8   /* packages kept in memory */
+#define DAEMON_PROGRESS_MS 500 /* between progress events */
+#define DAEMON_LINE		   1024
+
+/* a decoded package, users are the jobs flashing it */
+struct cache_entry {
+	struct cache_entry* next;
+	uint8_t hash[SHA256_LEN]; /* of the package file */
+	uint64_t used;
+	int users;
+	struct dfu_package pkg;
+};
+
+struct job {
+	struct job* next;
+	struct dfu_session s;
+	struct cache_entry* ce;
+	char* target;
+	pthread_t thread;
+	bool ok;
+};
+
+static struct cache_entry* cache;
+static int cache_num;
+static uint64_t cache_tick;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct job* jobs;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct dfu_config* conf;
+static volatile sig_atomic_t stop;
+
+static void daemon_signal(__attribute__((unused)) int signo)
+{
+	stop = 1;
+}
+
+/* all of the package file, to be freed */
+static uint8_t* file_read(const char* path, size_t* len)
+{
+	struct stat st;
+	ssize_t n = -1;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	/* the size is only a hint, one more byte to see the end at once */
+	size_t size = fstat(fd, &st) == 0 ? st.st_size + 1 : 16384;
+	uint8_t* buf = malloc(size);
+
+	*len = 0;
+	while (buf != NULL && (n = read(fd, buf + *len, size - *len)) != 0) {
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			break;
+		}
+		*len += n;
+		if (*len == size) {
+			size *= 2;
+			uint8_t* b = realloc(buf, size);
+			if (b == NULL) {
+				break;
+			}
+			buf = b;
+		}
+	}
+	close(fd);
+
+	if (buf == NULL || n != 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static void cache_entry_free(struct cache_entry* ce)
+{
+	package_free(&ce->pkg);
+	free(ce);
+}
+
+/* drop the least recently used packages nobody is flashing */
+static void cache_evict(void)
+{
+	while (cache_num > DAEMON_CACHE) {
+		struct cache_entry** lru = NULL;
+		for (struct cache_entry** p = &cache; *p != NULL; p = &(*p)->next) {
+			if ((*p)->users == 0
+				&& (lru == NULL || (*p)->used < (*lru)->used)) {
+				lru = p;
+			}
+		}
+		if (lru == NULL) {
+			return;
+		}
+
+		struct cache_entry* ce = *lru;
+		*lru = ce->next;
+		cache_entry_free(ce);
+		cache_num--;
+	}
+}
+
+/* the cached package with this hash and one more user, called locked */
+static struct cache_entry* cache_find(const uint8_t* hash)
+{
+	for (struct cache_entry* ce = cache; ce != NULL; ce = ce->next) {
+		if (memcmp(ce->hash, hash, SHA256_LEN) == 0) {
+			ce->users++;
+			ce->used = ++cache_tick;
+			return ce;
+		}
+	}
+	return NULL;
+}
+
+/* the package at path, loaded only if it is not in the cache yet. It is
+ * decoded without the lock, so other jobs are not held up meanwhile */
+static struct cache_entry* cache_get(const char* path, bool* cached)
+{
+	struct cache_entry* ce;
+	uint8_t hash[SHA256_LEN];
+	size_t len;
+
+	/* the file is read once, so the package is decoded from the same
+	 * bytes which were hashed, even if the file changes meanwhile */
+	uint8_t* data = file_read(path, &len);
+	if (data == NULL) {
+		LOG_ERR("Could not read '%s'", path);
+		return NULL;
+	}
+	sha256(data, len, hash);
+
+	pthread_mutex_lock(&cache_lock);
+	ce = cache_find(hash);
+	pthread_mutex_unlock(&cache_lock);
+
+	*cached = ce != NULL;
+	if (ce != NULL) {
+		free(data);
+		return ce;
+	}
+
+	ce = calloc(1, sizeof(*ce));
+	if (ce != NULL && !package_load_mem(&ce->pkg, data, len)) {
+		cache_entry_free(ce);
+		ce = NULL;
+	}
+	free(data);
+	if (ce == NULL) {
+		return NULL;
+	}
+	memcpy(ce->hash, hash, sizeof(hash));
+
+	/* another job may have loaded the same package meanwhile */
+	pthread_mutex_lock(&cache_lock);
+	struct cache_entry* dup = cache_find(hash);
+	if (dup == NULL) {
+		ce->users = 1;
+		ce->used = ++cache_tick;
+		ce->next = cache;
+		cache = ce;
+		cache_num++;
+		cache_evict();
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	if (dup != NULL) {
+		cache_entry_free(ce);
+		*cached = true;
+		return dup;
+	}
+	return ce;
+}
+
+static void cache_put(struct cache_entry* ce)
+{
+	pthread_mutex_lock(&cache_lock);
+	ce->users--;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static void cache_free(void)
+{
+	while (cache != NULL) {
+		struct cache_entry* ce = cache;
+		cache = ce->next;
+		cache_entry_free(ce);
+	}
+	cache_num = 0;
+}
+
+/* write one event line, a client which went away does not stop the job */
+static void event_send(int fd, json_object* ev)
+{
+	const char* str =
+		json_object_to_json_string_ext(ev, JSON_C_TO_STRING_PLAIN);
+	struct iovec iov[2] = {{(void*)str, strlen(str)}, {"\n", 1}};
+	struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+		LOG_INF("Could not send event: %s", strerror(errno));
+	}
+	json_object_put(ev);
+}
+
+static json_object* event_new(const char* name, const char* target)
+{
+	json_object* ev = json_object_new_object();
+	json_object_object_add(ev, "event", json_object_new_string(name));
+	if (target != NULL) {
+		json_object_object_add(ev, "target", json_object_new_string(target));
+	}
+	return ev;
+}
+
+static void event_error(int fd, const char* target, const char* msg)
+{
+	json_object* ev = event_new("error", target);
+	json_object_object_add(ev, "message", json_object_new_string(msg));
+	event_send(fd, ev);
+}
+
+static void* job_run(void* arg)
+{
+	struct job* j = arg;
+
+	log_set_prefix(j->target);
+	j->s.stats.start_us = stats_now_us();
+	j->ok = dfu_flash(&j->s, &j->ce->pkg);
+	j->s.stats.end_us = stats_now_us();
+
+	dfu_session_fini(&j->s);
+	return NULL;
+}
+
+/* add the job unless its target is already being updated */
+static bool job_add(struct job* j)
+{
+	pthread_mutex_lock(&jobs_lock);
+	for (struct job* o = jobs; o != NULL; o = o->next) {
+		if (strcmp(o->target, j->target) == 0) {
+			pthread_mutex_unlock(&jobs_lock);
+			return false;
+		}
+	}
+	j->next = jobs;
+	jobs = j;
+	pthread_mutex_unlock(&jobs_lock);
+	return true;
+}
+
+static void job_remove(struct job* j)
+{
+	pthread_mutex_lock(&jobs_lock);
+	for (struct job** p = &jobs; *p != NULL; p = &(*p)->next) {
+		if (*p == j) {
+			*p = j->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&jobs_lock);
+}
+
+/* flash the device and report the progress until it is done */
+static void job_flash(int fd, struct job* j, bool cached)
+{
+	size_t total = package_size(&j->ce->pkg);
+	size_t last = SIZE_MAX;
+	struct timespec ts;
+
+	if (pthread_create(&j->thread, NULL, job_run, j) != 0) {
+		event_error(fd, j->target, "Could not start session");
+		return;
+	}
+
+	json_object* ev = event_new("start", j->target);
+	json_object_object_add(ev, "size", json_object_new_int64(total));
+	json_object_object_add(ev, "cached", json_object_new_boolean(cached));
+	event_send(fd, ev);
+
+	do {
+		size_t done = MIN(atomic_load(&j->s.progress), total);
+		if (done != last) {
+			ev = event_new("progress", j->target);
+			json_object_object_add(ev, "bytes", json_object_new_int64(done));
+			json_object_object_add(ev, "total", json_object_new_int64(total));
+			event_send(fd, ev);
+			last = done;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += DAEMON_PROGRESS_MS * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+	} while (pthread_timedjoin_np(j->thread, NULL, &ts) == ETIMEDOUT);
+
+	LOG_NOTI("%s: %s", j->target, j->ok ? "OK" : "FAILED");
+	ev = event_new("done", j->target);
+	json_object_object_add(ev, "ok", json_object_new_boolean(j->ok));
+	json_object_object_add(ev, "stats", stats_json(&j->s, j->ok));
+	event_send(fd, ev);
+}
+
+/* handle one request line:
+ * {"target": <serial port or BLE address>, "package": <ZIP file>} */
+static void job_request(int fd, const char* line)
+{
+	json_object* req = json_tokener_parse(line);
+	json_object* jtarget;
+	json_object* jpkg;
+	bool cached;
+
+	if (req == NULL || !json_object_object_get_ex(req, "target", &jtarget)
+		|| !json_object_object_get_ex(req, "package", &jpkg)) {
+		event_error(fd, NULL, "Need target and package");
+		json_object_put(req);
+		return;
+	}
+
+	struct job* j = calloc(1, sizeof(*j));
+	if (j == NULL) {
+		event_error(fd, NULL, "Out of memory");
+		json_object_put(req);
+		return;
+	}
+	j->target = strdup(json_object_get_string(jtarget));
+	dfu_session_init(&j->s, j->target, conf);
+
+	if (stop) {
+		event_error(fd, j->target, "Shutting down");
+	} else if (!job_add(j)) {
+		event_error(fd, j->target, "Target is busy");
+	} else {
+		LOG_NOTI("Job for %s: %s", j->target, json_object_get_string(jpkg));
+		j->ce = cache_get(json_object_get_string(jpkg), &cached);
+		if (j->ce == NULL) {
+			event_error(fd, j->target, "Could not load package");
+		} else {
+			job_flash(fd, j, cached);
+			cache_put(j->ce);
+		}
+		job_remove(j);
+	}
+
+	json_object_put(req);
+	stats_free(&j->s.stats);
+	free(j->target);
+	free(j);
+}
+
+/* one client connection, its requests are run one after another */
+static void* conn_run(void* arg)
+{
+	int fd = (intptr_t)arg;
+	char buf[DAEMON_LINE];
+	size_t len = 0;
+	ssize_t n;
+
+	while ((n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+		len += n;
+		buf[len] = '\0';
+
+		char* line = buf;
+		char* end;
+		while ((end = strchr(line, '\n')) != NULL) {
+			*end = '\0';
+			if (end > line) {
+				job_request(fd, line);
+			}
+			line = end + 1;
+		}
+
+		len -= line - buf;
+		memmove(buf, line, len);
+		if (len == sizeof(buf) - 1) {
+			event_error(fd, NULL, "Request too long");
+			break;
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static void jobs_stop(void)
+{
+	pthread_mutex_lock(&jobs_lock);
+	for (struct job* j = jobs; j != NULL; j = j->next) {
+		j->s.terminate = true;
+	}
+	pthread_mutex_unlock(&jobs_lock);
+
+	/* the connections remove their jobs when the sessions ended */
+	for (;;) {
+		pthread_mutex_lock(&jobs_lock);
+		bool empty = jobs == NULL;
+		pthread_mutex_unlock(&jobs_lock);
+		if (empty) {
+			break;
+		}
+		usleep(100000);
+	}
+}
+
+bool daemon_run(const char* path, const struct dfu_config* cfg)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		LOG_ERR("Socket path '%s' too long", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+	conf = cfg;
+
+	int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lfd < 0) {
+		LOG_ERR("Could not create socket: %s", strerror(errno));
+		return false;
+	}
+
+	unlink(path);
+	if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+		|| listen(lfd, SOMAXCONN) < 0) {
+		LOG_ERR("Could not listen on '%s': %s", path, strerror(errno));
+		close(lfd);
+		return false;
+	}
+
+	struct sigaction act = {.sa_handler = daemon_signal};
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	LOG_NOTI("Waiting for jobs on %s", path);
+	while (!stop) {
+		struct pollfd pfd = {.fd = lfd, .events = POLLIN};
+		if (poll(&pfd, 1, DAEMON_PROGRESS_MS) <= 0) {
+			continue;
+		}
+
+		int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		if (pthread_create(&thread, &attr, conn_run, (void*)(intptr_t)fd)
+			!= 0) {
+			LOG_ERR("Could not start connection");
+			close(fd);
+		}
+	}
+
+	LOG_NOTI("Stopping");
+	pthread_attr_destroy(&attr);
+	close(lfd);
+	unlink(path);
+	jobs_stop();
+	cache_free();
+	return true;
+}
@@ -0,0 +1,39 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdbool.h>
+
+#include "conf.h"
+
+/*
+ * Daemon mode: update jobs are accepted on a Unix socket, one JSON object
+ * per line, e.g.
+ *
+ *	{"target": "/dev/ttyUSB0", "package": "/tmp/dfu-update.zip"}
+ *
+ * and answered with "start", "progress" and "done" events, also one JSON
+ * object per line. Decoded packages stay in memory, keyed by the CRC32 and
+ * size of the ZIP file, and the BLE context stays open between jobs.
+ */
+bool daemon_run(const char* path, const struct dfu_config* conf);
+
+#endif
@@ -18,25 +18,112 @@
  */
 
 #include <endian.h>
-
-#include <zlib.h>
+#include <string.h>
 
 #include "conf.h"
+#include "crc.h"
 #include "dfu.h"
 #include "dfu_ble.h"
 #include "dfu_serial.h"
+#include "evloop.h"
+#include "initpkt.h"
 #include "log.h"
 #include "nrf_dfu_handling_error.h"
 #include "nrf_dfu_req_handler.h"
+#include "package.h"
+#include "slip.h"
+#include "stats.h"
 #include "util.h"
 
-/* Timeout on Serial in seconds */
-#define SER_TIMEOUT_DEFAULT 1
-#define SER_TIMEOUT_OBJ_EXE 10
+/* wait before an object is sent again, doubled for every retry */
+#define DFU_RETRY_MS	 100
+#define DFU_RETRY_MAX_MS 2000
+
+/* response timeouts, see dfu_timeout_ms() */
+#define DFU_OP_TIMEOUT_SER 500
+#define DFU_OP_TIMEOUT_BLE 5000
+#define DFU_FLASH_BASE_MS  2000
+
+void dfu_session_init(struct dfu_session* s, const char* port,
+					  const struct dfu_config* conf)
+{
+	memset(s, 0, sizeof(*s));
+	s->port = port;
+	s->conf = conf;
+	s->ser.fd = -1;
+	s->ping_id = 1;
+}
+
+/* close the serial port or BLE connection */
+void dfu_session_fini(struct dfu_session* s)
+{
+	if (s->conf->dfu_type == DFU_SERIAL) {
+		ser_fini(s);
+	} else {
+		ble_fini(s);
+	}
+}
+
+/* the defaults of the command line options */
+void dfu_config_init(struct dfu_config* conf)
+{
+	memset(conf, 0, sizeof(*conf));
+	conf->serspeed = 115200;
+	conf->dfuspeed = 115200;
+	conf->timeout = 10;
+	conf->ser_profile = SER_PROF_AUTO;
+	conf->ble_atype = BAT_UNKNOWN;
+	conf->interface = "hci0";
+	conf->dfutarg_timeout = 30;
+	conf->object_retries = 3;
+	conf->exec_timeout_ms = 500;
+}
+
+/* the response timeout for most requests */
+int dfu_op_timeout_ms(const struct dfu_session* s)
+{
+	if (s->conf->op_timeout_ms > 0) {
+		return s->conf->op_timeout_ms;
+	}
+	return s->conf->dfu_type == DFU_SERIAL ? DFU_OP_TIMEOUT_SER
+										   : DFU_OP_TIMEOUT_BLE;
+}
+
+/* the time timeout_ms from now, but not after the session deadline */
+uint64_t dfu_deadline(const struct dfu_session* s, int timeout_ms)
+{
+	uint64_t end = ev_now_ms() + timeout_ms;
+	return s->deadline_ms > 0 ? MIN(end, s->deadline_ms) : end;
+}
 
-static uint16_t dfu_mtu;
-static uint32_t dfu_max_size;
-static uint32_t dfu_current_crc;
+/* how long to wait for the response to request. Create and execute write
+ * flash and scale with the object size, the CRC comes after the data which
+ * is still queued. Nothing waits past the session deadline */
+static int dfu_timeout_ms(const struct dfu_session* s, nrf_dfu_op_t request)
+{
+	int t = dfu_op_timeout_ms(s);
+	int kib = (s->obj_size + 1023) / 1024;
+
+	switch (request) {
+	case NRF_DFU_OP_OBJECT_CREATE:
+	case NRF_DFU_OP_OBJECT_EXECUTE:
+		t = MAX(t, DFU_FLASH_BASE_MS + kib * s->conf->exec_timeout_ms);
+		break;
+	case NRF_DFU_OP_CRC_GET:
+		if (s->conf->dfu_type == DFU_SERIAL && s->ser.dfu_speed > 0) {
+			/* 10 bits per byte, all of the object may still be queued */
+			t += (uint64_t)s->obj_size * 2 * 10000 / s->ser.dfu_speed;
+		}
+		break;
+	default:
+		/* shorter while waiting for the device */
+		if (s->conf->dfu_type == DFU_SERIAL && s->ser.timeout_ms > 0) {
+			t = MIN(t, s->ser.timeout_ms);
+		}
+		break;
+	}
+	return ev_remain_ms(dfu_deadline(s, t));
+}
 
 static size_t request_size(nrf_dfu_request_t* req)
 {
@@ -67,7 +154,7 @@ static size_t request_size(nrf_dfu_request_t* req)
 	return 0;
 }
 
-static bool send_request(nrf_dfu_request_t* req)
+static bool send_request(struct dfu_session* s, nrf_dfu_request_t* req)
 {
 	size_t size = request_size(req);
 	if (size == 0) {
@@ -75,10 +162,10 @@ static bool send_request(nrf_dfu_request_t* req)
 		return false;
 	}
 
-	if (conf.dfu_type == DFU_SERIAL) {
-		return ser_encode_write((uint8_t*)req, size, SER_TIMEOUT_DEFAULT);
+	if (s->conf->dfu_type == DFU_SERIAL) {
+		return ser_encode_write(s, (uint8_t*)req, size, SER_TIMEOUT_DEFAULT);
 	} else {
-		return ble_write_ctrl((uint8_t*)req, size);
+		return ble_write_ctrl(s, (uint8_t*)req, size);
 	}
 }
 
@@ -170,16 +257,20 @@ static const char* dfu_ext_err_str(nrf_dfu_ext_error_code_t res)
 	return "Unknown extended error";
 }
 
-static nrf_dfu_response_t* get_response(nrf_dfu_op_t request)
+static nrf_dfu_response_t* get_response(struct dfu_session* s,
+										nrf_dfu_op_t request)
 {
 	const uint8_t* buf = NULL;
-	if (conf.dfu_type == DFU_SERIAL) {
-		/* object execute needs more time when updating bootloader/SD */
-		buf = ser_read_decode(request == NRF_DFU_OP_OBJECT_EXECUTE
-								  ? SER_TIMEOUT_OBJ_EXE
-								  : SER_TIMEOUT_DEFAULT);
+	int timeout_ms = dfu_timeout_ms(s, request);
+
+	if (timeout_ms == 0) {
+		LOG_ERR("Deadline of the update passed");
+		return NULL;
+	}
+	if (s->conf->dfu_type == DFU_SERIAL) {
+		buf = ser_read_decode(s, timeout_ms);
 	} else {
-		buf = ble_read();
+		buf = ble_read(s, timeout_ms);
 	}
 
 	if (!buf) {
@@ -203,6 +294,23 @@ static nrf_dfu_response_t* get_response(nrf_dfu_op_t request)
 	return resp;
 }
 
+/* send req and wait for its response, timing it as op */
+static nrf_dfu_response_t* dfu_request(struct dfu_session* s,
+									   nrf_dfu_request_t* req,
+									   enum stats_op op)
+{
+	uint64_t start = stats_now_us();
+	nrf_dfu_response_t* resp = NULL;
+
+	if (send_request(s, req)) {
+		resp = get_response(s, req->request);
+	}
+
+	stats_op(&s->stats, op, start, 0,
+			 resp != NULL && resp->result == NRF_DFU_RES_CODE_SUCCESS);
+	return resp;
+}
+
 static bool response_is_error(nrf_dfu_response_t* resp)
 {
 	if (resp == NULL) {
@@ -222,33 +330,30 @@ static bool response_is_error(nrf_dfu_response_t* resp)
 }
 
 /* serial only */
-bool dfu_ping(void)
+bool dfu_ping(struct dfu_session* s)
 {
-	static uint8_t ping_id = 1;
+	uint8_t ping_id = s->ping_id++;
 	LOG_INF_("Sending ping %d: ", ping_id);
 	nrf_dfu_request_t req = {
 		.request = NRF_DFU_OP_PING,
-		.ping.id = ping_id++,
+		.ping.id = ping_id,
 	};
 
-	if (!send_request(&req)) {
-		return false;
-	}
-
-	nrf_dfu_response_t* resp = get_response(req.request);
+	nrf_dfu_response_t* resp = dfu_request(s, &req, STATS_PING);
 	if (response_is_error(resp)) {
 		return false;
 	}
 
-	if (resp->ping.id == ping_id - 1) {
+	if (resp->ping.id == ping_id) {
 		LOG_INF("OK");
 	} else {
 		LOG_INF("Wrong ID");
 	}
-	return (resp->ping.id == ping_id - 1);
+	return (resp->ping.id == ping_id);
 }
 
-static bool dfu_set_packet_receive_notification(uint16_t prn)
+static bool dfu_set_packet_receive_notification(struct dfu_session* s,
+												uint16_t prn)
 {
 	LOG_INF_("Set packet receive notification %d: ", prn);
 	nrf_dfu_request_t req = {
@@ -256,11 +361,7 @@ static bool dfu_set_packet_receive_notification(uint16_t prn)
 		.prn.target = htole16(prn),
 	};
 
-	if (!send_request(&req)) {
-		return false;
-	}
-
-	nrf_dfu_response_t* resp = get_response(req.request);
+	nrf_dfu_response_t* resp = dfu_request(s, &req, STATS_SETUP);
 	if (response_is_error(resp)) {
 		return false;
 	}
@@ -270,60 +371,74 @@ static bool dfu_set_packet_receive_notification(uint16_t prn)
 }
 
 /* serial only */
-static bool dfu_get_serial_mtu(void)
+static bool dfu_get_serial_mtu(struct dfu_session* s)
 {
 	LOG_INF_("Get serial MTU: ");
 	nrf_dfu_request_t req = {
 		.request = NRF_DFU_OP_MTU_GET,
 	};
 
-	if (!send_request(&req)) {
+	nrf_dfu_response_t* resp = dfu_request(s, &req, STATS_SETUP);
+	if (response_is_error(resp)) {
 		return false;
 	}
 
-	nrf_dfu_response_t* resp = get_response(req.request);
-	if (response_is_error(resp)) {
+	/* every request has to fit after escaping, plus END. The largest
+	 * besides data creates an object, only data is packed to the MTU */
+	uint16_t mtu = le16toh(resp->mtu.size);
+	size_t need = 1 + sizeof(req.create);
+	if (mtu < need * 2 + 1) {
+		LOG_ERR("MTU %d too small", mtu);
 		return false;
 	}
 
-	dfu_mtu = le16toh(resp->mtu.size);
-	if (dfu_mtu > SLIP_BUF_SIZE) {
-		LOG_WARN("MTU of %d limited to buffer size %d", dfu_mtu, SLIP_BUF_SIZE);
-		dfu_mtu = SLIP_BUF_SIZE;
+	if (s->conf->slip_pack) {
+		/* frames are filled up to the MTU after escaping, so a frame
+		 * without any escaped bytes holds MTU - 1 (END) bytes */
+		s->slip_mtu = mtu;
+		s->mtu = mtu - 1;
+		LOG_INF("%d (packed after SLIP)", mtu);
+	} else {
+		/* use MTU without SLIP overhead */
+		s->mtu = (mtu - 1) / 2;
+		LOG_INF("%d with SLIP => %d", mtu, s->mtu);
 	}
-	/* use MTU without SLIP overhead */
-	LOG_INF("%d with SLIP => %d", dfu_mtu, (dfu_mtu - 1) / 2);
-	dfu_mtu = (dfu_mtu - 1) / 2;
-	return true;
+
+	return ser_set_mtu(s, s->mtu);
 }
 
-static void dfu_set_mtu(uint16_t mtu)
+static void dfu_set_mtu(struct dfu_session* s, uint16_t mtu)
 {
-	dfu_mtu = mtu;
+	s->mtu = mtu;
 }
 
-static uint32_t dfu_get_crc(void)
+static bool dfu_get_crc(struct dfu_session* s, uint32_t* offset, uint32_t* crc)
 {
 	LOG_INF_("Get CRC: ");
 	nrf_dfu_request_t req = {
 		.request = NRF_DFU_OP_CRC_GET,
 	};
 
-	if (!send_request(&req)) {
-		return 0;
+	/* a late packet receipt notification looks just like the response to
+	 * CRC_GET, skip them until we get the CRC of everything we sent */
+	nrf_dfu_response_t* resp = dfu_request(s, &req, STATS_CRC);
+	while (resp != NULL && resp->result == NRF_DFU_RES_CODE_SUCCESS
+		   && s->prn_sent > 0
+		   && le32toh(resp->crc.offset) < s->current_offset) {
+		resp = get_response(s, req.request);
 	}
-
-	nrf_dfu_response_t* resp = get_response(req.request);
 	if (response_is_error(resp)) {
-		return 0;
+		return false;
 	}
 
-	LOG_INF("0x%X (offset %u)", le32toh(resp->crc.crc),
-			le32toh(resp->crc.offset));
-	return le32toh(resp->crc.crc);
+	*offset = le32toh(resp->crc.offset);
+	*crc = le32toh(resp->crc.crc);
+	LOG_INF("0x%X (offset %u)", *crc, *offset);
+	return true;
 }
 
-static bool dfu_object_select(uint8_t type, uint32_t* offset, uint32_t* crc)
+static bool dfu_object_select(struct dfu_session* s, uint8_t type,
+							  uint32_t* offset, uint32_t* crc)
 {
 	LOG_INF_("Select object %d: ", type);
 	nrf_dfu_request_t req = {
@@ -331,111 +446,181 @@ static bool dfu_object_select(uint8_t type, uint32_t* offset, uint32_t* crc)
 		.select.object_type = type,
 	};
 
-	if (!send_request(&req)) {
-		return false;
-	}
-
-	nrf_dfu_response_t* resp = get_response(req.request);
+	nrf_dfu_response_t* resp = dfu_request(s, &req, STATS_SELECT);
 	if (response_is_error(resp)) {
 		return false;
 	}
 
-	dfu_max_size = le32toh(resp->select.max_size);
+	s->max_size = le32toh(resp->select.max_size);
 	*offset = le32toh(resp->select.offset);
 	*crc = le32toh(resp->select.crc);
-	LOG_INF("offset %u max_size %u CRC 0x%X", *offset, dfu_max_size, *crc);
+	LOG_INF("offset %u max_size %u CRC 0x%X", *offset, s->max_size, *crc);
 	return true;
 }
 
-static bool dfu_object_create(uint8_t type, uint32_t size)
+static bool dfu_object_create(struct dfu_session* s, uint8_t type,
+							  uint32_t size)
 {
 	LOG_INF_("Create object %d (size %u): ", type, size);
+	s->obj_size = size;
 	nrf_dfu_request_t req = {
 		.request = NRF_DFU_OP_OBJECT_CREATE,
 		.create.object_type = type,
 		.create.object_size = htole32(size),
 	};
 
-	if (!send_request(&req)) {
+	nrf_dfu_response_t* resp = dfu_request(s, &req, STATS_CREATE);
+	if (response_is_error(resp)) {
 		return false;
 	}
 
-	nrf_dfu_response_t* resp = get_response(req.request);
+	LOG_INF("OK");
+	return true;
+}
+
+/* receive one packet receipt notification and check it against the CRC
+ * we calculated for that offset */
+static bool dfu_prn_receive(struct dfu_session* s)
+{
+	uint64_t start = stats_now_us();
+	nrf_dfu_response_t* resp = get_response(s, NRF_DFU_OP_CRC_GET);
+	stats_op(&s->stats, STATS_PRN, start, 0, resp != NULL);
 	if (response_is_error(resp)) {
 		return false;
 	}
 
-	LOG_INF("OK");
+	uint32_t offset = le32toh(resp->crc.offset);
+	uint32_t crc = le32toh(resp->crc.crc);
+
+	for (uint32_t p = s->prn_acked + 1; p <= s->prn_sent; p++) {
+		struct prn_mark* m = &s->prn_ring[p % ARRAY_SIZE(s->prn_ring)];
+		if (m->offset == offset) {
+			if (m->crc != crc) {
+				LOG_ERR("PRN CRC failed at offset %u: 0x%X vs 0x%X", offset,
+						crc, m->crc);
+				return false;
+			}
+			s->prn_acked = p;
+			s->prn_verified_offset = offset;
+			return true;
+		}
+	}
+
+	/* the bootloader counts packets differently than we do (e.g. after
+	 * resuming an object), we can't check this one, but it still means
+	 * that one window has arrived */
+	LOG_DBG("PRN for unknown offset %u", offset);
+	s->prn_acked = MIN(s->prn_acked + s->conf->prn, s->prn_sent);
 	return true;
 }
 
-static bool dfu_object_write(zip_file_t* zf, size_t size)
+/* count bytes done, for the progress shown and the callback */
+static void dfu_progress(struct dfu_session* s, size_t n)
 {
-	uint8_t buf[dfu_mtu];
-	uint8_t* fbuf = buf;
+	s->progress += n;
+	if (s->cb.progress != NULL) {
+		s->cb.progress(s, s->progress, s->cb.user);
+	}
+}
+
+/* write size bytes of the image, starting at the current offset */
+static bool dfu_object_write(struct dfu_session* s,
+							 const struct dfu_image* img, size_t size)
+{
+	uint8_t buf[s->mtu];
 	size_t written = 0;
-	zip_int64_t len;
-	size_t to_read;
+	uint64_t start = stats_now_us();
 
-	LOG_INF_("Write data (size %zd MTU %d): ", size, dfu_mtu);
+	LOG_INF_("Write data (size %zd MTU %d): ", size, s->mtu);
 
-	do {
-		if (conf.dfu_type == DFU_SERIAL) {
+	s->prn_sent = s->prn_acked = 0;
+	s->prn_verified_offset = 0;
+	size = MIN(size, s->max_size);
+	size = MIN(size, img->size - s->current_offset);
+
+	if (!image_fetch(img, s->current_offset, size, &s->stats.ahead)) {
+		return false;
+	}
+
+	while (written < size) {
+		const uint8_t* data = image_data(img, s->current_offset);
+		size_t n;
+		bool b;
+
+		if (s->conf->dfu_type == DFU_SERIAL) {
 			/* we need to put the write command first, so that leaves one
 			 * byte less for data */
+			n = MIN(sizeof(buf) - 1, size - written);
+			/* when packing, write as much as fits into the MTU after
+			 * escaping. The write opcode is never escaped */
+			if (s->slip_mtu > 0) {
+				n = slip_encode_fit(data, n, s->slip_mtu - 1);
+			}
 			buf[0] = NRF_DFU_OP_OBJECT_WRITE;
-			fbuf = buf + 1;
-			to_read = MIN(sizeof(buf) - 1, size - written);
+			memcpy(buf + 1, data, n);
+			b = ser_encode_write(s, buf, n + 1, SER_TIMEOUT_DEFAULT);
 		} else {
-			to_read = MIN(sizeof(buf), size - written);
-		}
-		len = zip_fread(zf, fbuf, to_read);
-		if (len < 0) {
-			LOG_ERR("zip_fread error");
-			break;
-		}
-		if (len == 0) { // EOF
-			break;
-		}
-		bool b;
-		if (conf.dfu_type == DFU_SERIAL) {
-			b = ser_encode_write(buf, len + 1, SER_TIMEOUT_DEFAULT);
-		} else {
-			b = ble_write_data(fbuf, len);
+			n = MIN(sizeof(buf), size - written);
+			b = ble_write_data(s, (uint8_t*)data, n);
 		}
 		if (!b) {
 			LOG_ERR("write failed");
+			stats_op(&s->stats, STATS_WRITE, start, written, false);
 			return false;
 		}
-		written += len;
-		dfu_current_crc = crc32(dfu_current_crc, fbuf, len);
-	} while (len > 0 && written < size && written < dfu_max_size);
+		written += n;
+		s->current_offset += n;
+		dfu_progress(s, n);
+
+		if (s->conf->prn > 0) {
+			s->current_crc = crc_update(s->current_crc, data, n);
+			s->prn_sent++;
+			struct prn_mark* m
+				= &s->prn_ring[s->prn_sent % ARRAY_SIZE(s->prn_ring)];
+			m->offset = s->current_offset;
+			m->crc = s->current_crc;
+
+			/* keep sending while the notification for the previous
+			 * window is on its way, only wait when two are missing */
+			while (s->prn_sent - s->prn_acked >= 2 * s->conf->prn) {
+				if (!dfu_prn_receive(s)) {
+					return false;
+				}
+			}
+		}
+	}
 
-	// No response expected
-	LOG_INF("%zd bytes CRC: 0x%X", written, dfu_current_crc);
+	/* collect notifications which are still in flight */
+	while (s->conf->prn > 0 && s->prn_sent - s->prn_acked >= s->conf->prn) {
+		if (!dfu_prn_receive(s)) {
+			return false;
+		}
+	}
 
-	if (conf.loglevel < LL_INFO) {
-		printf(".");
-		fflush(stdout);
+	/* without receipts the CRC is only needed at the end of the object,
+	 * where the table of the image mostly has it already */
+	if (s->conf->prn == 0) {
+		s->current_crc = image_crc(img, s->current_offset);
 	}
 
+	// No response expected
+	LOG_INF("%zd bytes CRC: 0x%X", written, s->current_crc);
+	stats_op(&s->stats, STATS_WRITE, start, written, true);
+
+	log_progress();
 	return true;
 }
 
 /** this writes the object to flash
  * return: failed, success, fw_version too low */
-static enum dfu_ret dfu_object_execute(void)
+static enum dfu_ret dfu_object_execute(struct dfu_session* s)
 {
 	LOG_INF_("Object Execute: ");
 	nrf_dfu_request_t req = {
 		.request = NRF_DFU_OP_OBJECT_EXECUTE,
 	};
 
-	if (!send_request(&req)) {
-		return DFU_RET_ERROR;
-	}
-
-	nrf_dfu_response_t* resp = get_response(req.request);
+	nrf_dfu_response_t* resp = dfu_request(s, &req, STATS_EXECUTE);
 	if (response_is_error(resp)) {
 		if (resp && resp->result == NRF_DFU_RES_CODE_EXT_ERROR
 			&& resp->ext_err == NRF_DFU_EXT_ERROR_FW_VERSION_FAILURE) {
@@ -449,119 +634,264 @@ static enum dfu_ret dfu_object_execute(void)
 	return DFU_RET_SUCCESS;
 }
 
-/* get CRC of contents of ZIP file until size */
-static uint32_t zip_crc_move(zip_file_t* zf, size_t size)
+/* CRC of the first offset bytes, a streamed image is read up to there */
+static bool dfu_image_crc(struct dfu_session* s, const struct dfu_image* img,
+						  size_t offset, uint32_t* crc)
 {
-	uint8_t fbuf[200];
-	size_t read = 0;
-	size_t to_read;
-	zip_int64_t len;
-	uint32_t crc = crc32(0L, Z_NULL, 0);
+	offset = MIN(offset, img->size);
+	if (!image_fetch(img, offset, 0, &s->stats.ahead)) {
+		return false;
+	}
+	*crc = image_crc(img, offset);
+	return true;
+}
 
-	do {
-		to_read = MIN(sizeof(fbuf), size - read);
-		len = zip_fread(zf, fbuf, to_read);
-		if (len < 0) {
-			LOG_ERR("zip_fread error");
-			break;
+/* start writing at offset */
+static bool dfu_object_seek(struct dfu_session* s, const struct dfu_image* img,
+							 size_t offset)
+{
+	s->current_offset = offset;
+	s->prn_sent = s->prn_acked = 0;
+	return dfu_image_crc(s, img, offset, &s->current_crc);
+}
+
+/* compare the CRC of the Bootloader with ours, unless the last receipt
+ * notification already confirmed it */
+static bool dfu_object_check_crc(struct dfu_session* s)
+{
+	uint32_t offset;
+	uint32_t crc;
+
+	if (s->prn_verified_offset == s->current_offset) {
+		return true;
+	}
+
+	if (!dfu_get_crc(s, &offset, &crc)) {
+		return false;
+	}
+
+	if (crc != s->current_crc) {
+		LOG_ERR("CRC failed 0x%X vs 0x%X", crc, s->current_crc);
+		return false;
+	}
+	return true;
+}
+
+/** Find where to continue when the Bootloader already has offset bytes of
+ * this object type with CRC crc.
+ * On success start is the object boundary to continue from and created is
+ * true if that object has already been created. If restart is set the data
+ * of the Bootloader can not be used at all and the Init packet has to be
+ * sent again.
+ * return: failed, success, fw_version too low */
+static enum dfu_ret dfu_object_resume(struct dfu_session* s, uint8_t type,
+									  const struct dfu_image* img,
+									  uint32_t offset, uint32_t crc,
+									  size_t* start, bool* created,
+									  bool* restart)
+{
+	size_t sz = img->size;
+	uint32_t remain = offset % s->max_size;
+	uint32_t our_crc;
+	enum dfu_ret ret;
+
+	/* all or part of the image received correctly */
+	if (offset <= sz && dfu_image_crc(s, img, offset, &our_crc)
+		&& crc == our_crc) {
+		if (offset == sz) {
+			LOG_NOTI_("Object already received");
+		} else {
+			LOG_WARN("Object partially received (offset %u remaining %u)",
+					 offset, remain);
 		}
-		if (len == 0) { // EOF
-			break;
+
+		if (!dfu_object_seek(s, img, offset)) {
+			return DFU_RET_ERROR;
+		}
+		if (remain > 0 && offset < sz) {
+			if (!dfu_object_write(s, img, s->max_size - remain)
+				|| !dfu_object_check_crc(s)) {
+				return DFU_RET_ERROR;
+			}
 		}
-		read += len;
-		crc = crc32(crc, fbuf, len);
-	} while (len > 0 && read < size);
 
-	return crc;
+		/* the last object may not have been executed yet */
+		ret = dfu_object_execute(s);
+		if (ret != DFU_RET_SUCCESS) {
+			return ret;
+		}
+
+		s->resume_skipped += offset;
+		dfu_progress(s, offset);
+		*start = s->current_offset;
+		return DFU_RET_SUCCESS;
+	}
+
+	/* try to keep everything before the current object: creating an object
+	 * drops the data which was not executed. If the Bootloader reports the
+	 * CRC we have for that boundary, continue from there */
+	size_t boundary = offset - (remain > 0 ? remain : MIN(offset, s->max_size));
+	if (sz > 0) {
+		boundary = MIN(boundary, (sz - 1) / s->max_size * s->max_size);
+	}
+	LOG_WARN("CRC does not match at offset %u, trying %zu", offset, boundary);
+
+	/* a stream which can't go back can only continue after its window */
+	if (img->win != NULL && !img->win->seek && boundary < img->win->start) {
+		LOG_WARN("Stream can't go back to %zu, starting over", boundary);
+		*restart = true;
+		return DFU_RET_SUCCESS;
+	}
+
+	if (!dfu_object_create(s, type, MIN(sz - boundary, s->max_size))) {
+		return DFU_RET_ERROR;
+	}
+
+	uint32_t doffset;
+	uint32_t dcrc;
+	if (!dfu_get_crc(s, &doffset, &dcrc)) {
+		return DFU_RET_ERROR;
+	}
+
+	if (doffset == boundary && dfu_image_crc(s, img, boundary, &our_crc)
+		&& dcrc == our_crc) {
+		s->resume_skipped += boundary;
+		dfu_progress(s, boundary);
+		s->resume_resent += offset - boundary;
+		*start = boundary;
+		*created = true;
+		return DFU_RET_SUCCESS;
+	}
+
+	/* data which was already executed can only be dropped by a new Init
+	 * packet. A command object is created from scratch above */
+	LOG_WARN("Bootloader data does not match (offset %u), starting over",
+			 doffset);
+	*restart = true;
+	return DFU_RET_SUCCESS;
 }
 
-/** return: failed, success, fw_version too low */
-static enum dfu_ret dfu_object_write_procedure(uint8_t type, zip_file_t* zf,
-											   size_t sz)
+/* create the object at the current offset unless it is, write it and check
+ * the CRC */
+static bool dfu_object_send(struct dfu_session* s, uint8_t type,
+							const struct dfu_image* img, size_t size,
+							bool created)
+{
+	return (created || dfu_object_create(s, type, size))
+		   && dfu_object_write(s, img, size) && dfu_object_check_crc(s);
+}
+
+/* after a write or CRC error, wait for the link to settle and go back to
+ * the start of the object at offset, which is then created again */
+static bool dfu_object_retry(struct dfu_session* s, uint8_t type,
+							 const struct dfu_image* img, size_t offset,
+							 int wait_ms)
+{
+	uint32_t boffset;
+	uint32_t crc;
+	bool ok;
+
+	if (s->conf->dfu_type == DFU_SERIAL) {
+		ok = ser_recover(s, wait_ms);
+	} else {
+		ble_recover(s, wait_ms);
+		ok = true;
+	}
+	if (!ok || !dfu_object_select(s, type, &boffset, &crc)) {
+		return false;
+	}
+
+	s->progress -= s->current_offset - offset;
+	return dfu_object_seek(s, img, offset);
+}
+
+/** write the image as objects of type, resuming if possible. With fresh
+ * the data of the Bootloader is ignored. A stream is read up to where the
+ * Bootloader is for comparing the CRC. restart is set if the data object
+ * can't be resumed and the Init packet needs to be sent again
+ * return: failed, success, fw_version too low */
+static enum dfu_ret dfu_object_write_procedure(struct dfu_session* s,
+											   uint8_t type,
+											   const struct dfu_image* img,
+											   bool fresh, bool* restart)
 {
 	uint32_t offset;
 	uint32_t crc;
 	enum dfu_ret ret;
+	size_t sz = img->size;
+	size_t start = 0;
+	bool created = false;
+
+	*restart = false;
 
-	if (!dfu_object_select(type, &offset, &crc)) {
+	if (!dfu_object_select(s, type, &offset, &crc)) {
 		return DFU_RET_ERROR;
 	}
 
-	/* object with same length and CRC already received */
-	if (offset == sz && zip_crc_move(zf, sz) == crc) {
-		LOG_NOTI_("Object already received");
-		/* Don't transfer anything and skip to the Execute command */
-		return dfu_object_execute();
-	}
-
-	/* parts already received */
-	if (offset > 0) {
-		uint32_t remain = offset % dfu_max_size;
-		LOG_WARN("Object partially received (offset %u remaining %u)", offset,
-				 remain);
-
-		dfu_current_crc = zip_crc_move(zf, offset);
-		if (crc != dfu_current_crc) {
-			/* invalid crc, remove corrupted data, rewind and
-			 * create new object below */
-			offset -= remain > 0 ? remain : dfu_max_size;
-			LOG_WARN("CRC does not match (restarting from %u)", offset);
-			zip_fseek(zf, 0, 0);
-			dfu_current_crc = zip_crc_move(zf, offset);
-		} else if (offset < sz) { /* CRC matches */
-			/* transfer remaining data if necessary */
-			if (remain > 0) {
-				size_t end = offset + dfu_max_size - remain;
-				if (!dfu_object_write(zf, end)) {
-					return DFU_RET_ERROR;
-				}
-			}
-			ret = dfu_object_execute();
-			if (ret != DFU_RET_SUCCESS) {
-				return ret;
-			}
+	if (offset > 0 && !fresh) {
+		ret = dfu_object_resume(s, type, img, offset, crc, &start, &created,
+								restart);
+		if (ret != DFU_RET_SUCCESS || *restart) {
+			return ret;
 		}
-	} else if (offset == 0) {
-		dfu_current_crc = crc32(0L, Z_NULL, 0);
 	}
 
-	/* create and write objects of max_size */
-	for (int i = offset; i < sz; i += dfu_max_size) {
-		size_t osz = MIN(sz - i, dfu_max_size);
-		if (!dfu_object_create(type, osz)) {
-			return DFU_RET_ERROR;
-		}
+	if (!dfu_object_seek(s, img, start)) {
+		return DFU_RET_ERROR;
+	}
 
-		if (!dfu_object_write(zf, osz)) {
-			return DFU_RET_ERROR;
-		}
+	/* create and write objects of max_size, sending one again when it
+	 * failed, waiting longer each time */
+	for (size_t i = start; i < sz; i += s->max_size) {
+		size_t osz = MIN(sz - i, s->max_size);
+		uint64_t ostart = stats_now_us();
+		int tries = 0;
 
-		uint32_t rcrc = dfu_get_crc();
-		if (rcrc != dfu_current_crc) {
-			LOG_ERR("CRC failed 0x%X vs 0x%X", rcrc, dfu_current_crc);
-			return DFU_RET_ERROR;
+		while (!dfu_object_send(s, type, img, osz, created)) {
+			if (tries >= s->conf->object_retries || s->terminate) {
+				return DFU_RET_ERROR;
+			}
+			if (dfu_deadline(s, 1) <= ev_now_ms()) {
+				LOG_ERR("Deadline of the update passed");
+				return DFU_RET_ERROR;
+			}
+			int wait_ms = MIN(DFU_RETRY_MS << tries, DFU_RETRY_MAX_MS);
+			tries++;
+			s->stats.object_retries++;
+			LOG_WARN("Sending object at offset %zu again (%d of %d)", i, tries,
+					 s->conf->object_retries);
+			if (!dfu_object_retry(s, type, img, i, wait_ms)) {
+				return DFU_RET_ERROR;
+			}
+			created = false;
 		}
+		created = false;
 
-		ret = dfu_object_execute();
+		ret = dfu_object_execute(s);
 		if (ret != DFU_RET_SUCCESS) {
 			return ret;
 		}
+		const struct stats_object* so
+			= stats_object(&s->stats, type, osz, ostart);
+		if (so != NULL && s->cb.object != NULL) {
+			s->cb.object(s, so, s->cb.user);
+		}
 	}
 
 	return DFU_RET_SUCCESS;
 }
 
-bool dfu_bootloader_enter(void)
+static bool dfu_bootloader_connect(struct dfu_session* s)
 {
-	if (conf.dfu_type == DFU_SERIAL) {
-		if (!ser_enter_dfu()) {
+	if (s->conf->dfu_type == DFU_SERIAL) {
+		if (!ser_enter_dfu(s)) {
 			return false;
 		}
-		if (!dfu_get_serial_mtu()) {
+		if (!dfu_get_serial_mtu(s)) {
 			return false;
 		}
 	} else {
-		int e = ble_enter_dfu(conf.interface, conf.ble_addr, conf.ble_atype);
+		int e = ble_enter_dfu(s);
 		if (!e) {
 			return false;
 		}
@@ -571,39 +901,287 @@ bool dfu_bootloader_enter(void)
 		 * In the special case that we we already connected to the bootloader
 		 * above, this is detected and ble_enter_dfu() returns 2. */
 		if (e != 2) {
-			if (!ble_connect_dfu_targ(conf.interface, conf.ble_addr,
-									  conf.ble_atype)) {
+			if (!ble_connect_dfu_targ(s)) {
 				return false;
 			}
 		}
+	}
+	return true;
+}
 
-		dfu_set_mtu(244);
+bool dfu_bootloader_enter(struct dfu_session* s)
+{
+	uint64_t start = stats_now_us();
+	bool ret = dfu_bootloader_connect(s);
+	stats_op(&s->stats, STATS_ENTER, start, 0, ret);
+	return ret;
+}
+
+static const char* fw_type_str(uint8_t type)
+{
+	switch (type) {
+	case NRF_DFU_FIRMWARE_TYPE_SOFTDEVICE:
+		return "SoftDevice";
+	case NRF_DFU_FIRMWARE_TYPE_APPLICATION:
+		return "Application";
+	case NRF_DFU_FIRMWARE_TYPE_BOOTLOADER:
+		return "Bootloader";
+	}
+	return "Unknown";
+}
+
+static void dfu_get_hw_version(struct dfu_session* s)
+{
+	nrf_dfu_request_t req = {
+		.request = NRF_DFU_OP_HARDWARE_VERSION,
+	};
+
+	nrf_dfu_response_t* resp = dfu_request(s, &req, STATS_SETUP);
+	if (resp == NULL || resp->result != NRF_DFU_RES_CODE_SUCCESS) {
+		return;
+	}
+	LOG_INF("Hardware: part %X variant %X, %u kB flash, %u kB RAM",
+			le32toh(resp->hardware.part), le32toh(resp->hardware.variant),
+			le32toh(resp->hardware.memory.rom_size) / 1024,
+			le32toh(resp->hardware.memory.ram_size) / 1024);
+}
+
+/** ask the Bootloader which images are installed. false if it does not
+ * support the request */
+bool dfu_get_versions(struct dfu_session* s)
+{
+	dfu_get_hw_version(s);
+
+	s->num_fw = 0;
+	for (int i = 0; i < DFU_FW_MAX; i++) {
+		nrf_dfu_request_t req = {
+			.request = NRF_DFU_OP_FIRMWARE_VERSION,
+			.firmware.image_number = i,
+		};
+
+		/* the list ends with an invalid parameter error */
+		nrf_dfu_response_t* resp = dfu_request(s, &req, STATS_SETUP);
+		if (resp == NULL || resp->result != NRF_DFU_RES_CODE_SUCCESS) {
+			break;
+		}
+
+		struct dfu_fw_version* fw = &s->fw[s->num_fw++];
+		fw->type = resp->firmware.type;
+		fw->version = le32toh(resp->firmware.version);
+		fw->addr = le32toh(resp->firmware.addr);
+		fw->len = le32toh(resp->firmware.len);
+		LOG_INF("Installed %s: version %u (%u bytes at 0x%X)",
+				fw_type_str(fw->type), fw->version, fw->len, fw->addr);
+	}
+
+	if (s->num_fw == 0) {
+		LOG_WARN("Bootloader does not report firmware versions");
+		return false;
 	}
 	return true;
 }
 
-/** return: failed, success, fw_version too low */
-enum dfu_ret dfu_upgrade(zip_file_t* init_zip, size_t init_size,
-						 zip_file_t* fw_zip, size_t fw_size)
+static const struct dfu_fw_version* dfu_fw_find(const struct dfu_session* s,
+												uint8_t type)
 {
-	if (!dfu_set_packet_receive_notification(0)) {
-		return DFU_RET_ERROR;
+	for (int i = 0; i < s->num_fw; i++) {
+		if (s->fw[i].type == type) {
+			return &s->fw[i];
+		}
+	}
+	return NULL;
+}
+
+/** true if the device already has the image of this Init packet. The
+ * SoftDevice reports no version which can be compared to the Init packet,
+ * it is compared by size */
+bool dfu_image_current(const struct dfu_session* s,
+					   const struct dfu_image* init)
+{
+	struct init_info ii;
+
+	if (!init_parse(init->data, init->size, &ii)) {
+		LOG_WARN("Could not parse Init packet");
+		return false;
 	}
 
-	LOG_NOTI_("Sending Init: ");
-	enum dfu_ret ret = dfu_object_write_procedure(1, init_zip, init_size);
-	if (ret != DFU_RET_SUCCESS) {
-		return ret;
+	const struct dfu_fw_version* sd
+		= dfu_fw_find(s, NRF_DFU_FIRMWARE_TYPE_SOFTDEVICE);
+	const struct dfu_fw_version* bl
+		= dfu_fw_find(s, NRF_DFU_FIRMWARE_TYPE_BOOTLOADER);
+	const struct dfu_fw_version* ap
+		= dfu_fw_find(s, NRF_DFU_FIRMWARE_TYPE_APPLICATION);
+
+	switch (ii.type) {
+	case INIT_FW_APPLICATION:
+		return ap && ap->version == ii.fw_version && ap->len == ii.app_size;
+	case INIT_FW_BOOTLOADER:
+		return bl && bl->version == ii.fw_version;
+	case INIT_FW_SOFTDEVICE:
+		return sd && sd->len == ii.sd_size;
+	case INIT_FW_SOFTDEVICE_BOOTLOADER:
+		return bl && bl->version == ii.fw_version && sd
+			   && sd->len == ii.sd_size;
+	default:
+		return false;
 	}
-	LOG_NL(LL_NOTICE);
+}
+
+/* nothing to update, so the Bootloader does not wait for us */
+void dfu_abort(struct dfu_session* s)
+{
+	nrf_dfu_request_t req = {
+		.request = NRF_DFU_OP_ABORT,
+	};
 
-	LOG_NOTI_("Sending Data: ");
-	ret = dfu_object_write_procedure(2, fw_zip, fw_size);
-	if (ret != DFU_RET_SUCCESS) {
-		return ret;
+	LOG_INF("Abort");
+	dfu_request(s, &req, STATS_SETUP);
+}
+
+/** return: failed, success, fw_version too low */
+enum dfu_ret dfu_upgrade(struct dfu_session* s, const struct dfu_image* init,
+						 const struct dfu_image* fw)
+{
+	if (s->conf->dfu_type == DFU_BLE) {
+		/* the ATT MTU of the current connection */
+		dfu_set_mtu(s, ble_get_mtu(s));
+	}
+
+	if (!dfu_set_packet_receive_notification(s, s->conf->prn)) {
+		return DFU_RET_ERROR;
 	}
 
+	bool restart;
+	/* a streamed image can't go back for resuming, unless it is read again */
+	bool fresh = fw->win != NULL && !fw->win->seek;
+	enum dfu_ret ret;
+
+	s->resume_skipped = s->resume_resent = 0;
+
+	do {
+		LOG_NOTI_("Sending Init: ");
+		ret = dfu_object_write_procedure(s, NRF_DFU_OBJ_TYPE_COMMAND, init,
+										 fresh, &restart);
+		if (ret != DFU_RET_SUCCESS) {
+			return ret;
+		}
+		if (restart) {
+			LOG_ERR("Bootloader did not accept new Init packet");
+			return DFU_RET_ERROR;
+		}
+		LOG_NL(LL_NOTICE);
+
+		LOG_NOTI_("Sending Data: ");
+		ret = dfu_object_write_procedure(s, NRF_DFU_OBJ_TYPE_DATA, fw, false,
+										 &restart);
+		if (ret != DFU_RET_SUCCESS) {
+			return ret;
+		}
+
+		if (restart && fresh) {
+			LOG_ERR("Bootloader did not start over");
+			return DFU_RET_ERROR;
+		}
+		if (restart) {
+			/* a new Init packet makes the Bootloader drop all data */
+			s->resume_resent += init->size;
+			s->stats.restarts++;
+			fresh = true;
+			LOG_NL(LL_NOTICE);
+		}
+	} while (restart);
+
 	LOG_NL(LL_NOTICE);
+	if (s->conf->resume_stats) {
+		LOG_NOTI("Resume: %zu bytes skipped, %zu bytes re-sent",
+				 s->resume_skipped, s->resume_resent);
+	}
 	LOG_NOTI("Done");
 	return DFU_RET_SUCCESS;
 }
+
+/* run the whole update of the package on the device of session s */
+bool dfu_flash(struct dfu_session* s, const struct dfu_package* pkg)
+{
+	enum dfu_ret r;
+	bool sb = pkg->sb;
+	bool ap = pkg->ap;
+
+	if (s->conf->deadline > 0) {
+		s->deadline_ms = ev_now_ms() + s->conf->deadline * 1000;
+	}
+
+	if (sb) {
+		LOG_NOTI("Updating SoftDevice/Bootloader (%zd bytes):",
+				 pkg->sb_bin.size);
+	} else {
+		LOG_NOTI("Updating Application (%zd bytes):", pkg->ap_bin.size);
+	}
+
+	if (!dfu_bootloader_enter(s)) {
+		return false;
+	}
+
+	/* leave out what the device already has */
+	if (s->conf->skip_current && dfu_get_versions(s)) {
+		if (sb && dfu_image_current(s, &pkg->sb_dat)) {
+			LOG_NOTI("SoftDevice/Bootloader is current, skipped");
+			sb = false;
+		}
+		if (ap && dfu_image_current(s, &pkg->ap_dat)) {
+			LOG_NOTI("Application is current, skipped");
+			ap = false;
+		}
+		if (!sb && !ap) {
+			LOG_NOTI("Nothing to update");
+			dfu_abort(s);
+			return true;
+		}
+		if (!sb && pkg->sb) {
+			LOG_NOTI("Updating Application (%zd bytes):", pkg->ap_bin.size);
+			goto update_app;
+		}
+	}
+
+	if (sb) {
+		r = dfu_upgrade(s, &pkg->sb_dat, &pkg->sb_bin);
+		if (r == DFU_RET_ERROR) {
+			return false;
+		} else if (r == DFU_RET_FW_VERSION) {
+			/* Bootloader update may fail because it already has the same
+			 * version. In this case try updating the Application */
+			LOG_NOTI("SoftDevice/Bootloader not updated!");
+			if (ap) {
+				LOG_NOTI("Updating Application (%zd bytes):",
+						 pkg->ap_bin.size);
+				goto update_app;
+			}
+		}
+	}
+
+	if (sb && ap) {
+		LOG_NOTI("Updating Application (%zd bytes):", pkg->ap_bin.size);
+		if (s->conf->dfu_type == DFU_BLE) {
+			ble_disconnect(s);
+			if (!ble_connect_dfu_targ(s)) {
+				/* if that fails, it may be that the APP is already running,
+				 * try to connect normally */
+				if (!dfu_bootloader_enter(s)) {
+					return false;
+				}
+			}
+		} else if (!ser_wait_reset(s)) {
+			return false;
+		}
+	}
+
+update_app:
+	if (ap) {
+		r = dfu_upgrade(s, &pkg->ap_dat, &pkg->ap_bin);
+		if (r != DFU_RET_SUCCESS) {
+			return false;
+		}
+	}
+
+	return true;
+}
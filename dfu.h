@@ -20,15 +20,107 @@
 #ifndef DFU_H
 #define DFU_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
-#include <zip.h>
+#include <stdint.h>
+
+#include "conf.h"
+#include "dfu_serial.h"
+#include "image.h"
+#include "stats.h"
+
+/* maximum packet receipt notification window */
+#define DFU_PRN_MAX 255
 
 enum dfu_ret { DFU_RET_SUCCESS, DFU_RET_ERROR, DFU_RET_FW_VERSION };
 
-bool dfu_ping(void);
-bool dfu_bootloader_enter(void);
-enum dfu_ret dfu_upgrade(zip_file_t* init_zip, size_t init_size,
-						 zip_file_t* fw_zip, size_t fw_size);
+struct ble_state;
+struct dfu_session;
+struct dfu_package;
+
+/* Packet receipt notifications: the CRC we calculated after each packet
+ * which is still in flight, so we can check it against the CRC reported
+ * by the bootloader. With at most two windows in flight this is enough. */
+struct prn_mark {
+	uint32_t offset;
+	uint32_t crc;
+};
+
+/* images installed on the device: SoftDevice, Application, Bootloader */
+#define DFU_FW_MAX 4
+
+/* an image installed on the device, from the firmware version request */
+struct dfu_fw_version {
+	uint8_t type; /* nrf_dfu_firmware_type_t */
+	uint32_t version;
+	uint32_t addr;
+	uint32_t len;
+};
+
+/* Optional callbacks for applications embedding the library, called from
+ * the thread of the session */
+struct dfu_callbacks {
+	/* bytes of the package done */
+	void (*progress)(struct dfu_session* s, size_t done, void* user);
+	/* an object was executed, with its size and time */
+	void (*object)(struct dfu_session* s, const struct stats_object* obj,
+				   void* user);
+	void* user;
+};
+
+/* State of the transfer to one device. Several sessions can run in
+ * parallel threads, everything else they use is read only */
+struct dfu_session {
+	const char* port; /* serial port or BLE address */
+	const struct dfu_config* conf;
+	struct dfu_callbacks cb;
+	struct ser_state ser;
+	struct ble_state* ble;
+	volatile bool terminate;
+
+	uint16_t mtu;
+	uint16_t slip_mtu; /* SLIP encoded MTU when packing frames */
+	uint32_t max_size;
+	uint32_t obj_size;	  /* of the object created last */
+	uint64_t deadline_ms; /* of the session, 0 = none */
+	uint32_t current_crc;
+	uint32_t current_offset;
+	uint8_t ping_id;
+
+	struct dfu_fw_version fw[DFU_FW_MAX];
+	int num_fw;
+
+	struct prn_mark prn_ring[2 * DFU_PRN_MAX];
+	uint32_t prn_sent;	/* packets sent in current object write */
+	uint32_t prn_acked; /* packets confirmed by notification */
+	uint32_t prn_verified_offset;
+
+	/* bytes the Bootloader already had which we did not have to send, and
+	 * which we had to send again */
+	size_t resume_skipped;
+	size_t resume_resent;
+
+	/* bytes done, for showing the progress of parallel sessions */
+	atomic_size_t progress;
+
+	struct dfu_stats stats;
+};
+
+void dfu_config_init(struct dfu_config* conf);
+void dfu_session_init(struct dfu_session* s, const char* port,
+					  const struct dfu_config* conf);
+void dfu_session_fini(struct dfu_session* s);
+int dfu_op_timeout_ms(const struct dfu_session* s);
+uint64_t dfu_deadline(const struct dfu_session* s, int timeout_ms);
+bool dfu_ping(struct dfu_session* s);
+bool dfu_bootloader_enter(struct dfu_session* s);
+bool dfu_get_versions(struct dfu_session* s);
+bool dfu_image_current(const struct dfu_session* s,
+					   const struct dfu_image* init);
+void dfu_abort(struct dfu_session* s);
+enum dfu_ret dfu_upgrade(struct dfu_session* s, const struct dfu_image* init,
+						 const struct dfu_image* fw);
+bool dfu_flash(struct dfu_session* s, const struct dfu_package* pkg);
 
 #endif
@@ -17,51 +17,72 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "conf.h"
+#include "dfu.h"
 #include "dfu_ble.h"
 #include "log.h"
+#include "trace.h"
 #include "util.h"
 
 #ifndef BLE_SUPPORT
 
-int ble_enter_dfu(const char* interface, const char* address,
-				   enum BLE_ATYPE atype)
+int ble_enter_dfu(struct dfu_session* s)
 {
 	return false;
 }
-bool ble_connect_dfu_targ(const char* interface, const char* address,
-                                                  enum BLE_ATYPE atype)
+bool ble_connect_dfu_targ(struct dfu_session* s)
 {
-        return false;
+	return false;
 }
-bool ble_write_ctrl(uint8_t* req, size_t len)
+bool ble_write_ctrl(struct dfu_session* s, uint8_t* req, size_t len)
 {
 	return false;
 }
-bool ble_write_data(uint8_t* req, size_t len)
+bool ble_write_data(struct dfu_session* s, uint8_t* req, size_t len)
 {
 	return false;
 }
-const uint8_t* ble_read(void)
+const uint8_t* ble_read(struct dfu_session* s, int timeout_ms)
 {
 	return NULL;
 }
-void ble_disconnect(void)
+void ble_recover(struct dfu_session* s, int wait_ms)
+{
+}
+uint16_t ble_get_mtu(struct dfu_session* s)
+{
+	return 0;
+}
+void ble_disconnect(struct dfu_session* s)
 {
 }
-void ble_fini(void)
+void ble_fini(struct dfu_session* s)
 {
 }
+void ble_ctx_fini(void)
+{
+}
+bool ble_scan(const char* interface, int timeout_ms, ble_seen_fn seen,
+			  void* user)
+{
+	return false;
+}
 
 #else
 
 #include <blzlib.h>
 #include <blzlib_util.h>
 
+#include "ble_param.h"
+
 #define DFU_SERVICE_UUID	 "0000fe59-0000-1000-8000-00805f9b34fb"
 #define DFU_CONTROL_UUID	 "8EC90001-F315-4F60-9FB8-838830DAEA50"
 #define DFU_DATA_UUID		 "8EC90002-F315-4F60-9FB8-838830DAEA50"
@@ -69,47 +90,130 @@ void ble_fini(void)
 #define SERVICE_CHANGED_UUID "2A05"
 #define CONNECT_NORMAL_TRY	 3
 #define CONNECT_DFUTARG_TRY	 10
+#define BLE_TIMEOUT			 10000 /* ms */
+#define BLE_LOOP_SLICE		 10000 /* us, timeout of blz_loop_one() */
+#define BLE_RX_QUEUE		 8	   /* power of two */
+#define BLE_RX_SIZE			 32	   /* responses are small */
+#define BLE_DEFAULT_MTU		 244   /* when the ATT MTU is unknown */
+#define BLE_TX_WAIT			 1000  /* ms, for the controller to send */
+#define BLE_WRITE_RETRY		 5	   /* when the write queue is full */
+#define BLE_L2CAP_HDR		 4
+#define DFUTARG_RETRY		 500 /* ms, between connecting to a seen DfuTarg */
+#define BLE_ADAPTERS		 8	 /* interfaces used at the same time */
+
+/* A BLE interface with its own context (and D-Bus connection) */
+struct ble_adapter {
+	char* name;
+	blz_ctx* ctx;
+	bool scan_on; /* while sessions wait for their DfuTarg */
+};
+
+/* The connection to one device. Notifications of all connections are
+ * dispatched by the event loop of the shared context, so they are queued
+ * here until the session reads them */
+struct ble_state {
+	struct ble_adapter* ad;
+	blz_dev* dev;
+	blz_serv* srv;
+	blz_char* cp;
+	blz_char* dp;
+	bool buttonless_noti;
+	bool control_noti;
+	bool disconnect_noti;
+	uint8_t addr[6]; /* of the connected device */
+	uint16_t mtu;	 /* data bytes per write */
+
+	/* writes without response are only sent when the controller has a
+	 * free buffer for them (credits are ACL packets) */
+	struct ble_tx_mon tx;
+	int tx_credits;
+	int tx_window;
+
+	struct {
+		uint8_t data[BLE_RX_SIZE];
+		size_t len;
+	} rx[BLE_RX_QUEUE];
+	size_t rx_head;
+	size_t rx_tail;
+	uint8_t recv_buf[BLE_RX_SIZE];
+
+	/* waiting for addr to advertise */
+	struct ble_state* scan_next;
+	bool scan_seen;
+	enum BLE_ATYPE scan_atype;
+};
+
+/* sessions on the same interface share its context. Only one thread at a
+ * time may call into blzlib, for all contexts */
+static struct ble_adapter adapters[BLE_ADAPTERS];
+static pthread_mutex_t ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* sessions waiting for their DfuTarg, scanning is on on an adapter while
+ * there are any for it */
+static struct ble_state* scan_list;
+
+static uint64_t ble_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-static bool terminate = false;
-static bool buttonless_noti = false;
-static bool control_noti = false;
-static bool disconnect_noti = false;
-static blz_ctx* ctx = NULL;
-static blz_dev* dev = NULL;
-static blz_serv* srv = NULL;
-static blz_char* cp = NULL;
-static blz_char* dp = NULL;
-
-static uint8_t recv_buf[200];
+/* run the event loop until check is set, called with ctx_lock held. Other
+ * sessions get the lock between the iterations to send their data and may
+ * as well dispatch notifications for this one */
+static void ble_loop_wait(struct dfu_session* s, bool* check, uint32_t timeout)
+{
+	uint64_t end = ble_now_ms() + timeout;
+
+	while (!*check && !s->terminate && ble_now_ms() < end) {
+		blz_loop_one(s->ble->ad->ctx, BLE_LOOP_SLICE);
+		if (!*check) {
+			pthread_mutex_unlock(&ctx_lock);
+			sched_yield();
+			pthread_mutex_lock(&ctx_lock);
+		}
+	}
+}
 
 void buttonless_notify_handler(const uint8_t* data, size_t len, blz_char* ch,
 							   void* user)
 {
+	struct ble_state* b = user;
+
 	if (data[2] != 0x01) {
 		LOG_ERR("Unexpected response (%zd) %x %x %x", len, data[0], data[1],
 				data[2]);
 	}
-	buttonless_noti = true;
+	b->buttonless_noti = true;
 }
 
 void control_notify_handler(const uint8_t* data, size_t len, blz_char* ch,
 							void* user)
 {
-	memcpy(recv_buf, data, len);
-	control_noti = true;
+	struct ble_state* b = user;
 
-	if (conf.loglevel >= LL_DEBUG) {
-		dump_data("RX: ", data, len);
+	if (b->rx_head - b->rx_tail >= BLE_RX_QUEUE || len > BLE_RX_SIZE) {
+		LOG_ERR("Dropped notification (%zd)", len);
+		return;
 	}
+
+	size_t idx = b->rx_head++ & (BLE_RX_QUEUE - 1);
+	memcpy(b->rx[idx].data, data, len);
+	b->rx[idx].len = len;
+	b->control_noti = true;
+
+	trace_packet(TRACE_RX, data, len);
 }
 
 static void disconnect_handler(void* user)
 {
-	disconnect_noti = true;
+	struct ble_state* b = user;
+	b->disconnect_noti = true;
 }
 
-static blz_dev* retry_connect(const char* address, enum BLE_ATYPE atype,
-							  int tries)
+static blz_dev* retry_connect(struct dfu_session* s, const char* address,
+							  enum BLE_ATYPE atype, int tries)
 {
 	blz_dev* dev = NULL;
 	int trynum = 0;
@@ -117,10 +221,13 @@ static blz_dev* retry_connect(const char* address, enum BLE_ATYPE atype,
 	do {
 		if (trynum > 0) {
 			LOG_ERR("Retry connecting to %s", address);
+			s->stats.entry_retries++;
+			pthread_mutex_unlock(&ctx_lock);
 			sleep(5);
+			pthread_mutex_lock(&ctx_lock);
 		}
-		dev = blz_connect(ctx, address, atype);
-	} while (dev == NULL && ++trynum < tries && !terminate);
+		dev = blz_connect(s->ble->ad->ctx, address, atype);
+	} while (dev == NULL && ++trynum < tries && !s->terminate);
 
 	if (trynum >= tries) {
 		LOG_ERR("Gave up connecting to %s after %d tries", address, trynum);
@@ -129,49 +236,248 @@ static blz_dev* retry_connect(const char* address, enum BLE_ATYPE atype,
 	return dev;
 }
 
-static bool start_cp_notify()
+static void scan_handler(const uint8_t* mac, enum blz_addr_type atype,
+						 int8_t rssi, const uint8_t* data, size_t len,
+						 void* user)
+{
+	for (struct ble_state* b = scan_list; b != NULL; b = b->scan_next) {
+		if (b->ad == user && memcmp(b->addr, mac, sizeof(b->addr)) == 0) {
+			b->scan_seen = true;
+			b->scan_atype = (enum BLE_ATYPE)atype;
+		}
+	}
+}
+
+static void scan_add(struct ble_state* b)
+{
+	b->scan_next = scan_list;
+	scan_list = b;
+}
+
+/* stops scanning when nobody waits on the adapter any more */
+static void scan_remove(struct ble_state* b)
 {
-	bool b = blz_char_notify_start(cp, control_notify_handler, NULL);
-	if (!b) {
+	bool waiting = false;
+
+	for (struct ble_state** p = &scan_list; *p != NULL;) {
+		if (*p == b) {
+			*p = b->scan_next;
+			continue;
+		}
+		waiting |= (*p)->ad == b->ad;
+		p = &(*p)->scan_next;
+	}
+	if (!waiting && b->ad->scan_on) {
+		blz_scan_stop(b->ad->ctx);
+		b->ad->scan_on = false;
+	}
+}
+
+/* connect to the DfuTarg at address as soon as it advertises, until
+ * the DfuTarg timeout. Without scanning connecting is just retried.
+ * Called with ctx_lock held */
+static blz_dev* dfutarg_connect(struct dfu_session* s, const char* address)
+{
+	struct ble_state* b = s->ble;
+	struct ble_adapter* ad = b->ad;
+	uint64_t end = dfu_deadline(s, s->conf->dfutarg_timeout * 1000);
+	blz_dev* dev = NULL;
+
+	if (!ad->scan_on) {
+		ad->scan_on = blz_scan_start(ad->ctx, scan_handler, ad);
+		if (!ad->scan_on) {
+			LOG_WARN("Could not scan, retrying to connect instead");
+			return retry_connect(s, address, s->conf->ble_atype,
+								 CONNECT_DFUTARG_TRY);
+		}
+	}
+	scan_add(b);
+
+	while (dev == NULL && !s->terminate) {
+		uint64_t now = ble_now_ms();
+		if (now >= end) {
+			break;
+		}
+		b->scan_seen = false;
+		ble_loop_wait(s, &b->scan_seen, end - now);
+		if (!b->scan_seen) {
+			break;
+		}
+
+		enum BLE_ATYPE atype = s->conf->ble_atype;
+		if (atype == BAT_UNKNOWN) {
+			atype = b->scan_atype;
+		}
+		LOG_INF("DfuTarg %s seen (%s)", address, blz_addr_type_str(atype));
+		dev = blz_connect(ad->ctx, address, atype);
+		if (dev == NULL) {
+			s->stats.entry_retries++;
+			pthread_mutex_unlock(&ctx_lock);
+			usleep(DFUTARG_RETRY * 1000);
+			pthread_mutex_lock(&ctx_lock);
+		}
+	}
+	scan_remove(b);
+
+	if (dev == NULL && !s->terminate) {
+		LOG_ERR("DfuTarg %s did not show up within %d seconds", address,
+				s->conf->dfutarg_timeout);
+	}
+	return dev;
+}
+
+static bool start_cp_notify(struct ble_state* b)
+{
+	bool ok = blz_char_notify_start(b->cp, control_notify_handler, b);
+	if (!ok) {
 		LOG_ERR("Could not start CP notification");
 		return false;
 	}
 	return true;
 }
 
-/** returns 0 on error, 1 on success and 2 when already in bootloader */
-int ble_enter_dfu(const char* interface, const char* address,
-				  enum BLE_ATYPE atype)
+/* the adapter of interface, its context is created when it is first used.
+ * Called with ctx_lock held */
+static struct ble_adapter* ble_adapter_get(const char* interface)
 {
-	ctx = blz_init(interface);
-	if (ctx == NULL) {
+	struct ble_adapter* ad = NULL;
+
+	for (int i = 0; i < BLE_ADAPTERS; i++) {
+		if (adapters[i].name == NULL) {
+			ad = ad ? ad : &adapters[i];
+		} else if (strcmp(adapters[i].name, interface) == 0) {
+			return &adapters[i];
+		}
+	}
+	if (ad == NULL) {
+		LOG_ERR("More than %d BLE interfaces", BLE_ADAPTERS);
+		return NULL;
+	}
+
+	ad->ctx = blz_init(interface);
+	if (ad->ctx == NULL) {
 		LOG_ERR("Could not initialize BLE interface '%s'", interface);
+		return NULL;
+	}
+	ad->name = strdup(interface);
+	return ad;
+}
+
+/* the state of the connection for each session, on the adapter of its
+ * config. Called with ctx_lock held */
+static bool ble_session_init(struct dfu_session* s)
+{
+	if (s->ble == NULL) {
+		s->ble = calloc(1, sizeof(struct ble_state));
+		if (s->ble == NULL) {
+			LOG_ERR("Could not allocate BLE session");
+			return false;
+		}
+		s->ble->tx.sock = -1;
+	}
+	if (s->ble->ad == NULL) {
+		s->ble->ad = ble_adapter_get(s->conf->interface);
+	}
+	return s->ble->ad != NULL;
+}
+
+/* ACL packets the controller needs for an ATT write of len bytes */
+static int ble_tx_frags(struct ble_state* b, size_t len)
+{
+	size_t pdu = len + BLE_ATT_WRITE_HDR + BLE_L2CAP_HDR;
+	return (pdu + b->tx.frag - 1) / b->tx.frag;
+}
+
+/* wait until the controller has buffers for a write of len bytes. If it
+ * stops reporting sent packets we continue without flow control */
+static void ble_tx_wait(struct dfu_session* s, size_t len)
+{
+	struct ble_state* b = s->ble;
+
+	if (b->tx.sock < 0) {
+		return;
+	}
+
+	int n = MIN(b->tx_window, ble_tx_frags(b, len));
+	while (b->tx_credits < n && !s->terminate) {
+		int done = ble_param_tx_completed(&b->tx, BLE_TX_WAIT);
+		if (done <= 0) {
+			LOG_WARN("BLE controller does not report sent packets, "
+					 "disabling TX flow control");
+			ble_param_tx_close(&b->tx);
+			return;
+		}
+		b->tx_credits = MIN(b->tx_window, b->tx_credits + done);
+	}
+	b->tx_credits -= n;
+}
+
+/* ask for a faster connection and find how much fits into one write */
+static void ble_tune(struct dfu_session* s)
+{
+	struct ble_state* b = s->ble;
+
+	ble_param_tune(s->conf->interface, b->addr, s->conf->ble_interval);
+
+	uint16_t att_mtu = ble_param_att_mtu(s->conf->interface, b->addr,
+										 DFU_DATA_UUID);
+	if (att_mtu > BLE_ATT_WRITE_HDR) {
+		b->mtu = att_mtu - BLE_ATT_WRITE_HDR;
+		LOG_INF("ATT MTU %d => %d", att_mtu, b->mtu);
+	} else {
+		b->mtu = BLE_DEFAULT_MTU;
+		LOG_INF("ATT MTU unknown, using %d", b->mtu);
+	}
+
+	ble_param_tx_close(&b->tx);
+	if (!ble_param_tx_open(&b->tx, s->conf->interface, b->addr)) {
+		LOG_INF("No TX flow control");
+		return;
+	}
+	if (s->conf->ble_window > 0) {
+		b->tx_window = s->conf->ble_window * ble_tx_frags(b, b->mtu);
+	} else {
+		b->tx_window = b->tx.bufs;
+	}
+	b->tx_credits = b->tx_window;
+	LOG_INF("TX window %d ACL packets", b->tx_window);
+}
+
+static int ble_enter_dfu_locked(struct dfu_session* s)
+{
+	const char* address = s->port;
+	enum BLE_ATYPE atype = s->conf->ble_atype;
+
+	if (!ble_session_init(s)) {
 		return false;
 	}
 
+	struct ble_state* b = s->ble;
+
 	LOG_NOTI("Connecting to %s (%s)...", address, blz_addr_type_str(atype));
-	dev = retry_connect(address, atype, CONNECT_NORMAL_TRY);
-	if (dev == NULL) {
+	b->dev = retry_connect(s, address, atype, CONNECT_NORMAL_TRY);
+	if (b->dev == NULL) {
 		return false;
 	}
 
-	blz_set_disconnect_handler(dev, disconnect_handler, NULL);
+	blz_set_disconnect_handler(b->dev, disconnect_handler, b);
 
-	srv = blz_get_serv_from_uuid(dev, DFU_SERVICE_UUID);
-	if (srv == NULL) {
+	b->srv = blz_get_serv_from_uuid(b->dev, DFU_SERVICE_UUID);
+	if (b->srv == NULL) {
 		LOG_ERR("DFU Service not found");
 		return false;
 	}
 
-	blz_char* bch = blz_get_char_from_uuid(srv, DFU_BUTTONLESS_UUID);
+	blz_char* bch = blz_get_char_from_uuid(b->srv, DFU_BUTTONLESS_UUID);
 	if (bch == NULL) {
 		LOG_ERR("Could not find buttonless DFU UUID");
 		/* try to find characteristics of DfuTarg */
-		dp = blz_get_char_from_uuid(srv, DFU_DATA_UUID);
-		cp = blz_get_char_from_uuid(srv, DFU_CONTROL_UUID);
-		if (dp != NULL && cp != NULL) {
+		b->dp = blz_get_char_from_uuid(b->srv, DFU_DATA_UUID);
+		b->cp = blz_get_char_from_uuid(b->srv, DFU_CONTROL_UUID);
+		if (b->dp != NULL && b->cp != NULL) {
 			LOG_NOTI("Device already is in Bootloader");
-			if (!start_cp_notify()) {
+			blz_string_to_mac(address, b->addr);
+			if (!start_cp_notify(b)) {
 				return false;
 			} else {
 				return 2; /* already in bootloader */
@@ -181,8 +487,10 @@ int ble_enter_dfu(const char* interface, const char* address,
 		}
 	}
 
-	bool b = blz_char_indicate_start(bch, buttonless_notify_handler, NULL);
-	if (!b) {
+	b->buttonless_noti = false;
+	b->disconnect_noti = false;
+	bool ok = blz_char_indicate_start(bch, buttonless_notify_handler, b);
+	if (!ok) {
 		LOG_ERR("Could not start buttonless notification");
 		return false;
 	}
@@ -190,15 +498,15 @@ int ble_enter_dfu(const char* interface, const char* address,
 	LOG_NOTI("Enter DFU Bootloader");
 
 	uint8_t buf = 0x01;
-	b = blz_char_write(bch, &buf, 1);
-	if (!b) {
+	ok = blz_char_write(bch, &buf, 1);
+	if (!ok) {
 		LOG_ERR("Could not write buttonless");
 		return false;
 	}
 
 	/* wait until notification is received with confirmation */
-	blz_loop_wait(ctx, &buttonless_noti, 10000);
-	if (!buttonless_noti) {
+	ble_loop_wait(s, &b->buttonless_noti, BLE_TIMEOUT);
+	if (!b->buttonless_noti) {
 		LOG_ERR("Timed out waiting for confirmation");
 		return false;
 	}
@@ -207,109 +515,265 @@ int ble_enter_dfu(const char* interface, const char* address,
 	 * bootloader and appear under a new MAC and the connection times out */
 
 	/* wait until disconnected */
-	blz_loop_wait(ctx, &disconnect_noti, 10000);
-	if (!disconnect_noti) {
+	ble_loop_wait(s, &b->disconnect_noti, BLE_TIMEOUT);
+	if (!b->disconnect_noti) {
 		LOG_ERR("Timed out waiting for disconnection");
 		return false;
 	}
 
 	/* free device and service structures (also frees char and
 	 * unsubscribes notifications of bch) */
-	blz_disconnect(dev);
-	blz_serv_free(srv);
-	srv = NULL;
+	blz_disconnect(b->dev);
+	b->dev = NULL;
+	blz_serv_free(b->srv);
+	b->srv = NULL;
 	return true;
 }
 
-bool ble_connect_dfu_targ(const char* interface, const char* address,
-						  enum BLE_ATYPE atype)
+/** returns 0 on error, 1 on success and 2 when already in bootloader */
+int ble_enter_dfu(struct dfu_session* s)
 {
+	pthread_mutex_lock(&ctx_lock);
+	int ret = ble_enter_dfu_locked(s);
+	pthread_mutex_unlock(&ctx_lock);
+
+	if (ret == 2) {
+		ble_tune(s);
+	}
+	return ret;
+}
+
+static bool ble_connect_dfu_targ_locked(struct dfu_session* s)
+{
+	uint8_t mac[6];
+	char macs[18];
+
+	if (!ble_session_init(s)) {
+		return false;
+	}
+
+	struct ble_state* b = s->ble;
+
 	/* connect to DfuTarg: increase MAC address by one */
-	uint8_t* mac = blz_string_to_mac_s(address);
+	if (!blz_string_to_mac(s->port, mac)) {
+		LOG_ERR("Invalid MAC address %s", s->port);
+		return false;
+	}
 	mac[0]++;
-	const char* macs = blz_mac_to_string_s(mac);
+	snprintf(macs, sizeof(macs), "%s", blz_mac_to_string_s(mac));
+	memcpy(b->addr, mac, sizeof(b->addr));
 
 	LOG_NOTI("Connecting to DfuTarg (%s)...", macs);
-	dev = retry_connect(macs, atype, CONNECT_DFUTARG_TRY);
-	if (dev == NULL) {
+	b->dev = dfutarg_connect(s, macs);
+	if (b->dev == NULL) {
 		return false;
 	}
 
-	srv = blz_get_serv_from_uuid(dev, DFU_SERVICE_UUID);
-	if (srv == NULL) {
+	b->srv = blz_get_serv_from_uuid(b->dev, DFU_SERVICE_UUID);
+	if (b->srv == NULL) {
 		LOG_ERR("DFU Service not found");
 		return false;
 	}
 
-	dp = blz_get_char_from_uuid(srv, DFU_DATA_UUID);
-	cp = blz_get_char_from_uuid(srv, DFU_CONTROL_UUID);
-	if (dp == NULL || cp == NULL) {
+	b->dp = blz_get_char_from_uuid(b->srv, DFU_DATA_UUID);
+	b->cp = blz_get_char_from_uuid(b->srv, DFU_CONTROL_UUID);
+	if (b->dp == NULL || b->cp == NULL) {
 		LOG_ERR("Could not find DFU UUIDs");
-		dp = cp = NULL;
+		b->dp = b->cp = NULL;
 		return false;
 	}
 
 	LOG_NOTI("DFU characteristics found");
-	return start_cp_notify();
+	b->rx_head = b->rx_tail = 0;
+	return start_cp_notify(b);
 }
 
-bool ble_write_ctrl(uint8_t* req, size_t len)
+bool ble_connect_dfu_targ(struct dfu_session* s)
 {
-	if (conf.loglevel >= LL_DEBUG) {
-		dump_data("CP: ", req, len);
+	pthread_mutex_lock(&ctx_lock);
+	bool ret = ble_connect_dfu_targ_locked(s);
+	pthread_mutex_unlock(&ctx_lock);
+
+	if (ret) {
+		ble_tune(s);
 	}
-	return blz_char_write(cp, req, len);
+	return ret;
+}
+
+bool ble_write_ctrl(struct dfu_session* s, uint8_t* req, size_t len)
+{
+	trace_packet(TRACE_CP, req, len);
+	ble_tx_wait(s, len);
+	pthread_mutex_lock(&ctx_lock);
+	bool ret = blz_char_write(s->ble->cp, req, len);
+	pthread_mutex_unlock(&ctx_lock);
+	return ret;
 }
 
-bool ble_write_data(uint8_t* req, size_t len)
+bool ble_write_data(struct dfu_session* s, uint8_t* req, size_t len)
 {
-	if (conf.loglevel >= LL_DEBUG) {
-		dump_data("TX: ", req, len);
+	trace_packet(TRACE_TX, req, len);
+	struct ble_state* b = s->ble;
+	bool ret = false;
+
+	ble_tx_wait(s, len);
+
+	/* the write fails when BlueZ can't queue it, give it time to drain */
+	for (int i = 0; i < BLE_WRITE_RETRY && !ret && !s->terminate; i++) {
+		if (i > 0) {
+			LOG_INF("BLE write queue full, retry %d", i);
+			s->stats.write_retries++;
+			usleep(1000 << i);
+		}
+		pthread_mutex_lock(&ctx_lock);
+		ret = b->dev != NULL && blz_char_write_cmd(b->dp, req, len);
+		pthread_mutex_unlock(&ctx_lock);
 	}
-	return blz_char_write_cmd(dp, req, len);
+	return ret;
 }
 
-const uint8_t* ble_read(void)
+const uint8_t* ble_read(struct dfu_session* s, int timeout_ms)
 {
+	struct ble_state* b = s->ble;
+	const uint8_t* ret = NULL;
+
+	pthread_mutex_lock(&ctx_lock);
+
 	/* wait until notification is received */
-	control_noti = false;
-	blz_loop_wait(ctx, &control_noti, 10000);
-	if (!control_noti) {
+	if (b->rx_tail == b->rx_head) {
+		b->control_noti = false;
+		ble_loop_wait(s, &b->control_noti, timeout_ms);
+	}
+
+	if (b->rx_tail != b->rx_head) {
+		size_t idx = b->rx_tail++ & (BLE_RX_QUEUE - 1);
+		memcpy(b->recv_buf, b->rx[idx].data, b->rx[idx].len);
+		ret = b->recv_buf;
+	} else {
 		LOG_ERR("BLE waiting for notification failed");
-		return NULL;
 	}
 
-	return recv_buf;
+	pthread_mutex_unlock(&ctx_lock);
+	return ret;
+}
+
+/* before an object is sent again: receive late notifications for wait_ms
+ * and drop them */
+void ble_recover(struct dfu_session* s, int wait_ms)
+{
+	struct ble_state* b = s->ble;
+	bool never = false;
+
+	pthread_mutex_lock(&ctx_lock);
+	ble_loop_wait(s, &never, wait_ms);
+	b->rx_tail = b->rx_head;
+	pthread_mutex_unlock(&ctx_lock);
 }
 
-void ble_disconnect(void)
+uint16_t ble_get_mtu(struct dfu_session* s)
 {
+	return s->ble ? s->ble->mtu : BLE_DEFAULT_MTU;
+}
+
+void ble_disconnect(struct dfu_session* s)
+{
+	struct ble_state* b = s->ble;
+
 	LOG_NOTI("Disconnecting");
 
-	if (cp) {
-		blz_char_notify_stop(cp);
+	pthread_mutex_lock(&ctx_lock);
+	if (b->cp) {
+		blz_char_notify_stop(b->cp);
+	}
+	if (b->dev) {
+		blz_disconnect(b->dev);
+		b->dev = NULL;
+	}
+	if (b->srv) {
+		blz_serv_free(b->srv); // also frees chars
+		b->srv = NULL;
+	}
+	b->cp = b->dp = NULL;
+	pthread_mutex_unlock(&ctx_lock);
+
+	ble_param_tx_close(&b->tx);
+}
+
+void ble_fini(struct dfu_session* s)
+{
+	struct ble_state* b = s->ble;
+
+	s->terminate = true;
+	if (b == NULL) {
+		return;
 	}
-	if (dev) {
-		blz_disconnect(dev);
+
+	pthread_mutex_lock(&ctx_lock);
+	if (b->dev) {
+		blz_disconnect(b->dev);
+	}
+	if (b->srv) {
+		blz_serv_free(b->srv); // also frees chars
+	}
+	pthread_mutex_unlock(&ctx_lock);
+
+	ble_param_tx_close(&b->tx);
+	free(b);
+	s->ble = NULL;
+}
+
+void ble_ctx_fini(void)
+{
+	pthread_mutex_lock(&ctx_lock);
+	for (int i = 0; i < BLE_ADAPTERS; i++) {
+		struct ble_adapter* ad = &adapters[i];
+		if (ad->name != NULL) {
+			blz_fini(ad->ctx);
+			free(ad->name);
+			memset(ad, 0, sizeof(*ad));
+		}
 	}
+	pthread_mutex_unlock(&ctx_lock);
 }
 
-void ble_fini(void)
+struct ble_survey {
+	ble_seen_fn seen;
+	void* user;
+};
+
+static void survey_handler(const uint8_t* mac, enum blz_addr_type atype,
+						   int8_t rssi, const uint8_t* data, size_t len,
+						   void* user)
 {
-	if (dev) {
-		blz_disconnect(dev);
-		dev = NULL;
+	struct ble_survey* sv = user;
+	sv->seen(blz_mac_to_string_s(mac), rssi, sv->user);
+}
+
+/* scan on interface for timeout_ms and report every advertisement to seen,
+ * e.g. for choosing the adapter closest to a device. The lock is held all
+ * the time, so no sessions should be running */
+bool ble_scan(const char* interface, int timeout_ms, ble_seen_fn seen,
+			  void* user)
+{
+	struct ble_survey sv = {seen, user};
+	bool ok = false;
+
+	pthread_mutex_lock(&ctx_lock);
+	struct ble_adapter* ad = ble_adapter_get(interface);
+	if (ad != NULL && !ad->scan_on) {
+		ok = blz_scan_start(ad->ctx, survey_handler, &sv);
 	}
-	if (srv) {
-		blz_serv_free(srv); // also frees chars
-		srv = NULL;
+	if (ok) {
+		uint64_t end = ble_now_ms() + timeout_ms;
+		while (ble_now_ms() < end) {
+			blz_loop_one(ad->ctx, BLE_LOOP_SLICE);
+		}
+		blz_scan_stop(ad->ctx);
+	} else if (ad != NULL) {
+		LOG_WARN("Could not scan on BLE interface '%s'", interface);
 	}
-	blz_fini(ctx);
-	ctx = NULL;
-	buttonless_noti = true;
-	disconnect_noti = true;
-	control_noti = true;
-	terminate = true;
+	pthread_mutex_unlock(&ctx_lock);
+	return ok;
 }
 
 #endif
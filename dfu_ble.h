@@ -24,16 +24,22 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#include "conf.h"
+struct dfu_session;
 
-int ble_enter_dfu(const char* interface, const char* address,
-				  enum BLE_ATYPE atype);
-bool ble_connect_dfu_targ(const char* interface, const char* address,
-						  enum BLE_ATYPE atype);
-bool ble_write_ctrl(uint8_t* req, size_t len);
-bool ble_write_data(uint8_t* req, size_t len);
-const uint8_t* ble_read(void);
-void ble_disconnect(void);
-void ble_fini(void);
+/* an advertisement seen by ble_scan() */
+typedef void (*ble_seen_fn)(const char* addr, int rssi, void* user);
+
+int ble_enter_dfu(struct dfu_session* s);
+bool ble_connect_dfu_targ(struct dfu_session* s);
+bool ble_write_ctrl(struct dfu_session* s, uint8_t* req, size_t len);
+bool ble_write_data(struct dfu_session* s, uint8_t* req, size_t len);
+const uint8_t* ble_read(struct dfu_session* s, int timeout_ms);
+void ble_recover(struct dfu_session* s, int wait_ms);
+uint16_t ble_get_mtu(struct dfu_session* s);
+void ble_disconnect(struct dfu_session* s);
+void ble_fini(struct dfu_session* s);
+void ble_ctx_fini(void);
+bool ble_scan(const char* interface, int timeout_ms, ble_seen_fn seen,
+			  void* user);
 
 #endif
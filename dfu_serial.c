@@ -19,101 +19,283 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <strings.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "conf.h"
 #include "dfu.h"
 #include "dfu_serial.h"
+#include "evloop.h"
 #include "log.h"
 #include "serialtty.h"
 #include "slip.h"
+#include "trace.h"
 #include "util.h"
 
 #define DFU_SERIAL_BAUDRATE 115200
-#define MAX_READ_TRIES		SLIP_BUF_SIZE
+#define PROBE_PINGS			3
+#define MAX_READ_TRIES		(SER_RX_BUF_SIZE * 2 + 1)
+#define RX_RING_SIZE		SER_RX_RING_SIZE
+#define TX_QUEUE_SIZE		SER_TX_QUEUE_SIZE
 
-static uint8_t buf[SLIP_BUF_SIZE];
-static int ser_fd = -1;
-static bool terminate;
+/* waiting for the Bootloader, pings start with this timeout, which is
+ * doubled up to the response timeout */
+#define READY_PING_MS 20
+/* the device may still answer for this long after the last object of a
+ * SoftDevice/Bootloader update, before it resets */
+#define RESET_WAIT_MS 1000
+/* the reply to the DFU command ends when the device is quiet this long */
+#define CMD_REPLY_MS 1000
+#define CMD_QUIET_MS 50
 
-bool ser_encode_write(uint8_t* req, size_t len, int timeout_sec)
+/* what the profiles set up. Low latency makes the driver pass on small
+ * responses at once instead of holding them back, flow control lets fast
+ * baud rates run without overrunning the UART of the nRF */
+static const struct ser_profile {
+	const char* name;
+	bool low_latency;
+	int latency_timer; /* ms, -1 = leave it */
+	bool rtscts;
+} ser_profiles[] = {
+	[SER_PROF_AUTO] = {"auto", false, -1, false},
+	[SER_PROF_PLAIN] = {"plain", false, -1, false},
+	[SER_PROF_LOWLAT] = {"lowlat", true, 1, false},
+	[SER_PROF_HWFC] = {"hwfc", true, 1, true},
+};
+
+/* USB serial bridges which get the lowlat profile with auto, pid 0 = all.
+ * Flow control depends on the wiring and is never chosen automatically */
+static const struct {
+	uint16_t vid;
+	uint16_t pid;
+} lowlat_usb[] = {
+	{0x0403, 0},	  /* FTDI */
+	{0x10c4, 0xea60}, /* CP210x */
+	{0x067b, 0x2303}, /* PL2303 */
+	{0x1a86, 0x7523}, /* CH340 */
+};
+
+/* baud rates tried with --dfu-baud auto, fastest first */
+static const int probe_rates[]
+	= {3000000, 2000000, 1000000, 921600, 460800, 230400, 115200};
+
+/* drop anything left over, e.g. from another baud rate */
+static void ser_flush(struct ser_state* ser)
+{
+	ser->rx.tail = ser->rx.head;
+	ser->tx.tail = ser->tx.head;
+}
+
+static size_t ser_tx_pending(struct ser_state* ser)
+{
+	return ser->tx.head - ser->tx.tail;
+}
+
+/* write as much of the queue as the port takes without blocking */
+static bool ser_tx_push(struct ser_state* ser)
+{
+	while (ser_tx_pending(ser) > 0) {
+		size_t idx = ser->tx.tail & (TX_QUEUE_SIZE - 1);
+		size_t len = MIN(ser_tx_pending(ser), TX_QUEUE_SIZE - idx);
+		ssize_t ret = write(ser->fd, ser->tx.data + idx, len);
+		if (ret < 0) {
+			if (errno == EAGAIN) {
+				return true;
+			}
+			LOG_ERR("Write error: %d %s", errno, strerror(errno));
+			return false;
+		}
+		ser->tx.tail += ret;
+		if ((size_t)ret < len) {
+			return true; // port is full
+		}
+	}
+	return true;
+}
+
+/* queue len bytes, only waiting for the port when the queue is full */
+static bool ser_tx_queue(struct ser_state* ser, const uint8_t* data,
+						 size_t len, int timeout_ms)
+{
+	while (len > 0) {
+		size_t space = TX_QUEUE_SIZE - ser_tx_pending(ser);
+		if (space == 0) {
+			if (ev_wait(ser->fd, POLLOUT, timeout_ms) <= 0) {
+				LOG_ERR("Timeout on Serial TX");
+				return false;
+			}
+			if (!ser_tx_push(ser)) {
+				return false;
+			}
+			continue;
+		}
+
+		size_t idx = ser->tx.head & (TX_QUEUE_SIZE - 1);
+		size_t n = MIN(len, MIN(space, TX_QUEUE_SIZE - idx));
+		memcpy(ser->tx.data + idx, data, n);
+		ser->tx.head += n;
+		data += n;
+		len -= n;
+	}
+	return ser_tx_push(ser);
+}
+
+/* wait until there is something to read and read as many bytes as fit
+ * into the ring. The TX queue is sent meanwhile. returns false on error,
+ * timeout and when the port hung up, like a USB device which resets */
+static bool ser_rx_fill(struct ser_state* ser, int timeout_ms)
 {
+	uint64_t end = ev_now_ms() + timeout_ms;
+	int ev;
+
+	do {
+		uint64_t now = ev_now_ms();
+		short events = POLLIN | (ser_tx_pending(ser) > 0 ? POLLOUT : 0);
+		ev = ev_wait(ser->fd, events, now < end ? end - now : 0);
+		if (ev > 0 && (ev & POLLOUT) && !ser_tx_push(ser)) {
+			return false;
+		}
+	} while (ev > 0 && !(ev & (POLLIN | POLLERR | POLLHUP)));
+
+	if (ev <= 0) {
+		LOG_INF("Timeout on Serial RX");
+		return false;
+	}
+
+	size_t idx = ser->rx.head & (RX_RING_SIZE - 1);
+	size_t space = RX_RING_SIZE - (ser->rx.head - ser->rx.tail);
+	ssize_t ret
+		= read(ser->fd, ser->rx.data + idx, MIN(space, RX_RING_SIZE - idx));
+	if (ret < 0 && errno != EAGAIN) {
+		LOG_ERR("Read error: %d %s", errno, strerror(errno));
+		return false;
+	} else if (ret == 0 || (ret < 0 && (ev & (POLLERR | POLLHUP)))) {
+		/* poll keeps reporting it, waiting again would spin */
+		LOG_ERR("Serial port hung up");
+		ser->hung_up = true;
+		return false;
+	}
+	ser->rx.head += ret;
+	return true;
+}
+
+/* size the TX buffer for frames of up to mtu bytes before escaping */
+bool ser_set_mtu(struct dfu_session* s, size_t mtu)
+{
+	struct ser_state* ser = &s->ser;
+
+	/* worst case every byte is escaped, plus the END byte */
+	uint8_t* b = arena_realloc(ser->tx_buf, ser->tx_mtu * 2 + 1, mtu * 2 + 1);
+	if (b == NULL) {
+		LOG_ERR("Could not allocate TX buffer for MTU %zd", mtu);
+		return false;
+	}
+	ser->tx_buf = b;
+	ser->tx_mtu = mtu;
+	return true;
+}
+
+bool ser_encode_write(struct dfu_session* s, uint8_t* req, size_t len,
+					  int timeout_ms)
+{
+	struct ser_state* ser = &s->ser;
 	uint32_t slip_len;
-	slip_encode(buf, (uint8_t*)req, len, &slip_len);
 
-	bool b = serial_write(ser_fd, (const char*)buf, slip_len, timeout_sec);
+	if (len > ser->tx_mtu) {
+		LOG_ERR("Frame of %zd bytes exceeds MTU %zd", len, ser->tx_mtu);
+		return false;
+	}
+
+	slip_encode_bulk(ser->tx_buf, req, len, &slip_len);
 
-	if (b && conf.loglevel >= LL_DEBUG) {
-		dump_data("TX: ", req, len);
+	/* this returns before the frame is sent, the response or the next
+	 * frame wait for it */
+	bool b = ser_tx_queue(ser, ser->tx_buf, slip_len, timeout_ms);
+
+	if (b) {
+		trace_packet(TRACE_TX, req, len);
 	}
 
 	return b;
 }
 
-const uint8_t* ser_read_decode(int timeout_sec)
+/* read one frame within timeout_ms, however many reads it takes */
+const uint8_t* ser_read_decode(struct dfu_session* s, int timeout_ms)
 {
-	ssize_t ret;
+	struct ser_state* ser = &s->ser;
+	uint64_t deadline = ev_now_ms() + timeout_ms;
 	int end = 0;
-	char read_buf;
 	int read_tries = 0;
-	bool timeout;
 
-	slip_t slip = {.p_buffer = buf,
+	slip_t slip = {.p_buffer = ser->buf,
 				   .current_index = 0,
-				   .buffer_len = BUF_SIZE,
+				   .buffer_len = sizeof(ser->buf),
 				   .state = SLIP_STATE_DECODING};
 
 	do {
-		read_tries++;
-		timeout = serial_wait_read_ready(ser_fd, timeout_sec);
-		if (timeout) {
-			LOG_INF("Timeout on Serial RX");
-			break;
+		/* decode what we already have, leaving the rest in the ring */
+		while (ser->rx.tail != ser->rx.head && end != 1
+			   && read_tries < MAX_READ_TRIES) {
+			size_t idx = ser->rx.tail & (RX_RING_SIZE - 1);
+			uint32_t len = MIN(ser->rx.head - ser->rx.tail, RX_RING_SIZE - idx);
+			uint32_t used;
+			len = MIN(len, MAX_READ_TRIES - read_tries);
+			end = slip_decode_bulk(&slip, ser->rx.data + idx, len, &used);
+			ser->rx.tail += used;
+			read_tries += used;
 		}
-		ret = read(ser_fd, &read_buf, 1);
-		if (ret < 0 && errno != EAGAIN) {
-			LOG_ERR("Read error: %d %s", errno, strerror(errno));
+		if (end == 1 || read_tries >= MAX_READ_TRIES || s->terminate) {
 			break;
-		} else if (ret > 0) {
-			end = slip_decode_add_byte(&slip, read_buf);
 		}
-	} while (end != 1 && read_tries < MAX_READ_TRIES && !terminate);
+	} while (ev_now_ms() < deadline
+			 && ser_rx_fill(ser, ev_remain_ms(deadline)));
 
-	if (conf.loglevel >= LL_DEBUG) {
-		dump_data("RX: ", slip.p_buffer, slip.current_index);
-	}
+	trace_packet(TRACE_RX, slip.p_buffer, slip.current_index);
 
-	return (end == 1 ? buf : NULL);
+	return (end == 1 ? ser->buf : NULL);
 }
 
-static bool serial_enter_dfu_cmd(void)
+static bool serial_enter_dfu_cmd(struct ser_state* ser,
+								 const struct dfu_config* conf)
 {
 	char b[200];
 
-	serial_set_baudrate(ser_fd, conf.serspeed);
+	serial_set_baudrate(ser->fd, conf->serspeed);
 
 	/* first read and discard anything that came before */
-	read(ser_fd, b, 200);
+	read(ser->fd, b, 200);
+	ser_flush(ser);
 
-	LOG_INF("Sending command to enter DFU mode: '%s'", conf.dfucmd);
-	if (conf.dfucmd_hex) {
-		hex_to_bin(conf.dfucmd, (uint8_t*)b, strlen(conf.dfucmd));
-		size_t len = strlen(conf.dfucmd) / 2;
-		serial_write(ser_fd, b, len, 1);
+	LOG_INF("Sending command to enter DFU mode: '%s'", conf->dfucmd);
+	if (conf->dfucmd_hex) {
+		hex_to_bin(conf->dfucmd, (uint8_t*)b, strlen(conf->dfucmd));
+		size_t len = strlen(conf->dfucmd) / 2;
+		serial_write(ser->fd, b, len, SER_TIMEOUT_DEFAULT);
 	} else {
 		/* it looks like the first two characters written are lost...
 		 * and we need \r to enter CLI */
-		serial_write(ser_fd, "\r\r\r", 3, 1);
-		serial_write(ser_fd, conf.dfucmd, strlen(conf.dfucmd), 1);
-		serial_write(ser_fd, "\r", 1, 1);
+		serial_write(ser->fd, "\r\r\r", 3, SER_TIMEOUT_DEFAULT);
+		serial_write(ser->fd, conf->dfucmd, strlen(conf->dfucmd),
+					 SER_TIMEOUT_DEFAULT);
+		serial_write(ser->fd, "\r", 1, SER_TIMEOUT_DEFAULT);
+	}
+	/* the reply, until the device is quiet for a moment */
+	int ret = 0;
+	int wait = CMD_REPLY_MS;
+	while (ret < sizeof(b) - 1 && ev_wait(ser->fd, POLLIN, wait) > 0) {
+		int n = read(ser->fd, b + ret, sizeof(b) - 1 - ret);
+		if (n <= 0) {
+			break;
+		}
+		ret += n;
+		wait = CMD_QUIET_MS;
 	}
-	sleep(1);
 
-	int ret = read(ser_fd, b, 200);
 	if (ret > 0) {
-		if (!conf.dfucmd_hex) {
+		if (!conf->dfucmd_hex) {
 			/* debug output reply */
 			b[ret--] = '\0';
 			/* remove trailing \r \n */
@@ -131,69 +313,305 @@ static bool serial_enter_dfu_cmd(void)
 			LOG_INF("Device replied with %d bytes", ret);
 		}
 
-		serial_set_baudrate(ser_fd, DFU_SERIAL_BAUDRATE);
+		serial_set_baudrate(ser->fd, ser->dfu_speed);
 		return true;
 	} else {
 		LOG_INF("Device didn't repy (%d)", ret);
-		serial_set_baudrate(ser_fd, DFU_SERIAL_BAUDRATE);
+		serial_set_baudrate(ser->fd, ser->dfu_speed);
 		return false;
 	}
 }
 
-bool ser_enter_dfu(void)
+bool ser_profile_parse(const char* name, enum SER_PROFILE* prof)
 {
-	ser_fd = serial_init(conf.serport, DFU_SERIAL_BAUDRATE);
-	if (ser_fd <= 0) {
-		return false;
+	for (int i = 0; i < ARRAY_SIZE(ser_profiles); i++) {
+		if (strcasecmp(name, ser_profiles[i].name) == 0) {
+			*prof = i;
+			return true;
+		}
 	}
+	return false;
+}
 
-	/* first check if Bootloader responds to Ping */
-	LOG_NOTI_("Waiting for device to be ready: ");
-	int ntry = 0;
-	bool ret = false;
-	do {
-		if (conf.dfucmd) {
-			ret = serial_enter_dfu_cmd();
-			if (terminate) {
-				ret = false;
-				break;
-			}
-			sleep(1);
-			if (!ret) {
-				/* if dfu command failed, try ping, it will
-				 * usually fail with "Opcode not supported"
-				 * because of the text we sent before, but then
-				 * the next one below can succeed */
-				ret = dfu_ping();
-			}
+/* the profile for the port, looked up again on every open because the
+ * device can come back with another USB ID */
+static enum SER_PROFILE ser_profile_for(const struct dfu_session* s)
+{
+	uint16_t vid;
+	uint16_t pid;
+
+	if (s->conf->ser_profile != SER_PROF_AUTO) {
+		return s->conf->ser_profile;
+	}
+	if (!serial_usb_id(s->port, &vid, &pid)) {
+		return SER_PROF_PLAIN;
+	}
+	for (int i = 0; i < ARRAY_SIZE(lowlat_usb); i++) {
+		if (lowlat_usb[i].vid == vid
+			&& (lowlat_usb[i].pid == 0 || lowlat_usb[i].pid == pid)) {
+			LOG_INF("USB serial bridge %04x:%04x", vid, pid);
+			return SER_PROF_LOWLAT;
+		}
+	}
+	return SER_PROF_PLAIN;
+}
+
+/* open the port with the settings of its profile. What we changed in the
+ * driver is set back by ser_fini() */
+static int ser_open(struct dfu_session* s)
+{
+	struct ser_state* ser = &s->ser;
+	enum SER_PROFILE prof = ser_profile_for(s);
+	const struct ser_profile* p = &ser_profiles[prof];
+	bool was;
+
+	ser->lowlat_set = false;
+	ser->old_latency = -1;
+	ser->fd = serial_init(s->port, ser->dfu_speed, p->rtscts, &ser->otty);
+	if (ser->fd < 0) {
+		return ser->fd;
+	}
+
+	LOG_INF("Serial profile %s", p->name);
+	if (p->low_latency) {
+		if (serial_set_low_latency(ser->fd, true, &was)) {
+			ser->lowlat_set = !was;
 		} else {
-			sleep(1);
+			LOG_INF("Serial driver has no low latency mode");
 		}
+	}
+	if (p->latency_timer >= 0
+		&& !serial_set_latency_timer(s->port, p->latency_timer,
+									 &ser->old_latency)) {
+		ser->old_latency = -1;
+	}
+	return ser->fd;
+}
 
-		if (conf.loglevel < LL_INFO) {
-			printf(".");
-			fflush(stdout);
+/* find the fastest baud rate at which the Bootloader answers to a few pings
+ * in a row */
+static bool ser_probe_speed(struct dfu_session* s)
+{
+	struct ser_state* ser = &s->ser;
+
+	for (int i = 0; i < ARRAY_SIZE(probe_rates) && !s->terminate; i++) {
+		LOG_INF("Probing %d baud", probe_rates[i]);
+		if (!serial_set_baudrate(ser->fd, probe_rates[i])) {
+			continue;
 		}
+		ser_flush(ser);
 
-		if (!terminate) {
-			ret = dfu_ping();
+		/* allow one failure, the Bootloader may still have garbage from
+		 * the last rate in its buffer */
+		int ok = 0;
+		int fail = 0;
+		while (ok < PROBE_PINGS && fail < 2 && !s->terminate) {
+			if (dfu_ping(s)) {
+				ok++;
+			} else {
+				fail++;
+			}
 		}
-	} while (!ret && ++ntry < conf.timeout && !terminate);
 
-	LOG_NL(LL_NOTICE);
+		if (ok == PROBE_PINGS) {
+			ser->dfu_speed = probe_rates[i];
+			LOG_NOTI_("(%d baud) ", ser->dfu_speed);
+			return true;
+		}
+	}
+
+	serial_set_baudrate(ser->fd, ser->dfu_speed);
+	return false;
+}
+
+static bool ser_ping(struct dfu_session* s)
+{
+	if (s->conf->dfuspeed == 0) {
+		return ser_probe_speed(s);
+	}
+	return dfu_ping(s);
+}
+
+/* drop what is still in the port and the ring, like late answers to pings
+ * which timed out */
+static void ser_drain(struct ser_state* ser)
+{
+	tcflush(ser->fd, TCIFLUSH);
+	ser_flush(ser);
+}
+
+/* before an object is sent again: finish the frames which are queued, so
+ * none is cut off, then wait for late responses and drop them */
+bool ser_recover(struct dfu_session* s, int wait_ms)
+{
+	struct ser_state* ser = &s->ser;
+
+	while (ser_tx_pending(ser) > 0) {
+		if (ev_wait(ser->fd, POLLOUT, SER_TIMEOUT_DEFAULT) <= 0
+			|| !ser_tx_push(ser)) {
+			LOG_ERR("Could not send queued frames");
+			return false;
+		}
+	}
+	ev_sleep(wait_ms);
+	ser_drain(ser);
+	return true;
+}
+
+/* A USB CDC device goes away when it resets and comes back as a new
+ * device. Reopen the port when that happened. false if it did not come
+ * back until deadline */
+static bool ser_port_check(struct dfu_session* s, uint64_t deadline)
+{
+	struct ser_state* ser = &s->ser;
+
+	if (ser->fd >= 0 && !ser->hung_up
+		&& !serial_port_changed(ser->fd, s->port)) {
+		return true;
+	}
+
+	if (ser->fd >= 0) {
+		LOG_INF("Serial port %s went away", s->port);
+		ev_forget(ser->fd);
+		close(ser->fd); // nothing to restore on a gone device
+		ser->fd = -1;
+	}
+
+	while (!s->terminate) {
+		uint64_t now = ev_now_ms();
+		if (now >= deadline || !serial_wait_port(s->port, deadline - now)) {
+			return false;
+		}
+		if (ser_open(s) >= 0) {
+			LOG_INF("Serial port %s is back", s->port);
+			ser->hung_up = false;
+			ser_flush(ser);
+			return true;
+		}
+		ev_sleep(READY_PING_MS);
+	}
+	return false;
+}
+
+/* ping until the Bootloader answers or deadline, starting with short
+ * timeouts and backing off. With cmd the command to enter DFU mode is sent
+ * first and again whenever the backoff reached the normal timeout. ntry
+ * counts the pings which were not answered */
+static bool ser_wait_ready(struct dfu_session* s, uint64_t deadline, bool cmd,
+						   uint32_t* ntry)
+{
+	struct ser_state* ser = &s->ser;
+	int wait = READY_PING_MS;
+	bool ret = false;
+
+	while (!s->terminate && ev_now_ms() < deadline) {
+		if (!ser_port_check(s, deadline)) {
+			break;
+		}
+
+		if (cmd && wait == READY_PING_MS) {
+			/* if the command is not answered, the following ping will
+			 * usually fail with "Opcode not supported" because of the
+			 * text we sent, but then the next one can succeed */
+			serial_enter_dfu_cmd(ser, s->conf);
+		}
+
+		uint64_t start = ev_now_ms();
+		ser->timeout_ms = wait;
+		ser_drain(ser);
+		ret = ser_ping(s);
+		if (ret) {
+			break;
+		}
+
+		(*ntry)++;
+		log_progress();
 
-	if (ntry >= conf.timeout) {
-		LOG_NOTI("Device didn't respond after %d tries", conf.timeout);
+		/* a ping can also fail at once, e.g. on a port which is gone. Then
+		 * we rather wait for it to come back */
+		uint64_t used = ev_now_ms() - start;
+		if (used < wait && !ser->hung_up
+			&& !serial_port_changed(ser->fd, s->port)) {
+			ev_sleep(wait - used);
+		}
+		if (wait < dfu_op_timeout_ms(s)) {
+			wait = MIN(wait * 2, dfu_op_timeout_ms(s));
+		} else if (cmd) {
+			wait = READY_PING_MS;
+		}
+	}
+
+	ser->timeout_ms = 0;
+	return ret;
+}
+
+bool ser_enter_dfu(struct dfu_session* s)
+{
+	struct ser_state* ser = &s->ser;
+
+	if (!ser_set_mtu(s, SER_DEFAULT_MTU)) {
 		return false;
 	}
+
+	ser->dfu_speed = s->conf->dfuspeed > 0 ? s->conf->dfuspeed
+										   : DFU_SERIAL_BAUDRATE;
+	if (ser_open(s) <= 0) {
+		return false;
+	}
+
+	LOG_NOTI_("Waiting for device to be ready: ");
+	uint32_t ntry = 0;
+	bool ret = ser_wait_ready(s, dfu_deadline(s, s->conf->timeout * 1000),
+							  s->conf->dfucmd != NULL, &ntry);
+	LOG_NL(LL_NOTICE);
+	s->stats.entry_retries += ntry;
+
+	if (!ret && !s->terminate) {
+		LOG_NOTI("Device didn't respond after %d seconds", s->conf->timeout);
+	}
+	return ret;
+}
+
+/* after updating the SoftDevice/Bootloader the device resets: wait until
+ * it stops answering or its port goes away, then for the new Bootloader */
+bool ser_wait_reset(struct dfu_session* s)
+{
+	struct ser_state* ser = &s->ser;
+	uint64_t deadline = ev_now_ms() + RESET_WAIT_MS;
+	uint32_t ntry = 0;
+
+	ser->timeout_ms = READY_PING_MS;
+	while (!s->terminate && ev_now_ms() < deadline && !ser->hung_up
+		   && !serial_port_changed(ser->fd, s->port)) {
+		ser_drain(ser);
+		if (!dfu_ping(s)) {
+			break;
+		}
+		ev_sleep(READY_PING_MS);
+	}
+
+	bool ret = ser_wait_ready(s, dfu_deadline(s, s->conf->timeout * 1000),
+							  false, &ntry);
+	s->stats.entry_retries += ntry;
 	return ret;
 }
 
-void ser_fini(void)
+void ser_fini(struct dfu_session* s)
 {
-	terminate = true;
-	if (ser_fd > 0) {
-		serial_fini(ser_fd);
-		ser_fd = -1;
+	struct ser_state* ser = &s->ser;
+
+	s->terminate = true;
+	if (ser->fd > 0) {
+		if (ser->lowlat_set) {
+			serial_set_low_latency(ser->fd, false, NULL);
+		}
+		if (ser->old_latency >= 0) {
+			serial_set_latency_timer(s->port, ser->old_latency, NULL);
+		}
+		serial_fini(ser->fd, &ser->otty);
+		ser->fd = -1;
 	}
+	arena_release(ser->tx_buf);
+	ser->tx_buf = NULL;
+	ser->tx_mtu = 0;
 }
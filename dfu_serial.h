@@ -23,14 +23,62 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <termios.h>
 
-/* SLIP buffer size should be bigger than MTU */
-#define BUF_SIZE	  100
-#define SLIP_BUF_SIZE (BUF_SIZE * 2 + 1)
+#include "conf.h"
 
-bool ser_enter_dfu(void);
-bool ser_encode_write(uint8_t* req, size_t len, int timeout_sec);
-const uint8_t* ser_read_decode(int timeout_sec);
-void ser_fini(void);
+/* MTU used until the Bootloader told us its own */
+#define SER_DEFAULT_MTU 64
+
+/* response timeouts in ms */
+#define SER_TIMEOUT_DEFAULT 1000 /* for writing */
+
+#define SER_RX_BUF_SIZE	  100  /* responses are small */
+#define SER_RX_RING_SIZE  1024 /* power of two */
+#define SER_TX_QUEUE_SIZE 4096 /* power of two */
+
+struct dfu_session;
+
+/* Serial port of one session */
+struct ser_state {
+	int fd;
+	int dfu_speed;
+	int timeout_ms; /* limits responses while waiting for the device, or 0 */
+	struct termios otty;
+	bool lowlat_set; /* ASYNC_LOW_LATENCY to be cleared again */
+	int old_latency; /* latency timer to be restored, -1 = none */
+	bool hung_up;	 /* the fd is dead, it has to be opened again */
+	uint8_t buf[SER_RX_BUF_SIZE];
+	uint8_t* tx_buf;
+	size_t tx_mtu;
+
+	/* Receive ring buffer: we read as much as is available at once and
+	 * decode SLIP frames out of it. Bytes after the end of a frame stay
+	 * here for the next call. head and tail are free running. */
+	struct {
+		uint8_t data[SER_RX_RING_SIZE];
+		size_t head;
+		size_t tail;
+	} rx;
+
+	/* Transmit queue: frames are written as far as the port takes them
+	 * without blocking, the rest is sent while we prepare the next frame
+	 * or wait for a response. */
+	struct {
+		uint8_t data[SER_TX_QUEUE_SIZE];
+		size_t head;
+		size_t tail;
+	} tx;
+};
+
+bool ser_profile_parse(const char* name, enum SER_PROFILE* prof);
+bool ser_enter_dfu(struct dfu_session* s);
+bool ser_wait_reset(struct dfu_session* s);
+bool ser_set_mtu(struct dfu_session* s, size_t mtu);
+bool ser_encode_write(struct dfu_session* s, uint8_t* req, size_t len,
+					  int timeout_ms);
+const uint8_t* ser_read_decode(struct dfu_session* s, int timeout_ms);
+bool ser_recover(struct dfu_session* s, int wait_ms);
+void ser_fini(struct dfu_session* s);
 
 #endif
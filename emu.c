@@ -0,0 +1,545 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * nrfdfu-emu: an emulated Nordic serial DFU Bootloader on a pseudo
+ * terminal, for testing and benchmarking nrfdfu without hardware.
+ *
+ * It prints the name of the terminal to use with "nrfdfu serial -p" and
+ * keeps running until it is killed, so several updates can be sent to it.
+ * Like the real Bootloader it keeps the received data between updates.
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "initpkt.h"
+#include "log.h"
+#include "nrf_dfu_req_handler.h"
+#include "slip.h"
+#include "util.h"
+
+#define EMU_CMD_MAX	   512			/* like INIT_COMMAND_MAX_SIZE */
+#define EMU_FLASH_SIZE (1024 * 1024) /* largest image */
+
+static struct {
+	int mtu;		   /* reported with MTU_GET, SLIP encoded */
+	uint32_t max_obj;  /* data object size */
+	int latency_us;	   /* before each response */
+	int exec_ms;	   /* writing a data object to flash */
+	int error_rate;	   /* corrupt one in error_rate data bytes */
+	int baud;		   /* limit the rate of the link, 0 = no limit */
+	const char* out;   /* write the image here after each execute */
+} opt = {
+	.mtu = 131,
+	.max_obj = 4096,
+};
+
+/* what the Bootloader has received */
+static struct {
+	uint8_t type; /* selected object type */
+	uint16_t prn;
+	uint16_t prn_cnt;
+
+	uint8_t cmd[EMU_CMD_MAX];
+	uint32_t cmd_len;
+	uint32_t cmd_size;
+	uint32_t cmd_crc;
+	bool cmd_valid;
+
+	uint8_t* img;
+	uint32_t data_len;
+	uint32_t data_crc;
+	uint32_t data_end;	/* of the current object */
+	uint32_t executed; /* end of the last executed object */
+
+	struct init_info init; /* of the executed Init packet */
+	uint32_t app_version;  /* the installed Application, if app_len > 0 */
+	uint32_t app_len;
+
+	uint64_t link_us; /* when the link is idle again */
+	unsigned long errors;
+} st;
+
+static volatile bool terminate;
+
+static void signal_handler(__attribute__((unused)) int signo)
+{
+	terminate = true;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* with a baud rate, sending or receiving len bytes takes this long */
+static void link_delay(size_t len)
+{
+	if (opt.baud == 0) {
+		return;
+	}
+
+	uint64_t now = now_us();
+	st.link_us = MAX(st.link_us, now) + len * 10 * 1000000ULL / opt.baud;
+	if (st.link_us > now) {
+		usleep(st.link_us - now);
+	}
+}
+
+static void respond(int fd, nrf_dfu_op_t req, nrf_dfu_result_t res,
+					const void* data, size_t len)
+{
+	uint8_t buf[3 + sizeof(nrf_dfu_response_t)] = {NRF_DFU_OP_RESPONSE, req,
+												   res};
+	uint8_t enc[sizeof(buf) * 2 + 1];
+	uint32_t enc_len;
+
+	if (opt.latency_us > 0) {
+		usleep(opt.latency_us);
+	}
+
+	len = MIN(len, sizeof(buf) - 3);
+	if (len > 0) {
+		memcpy(buf + 3, data, len);
+	}
+	slip_encode_bulk(enc, buf, 3 + len, &enc_len);
+	link_delay(enc_len);
+	if (write(fd, enc, enc_len) != enc_len) {
+		LOG_ERR("Write error: %s", strerror(errno));
+	}
+	if (log_level >= LL_DEBUG) {
+		dump_data("TX: ", buf, 3 + len);
+	}
+}
+
+static void respond_crc(int fd, nrf_dfu_op_t req)
+{
+	nrf_dfu_response_crc_t crc;
+	if (st.type == NRF_DFU_OBJ_TYPE_COMMAND) {
+		crc.offset = htole32(st.cmd_len);
+		crc.crc = htole32(st.cmd_crc);
+	} else {
+		crc.offset = htole32(st.data_len);
+		crc.crc = htole32(st.data_crc);
+	}
+	respond(fd, req, NRF_DFU_RES_CODE_SUCCESS, &crc, sizeof(crc));
+}
+
+static void save_image(void)
+{
+	if (opt.out == NULL) {
+		return;
+	}
+
+	FILE* f = fopen(opt.out, "w");
+	if (f == NULL || fwrite(st.img, 1, st.executed, f) != st.executed) {
+		LOG_ERR("Could not write '%s'", opt.out);
+	}
+	if (f) {
+		fclose(f);
+	}
+}
+
+static nrf_dfu_result_t handle_select(uint8_t type,
+									  nrf_dfu_response_select_t* sel)
+{
+	if (type == NRF_DFU_OBJ_TYPE_COMMAND) {
+		sel->max_size = htole32(EMU_CMD_MAX);
+		sel->offset = htole32(st.cmd_len);
+		sel->crc = htole32(st.cmd_crc);
+	} else if (type == NRF_DFU_OBJ_TYPE_DATA) {
+		sel->max_size = htole32(opt.max_obj);
+		sel->offset = htole32(st.data_len);
+		sel->crc = htole32(st.data_crc);
+	} else {
+		return NRF_DFU_RES_CODE_INVALID_PARAMETER;
+	}
+	st.type = type;
+	return NRF_DFU_RES_CODE_SUCCESS;
+}
+
+static nrf_dfu_result_t handle_create(uint8_t type, uint32_t size)
+{
+	st.prn_cnt = 0;
+
+	if (type == NRF_DFU_OBJ_TYPE_COMMAND) {
+		if (size == 0 || size > EMU_CMD_MAX) {
+			return NRF_DFU_RES_CODE_INSUFFICIENT_RESOURCES;
+		}
+		/* a new Init packet drops all data */
+		st.cmd_len = st.cmd_crc = 0;
+		st.cmd_size = size;
+		st.cmd_valid = false;
+		st.data_len = st.data_crc = st.executed = 0;
+		st.app_len = 0;
+	} else if (type == NRF_DFU_OBJ_TYPE_DATA) {
+		if (!st.cmd_valid) {
+			return NRF_DFU_RES_CODE_OPERATION_NOT_PERMITTED;
+		}
+		if (size == 0 || size > opt.max_obj
+			|| st.executed + size > EMU_FLASH_SIZE) {
+			return NRF_DFU_RES_CODE_INSUFFICIENT_RESOURCES;
+		}
+		/* data after the last executed object is dropped */
+		st.data_len = st.executed;
+		st.data_crc = crc32(0, st.img, st.executed);
+		st.data_end = st.executed + size;
+	} else {
+		return NRF_DFU_RES_CODE_UNSUPPORTED_TYPE;
+	}
+	st.type = type;
+	return NRF_DFU_RES_CODE_SUCCESS;
+}
+
+static void handle_write(int fd, uint8_t* data, size_t len)
+{
+	if (st.type == NRF_DFU_OBJ_TYPE_COMMAND) {
+		len = MIN(len, st.cmd_size - st.cmd_len);
+		memcpy(st.cmd + st.cmd_len, data, len);
+		st.cmd_crc = crc32(st.cmd_crc, data, len);
+		st.cmd_len += len;
+	} else if (st.type == NRF_DFU_OBJ_TYPE_DATA) {
+		len = MIN(len, st.data_end - st.data_len);
+		for (size_t i = 0; opt.error_rate > 0 && i < len; i++) {
+			/* as if a bit had flipped on the link, only the CRC finds it */
+			if (rand() % opt.error_rate == 0) {
+				data[i] ^= 1 << (rand() % 8);
+				st.errors++;
+			}
+		}
+		memcpy(st.img + st.data_len, data, len);
+		st.data_crc = crc32(st.data_crc, data, len);
+		st.data_len += len;
+	} else {
+		return;
+	}
+
+	if (st.prn > 0 && ++st.prn_cnt >= st.prn) {
+		st.prn_cnt = 0;
+		respond_crc(fd, NRF_DFU_OP_CRC_GET);
+	}
+}
+
+static nrf_dfu_result_t handle_execute(void)
+{
+	if (st.type == NRF_DFU_OBJ_TYPE_COMMAND) {
+		if (st.cmd_size == 0 || st.cmd_len != st.cmd_size) {
+			return NRF_DFU_RES_CODE_OPERATION_NOT_PERMITTED;
+		}
+		st.cmd_valid = true;
+		if (!init_parse(st.cmd, st.cmd_len, &st.init)) {
+			LOG_WARN("Could not parse Init packet");
+		}
+	} else if (st.type == NRF_DFU_OBJ_TYPE_DATA) {
+		/* executing the last object again is fine when resuming */
+		if (st.data_len != st.data_end && st.data_len != st.executed) {
+			return NRF_DFU_RES_CODE_OPERATION_NOT_PERMITTED;
+		}
+		if (opt.exec_ms > 0) {
+			usleep(opt.exec_ms * 1000);
+		}
+		st.executed = st.data_len;
+		save_image();
+		/* complete, it is now the installed Application */
+		if (st.init.type == INIT_FW_APPLICATION
+			&& st.executed == st.init.app_size) {
+			st.app_version = st.init.fw_version;
+			st.app_len = st.executed;
+		}
+	} else {
+		return NRF_DFU_RES_CODE_OPERATION_NOT_PERMITTED;
+	}
+	LOG_INF("Executed object %d, %u bytes", st.type,
+			st.type == NRF_DFU_OBJ_TYPE_COMMAND ? st.cmd_len : st.executed);
+	return NRF_DFU_RES_CODE_SUCCESS;
+}
+
+/* image 0 is the Bootloader, 1 the Application once it was received */
+static nrf_dfu_result_t handle_fw_version(uint8_t num,
+										  nrf_dfu_response_firmware_t* fw)
+{
+	if (num == 0) {
+		fw->type = NRF_DFU_FIRMWARE_TYPE_BOOTLOADER;
+		fw->version = htole32(1);
+		fw->addr = htole32(0x78000);
+		fw->len = htole32(0x6000);
+	} else if (num == 1 && st.app_len > 0) {
+		fw->type = NRF_DFU_FIRMWARE_TYPE_APPLICATION;
+		fw->version = htole32(st.app_version);
+		fw->addr = htole32(0x26000);
+		fw->len = htole32(st.app_len);
+	} else {
+		return NRF_DFU_RES_CODE_INVALID_PARAMETER;
+	}
+	return NRF_DFU_RES_CODE_SUCCESS;
+}
+
+/* one decoded SLIP frame */
+static void handle_request(int fd, uint8_t* buf, size_t len)
+{
+	nrf_dfu_request_t* req = (nrf_dfu_request_t*)buf;
+	nrf_dfu_response_select_t sel;
+	nrf_dfu_result_t res;
+
+	if (log_level >= LL_DEBUG) {
+		dump_data("RX: ", buf, len);
+	}
+	if (len == 0) {
+		return;
+	}
+
+	switch (req->request) {
+	case NRF_DFU_OP_OBJECT_WRITE:
+		handle_write(fd, buf + 1, len - 1);
+		break;
+	case NRF_DFU_OP_PING:
+		respond(fd, req->request, NRF_DFU_RES_CODE_SUCCESS, &req->ping.id, 1);
+		break;
+	case NRF_DFU_OP_MTU_GET: {
+		uint16_t mtu = htole16(opt.mtu);
+		respond(fd, req->request, NRF_DFU_RES_CODE_SUCCESS, &mtu, 2);
+		break;
+	}
+	case NRF_DFU_OP_RECEIPT_NOTIF_SET:
+		st.prn = le16toh(req->prn.target);
+		st.prn_cnt = 0;
+		respond(fd, req->request, NRF_DFU_RES_CODE_SUCCESS, NULL, 0);
+		break;
+	case NRF_DFU_OP_OBJECT_SELECT:
+		res = handle_select(req->select.object_type, &sel);
+		respond(fd, req->request, res, &sel,
+				res == NRF_DFU_RES_CODE_SUCCESS ? sizeof(sel) : 0);
+		break;
+	case NRF_DFU_OP_OBJECT_CREATE:
+		res = handle_create(req->create.object_type,
+							le32toh(req->create.object_size));
+		respond(fd, req->request, res, NULL, 0);
+		break;
+	case NRF_DFU_OP_CRC_GET:
+		respond_crc(fd, req->request);
+		break;
+	case NRF_DFU_OP_OBJECT_EXECUTE:
+		res = handle_execute();
+		respond(fd, req->request, res, NULL, 0);
+		break;
+	case NRF_DFU_OP_FIRMWARE_VERSION: {
+		nrf_dfu_response_firmware_t fw;
+		res = handle_fw_version(req->firmware.image_number, &fw);
+		respond(fd, req->request, res, &fw,
+				res == NRF_DFU_RES_CODE_SUCCESS ? sizeof(fw) : 0);
+		break;
+	}
+	case NRF_DFU_OP_HARDWARE_VERSION: {
+		/* an nRF52832 */
+		nrf_dfu_response_hardware_t hw = {
+			.part = htole32(0x52832),
+			.variant = htole32(0x41414530),
+			.memory.rom_size = htole32(512 * 1024),
+			.memory.ram_size = htole32(64 * 1024),
+			.memory.rom_page_size = htole32(4096),
+		};
+		respond(fd, req->request, NRF_DFU_RES_CODE_SUCCESS, &hw, sizeof(hw));
+		break;
+	}
+	case NRF_DFU_OP_ABORT:
+		respond(fd, req->request, NRF_DFU_RES_CODE_SUCCESS, NULL, 0);
+		break;
+	default:
+		respond(fd, req->request, NRF_DFU_RES_CODE_OP_CODE_NOT_SUPPORTED,
+				NULL, 0);
+		break;
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"Usage: nrfdfu-emu [options]\n"
+			"Emulated Nordic serial DFU Bootloader on a pseudo terminal\n"
+			"Options:\n"
+			"  -h, --help\t\tShow help\n"
+			"  -v, --verbose=<level>\tLog level 1 or 2 (-vv)\n"
+			"  -m, --mtu <num>\tMTU reported to nrfdfu (131)\n"
+			"  -o, --object <num>\tMaximum data object size (4096)\n"
+			"  -l, --latency <us>\tDelay before each response\n"
+			"  -x, --execute <ms>\tTime to write an object to flash\n"
+			"  -e, --errors <num>\tCorrupt one in <num> data bytes\n"
+			"  -b, --baud <num>\tLimit the link to <num> baud\n"
+			"  -w, --write <file>\tWrite the received image to <file>\n");
+}
+
+static struct option options[] = {{"help", no_argument, NULL, 'h'},
+								  {"verbose", optional_argument, NULL, 'v'},
+								  {"mtu", required_argument, NULL, 'm'},
+								  {"object", required_argument, NULL, 'o'},
+								  {"latency", required_argument, NULL, 'l'},
+								  {"execute", required_argument, NULL, 'x'},
+								  {"errors", required_argument, NULL, 'e'},
+								  {"baud", required_argument, NULL, 'b'},
+								  {"write", required_argument, NULL, 'w'},
+								  {NULL, 0, NULL, 0}};
+
+static void emu_options(int argc, char* argv[])
+{
+	int n;
+
+	log_level = LL_NOTICE;
+
+	while ((n = getopt_long(argc, argv, "hv::m:o:l:x:e:b:w:", options, NULL))
+		   >= 0) {
+		switch (n) {
+		case 'v':
+			log_level = LL_INFO;
+			if (optarg && *optarg == 'v') {
+				log_level = LL_DEBUG;
+			}
+			break;
+		case 'm':
+			opt.mtu = atoi(optarg);
+			break;
+		case 'o':
+			opt.max_obj = atoi(optarg);
+			break;
+		case 'l':
+			opt.latency_us = atoi(optarg);
+			break;
+		case 'x':
+			opt.exec_ms = atoi(optarg);
+			break;
+		case 'e':
+			opt.error_rate = atoi(optarg);
+			break;
+		case 'b':
+			opt.baud = atoi(optarg);
+			break;
+		case 'w':
+			opt.out = optarg;
+			break;
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (opt.mtu < 3 || opt.max_obj == 0 || opt.max_obj > EMU_FLASH_SIZE) {
+		LOG_ERR("Invalid MTU or object size");
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	struct termios tty;
+	uint8_t rx[4096];
+
+	emu_options(argc, argv);
+
+	struct sigaction act = {.sa_handler = signal_handler};
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+
+	st.img = malloc(EMU_FLASH_SIZE);
+	uint8_t* frame = malloc(opt.mtu);
+	if (st.img == NULL || frame == NULL) {
+		LOG_ERR("Out of memory");
+		return EXIT_FAILURE;
+	}
+
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+		LOG_ERR("Could not create pseudo terminal: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* keep the other side open, so our side doesn't hang up when nrfdfu
+	 * closes it, and make it raw until nrfdfu configures it */
+	const char* name = ptsname(fd);
+	int slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0 || tcgetattr(slave, &tty) < 0) {
+		LOG_ERR("Could not open '%s'", name);
+		return EXIT_FAILURE;
+	}
+	cfmakeraw(&tty);
+	tcsetattr(slave, TCSANOW, &tty);
+
+	printf("%s\n", name);
+	fflush(stdout);
+
+	slip_t slip = {.p_buffer = frame,
+				   .current_index = 0,
+				   .buffer_len = opt.mtu,
+				   .state = SLIP_STATE_DECODING};
+
+	while (!terminate) {
+		ssize_t n = read(fd, rx, sizeof(rx));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG_ERR("Read error: %s", strerror(errno));
+			break;
+		}
+		link_delay(n);
+
+		for (uint32_t pos = 0, used; pos < n; pos += used) {
+			int ret = slip_decode_bulk(&slip, rx + pos, n - pos, &used);
+			if (ret == 1) {
+				/* the MTU is for the frame as sent, with escapes and END.
+				 * The encoding is unique, so it follows from the data */
+				uint32_t len = slip.current_index;
+				if (slip_encode_fit(frame, len, opt.mtu) < len) {
+					LOG_WARN("Frame exceeds MTU %d after SLIP", opt.mtu);
+				} else {
+					handle_request(fd, frame, len);
+				}
+				slip.current_index = 0;
+			} else if (ret == -1) {
+				/* like the Bootloader, drop frames longer than the MTU */
+				LOG_WARN("Frame exceeds MTU %d", opt.mtu);
+				slip.current_index = 0;
+				slip.state = SLIP_STATE_CLEARING_INVALID_PACKET;
+				used = 0;
+			}
+		}
+	}
+
+	if (opt.error_rate > 0) {
+		LOG_NOTI("Corrupted %lu bytes", st.errors);
+	}
+	close(slave);
+	close(fd);
+	free(frame);
+	free(st.img);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,325 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "log.h"
+
+#define EV_STACK_SIZE (256 * 1024)
+#define EV_MAX_EVENTS 16
+
+struct ev_task {
+	ucontext_t ctx;
+	void* stack;
+	ev_task_fn fn;
+	void* arg;
+	const char* name;
+	bool started;
+	bool done;
+
+	/* what the task is waiting for */
+	bool waiting;
+	bool armed;		   /* for events on fd */
+	int fd;			   /* registered with epoll, or -1 */
+	uint64_t deadline; /* in ms, 0 = none */
+	int revents;
+
+	struct ev_task* next;
+};
+
+static int epfd = -1;
+static ucontext_t loop_ctx;
+static struct ev_task* tasks;
+static __thread struct ev_task* current;
+
+uint64_t ev_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* time left until the deadline, 0 when it has passed */
+int ev_remain_ms(uint64_t deadline)
+{
+	uint64_t now = ev_now_ms();
+	return now < deadline ? deadline - now : 0;
+}
+
+static void ev_trampoline(void)
+{
+	struct ev_task* t = current;
+	t->fn(t->arg);
+	t->done = true;
+	/* uc_link returns to the loop */
+}
+
+bool ev_init(void)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		LOG_ERR("Could not create event loop: %s", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* the task is started by the next ev_run(). name is used as log prefix
+ * while it runs */
+bool ev_task_start(ev_task_fn fn, void* arg, const char* name)
+{
+	struct ev_task* t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		LOG_ERR("Could not allocate task");
+		return false;
+	}
+
+	t->stack = mmap(NULL, EV_STACK_SIZE, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (t->stack == MAP_FAILED) {
+		LOG_ERR("Could not allocate task stack");
+		free(t);
+		return false;
+	}
+	/* guard page at the bottom, overflows crash instead of corrupting */
+	mprotect(t->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+
+	getcontext(&t->ctx);
+	t->ctx.uc_stack.ss_sp = t->stack;
+	t->ctx.uc_stack.ss_size = EV_STACK_SIZE;
+	t->ctx.uc_link = &loop_ctx;
+	makecontext(&t->ctx, ev_trampoline, 0);
+
+	t->fn = fn;
+	t->arg = arg;
+	t->name = name;
+	t->fd = -1;
+
+	/* keep the order in which they were started */
+	struct ev_task** p = &tasks;
+	while (*p != NULL) {
+		p = &(*p)->next;
+	}
+	*p = t;
+	return true;
+}
+
+/* run t until it waits again or is done */
+static void ev_resume(struct ev_task* t, int revents)
+{
+	t->waiting = false;
+	t->revents = revents;
+
+	current = t;
+	log_set_prefix(t->name);
+	swapcontext(&loop_ctx, &t->ctx);
+	log_set_prefix(NULL);
+	current = NULL;
+
+	/* the fd is closed by the task itself, which removes it from epoll
+	 * with ev_forget(), so it is not touched here: its number may be in
+	 * use by another task already */
+	if (t->done && t->stack != NULL) {
+		munmap(t->stack, EV_STACK_SIZE);
+		t->stack = NULL;
+	}
+}
+
+/* stop a timed out wait from being woken by its fd later */
+static void ev_disarm(struct ev_task* t)
+{
+	if (t->armed) {
+		struct epoll_event ev = {.events = EPOLLONESHOT, .data.ptr = t};
+		epoll_ctl(epfd, EPOLL_CTL_MOD, t->fd, &ev);
+		t->armed = false;
+	}
+}
+
+static bool ev_arm(struct ev_task* t, int fd, short events)
+{
+	/* the values of POLLIN and POLLOUT are the same for epoll */
+	struct epoll_event ev = {.events = events | EPOLLONESHOT, .data.ptr = t};
+
+	/* a previous fd is not removed here: it may be closed and its number
+	 * in use by another task already. It stays registered without
+	 * events until ev_forget() or its close */
+	int ret = -1;
+	if (t->fd == fd) {
+		ret = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+	}
+	/* first wait on fd or it was closed and opened again since */
+	if (ret < 0) {
+		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+	/* waited on before, then on another fd */
+	if (ret < 0 && errno == EEXIST) {
+		ret = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+	}
+	if (ret < 0) {
+		LOG_ERR("Could not wait for fd %d: %s", fd, strerror(errno));
+		t->fd = -1;
+		return false;
+	}
+
+	t->fd = fd;
+	t->armed = true;
+	return true;
+}
+
+void ev_forget(int fd)
+{
+	bool registered = false;
+
+	for (struct ev_task* t = tasks; t != NULL; t = t->next) {
+		if (t->fd == fd) {
+			t->fd = -1;
+			t->armed = false;
+			registered = true;
+		}
+	}
+	if (registered && epfd >= 0) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	}
+}
+
+/** run the tasks for up to timeout_ms. returns false when all tasks are
+ * done, so the caller can do something (like showing progress) between
+ * calls */
+bool ev_run(int timeout_ms)
+{
+	struct epoll_event evs[EV_MAX_EVENTS];
+	uint64_t end = ev_now_ms() + timeout_ms;
+
+	while (true) {
+		int alive = 0;
+		uint64_t next = end;
+
+		for (struct ev_task* t = tasks; t != NULL; t = t->next) {
+			if (!t->started) {
+				t->started = true;
+				ev_resume(t, 0);
+			}
+			if (t->done) {
+				continue;
+			}
+			alive++;
+			if (t->waiting && t->deadline > 0 && t->deadline < next) {
+				next = t->deadline;
+			}
+		}
+
+		if (alive == 0) {
+			return false;
+		}
+
+		uint64_t now = ev_now_ms();
+		if (now >= end) {
+			return true;
+		}
+
+		int n = epoll_wait(epfd, evs, EV_MAX_EVENTS,
+						   next > now ? next - now : 0);
+		if (n < 0) {
+			/* interrupted by a signal, all tasks have to check if they
+			 * should stop */
+			int err = errno;
+			if (err != EINTR) {
+				LOG_ERR("Event loop: %s", strerror(err));
+			}
+			for (struct ev_task* t = tasks; t != NULL; t = t->next) {
+				if (t->waiting) {
+					ev_disarm(t);
+					ev_resume(t, err == EINTR ? 0 : -1);
+				}
+			}
+			continue;
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct ev_task* t = evs[i].data.ptr;
+			/* ignore events which were already pending when the wait
+			 * timed out */
+			if (t->waiting && t->armed) {
+				t->armed = false;
+				ev_resume(t, evs[i].events);
+			}
+		}
+
+		now = ev_now_ms();
+		for (struct ev_task* t = tasks; t != NULL; t = t->next) {
+			if (t->waiting && t->deadline > 0 && t->deadline <= now) {
+				ev_disarm(t);
+				ev_resume(t, 0);
+			}
+		}
+	}
+}
+
+void ev_fini(void)
+{
+	while (tasks != NULL) {
+		struct ev_task* t = tasks;
+		tasks = t->next;
+		if (t->stack != NULL) {
+			munmap(t->stack, EV_STACK_SIZE);
+		}
+		free(t);
+	}
+	if (epfd >= 0) {
+		close(epfd);
+		epfd = -1;
+	}
+}
+
+int ev_wait(int fd, short events, int timeout_ms)
+{
+	struct ev_task* t = current;
+
+	if (t == NULL) {
+		struct pollfd pfd = {.fd = fd, .events = events};
+		int ret = poll(&pfd, 1, timeout_ms);
+		if (ret < 0 && errno == EINTR) {
+			return 0;
+		}
+		return ret > 0 ? pfd.revents : ret;
+	}
+
+	if (fd >= 0 && !ev_arm(t, fd, events)) {
+		return -1;
+	}
+	t->deadline = timeout_ms >= 0 ? ev_now_ms() + timeout_ms : 0;
+	t->waiting = true;
+
+	swapcontext(&t->ctx, &loop_ctx);
+	return t->revents;
+}
+
+void ev_sleep(int ms)
+{
+	ev_wait(-1, 0, ms);
+}
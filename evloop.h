@@ -0,0 +1,53 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Event loop driving many sessions from one thread: each task runs on its
+ * own stack and gives control back to the loop whenever it waits for a
+ * file descriptor or a timeout with ev_wait(). The sequential DFU code
+ * stays as it is.
+ *
+ * Outside of a task ev_wait() simply polls, so the same code also works
+ * without the loop.
+ */
+
+typedef void (*ev_task_fn)(void* arg);
+
+bool ev_init(void);
+bool ev_task_start(ev_task_fn fn, void* arg, const char* name);
+bool ev_run(int timeout_ms);
+void ev_fini(void);
+
+/* events are POLLIN and POLLOUT. returns the events which are ready, 0 on
+ * timeout or interruption by a signal and -1 on error */
+int ev_wait(int fd, short events, int timeout_ms);
+void ev_sleep(int ms);
+/* remove fd from the loop, before it is closed */
+void ev_forget(int fd);
+uint64_t ev_now_ms(void);
+int ev_remain_ms(uint64_t deadline);
+
+#endif
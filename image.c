@@ -0,0 +1,767 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "crc.h"
+#include "image.h"
+#include "log.h"
+#include "stats.h"
+#include "util.h"
+
+#define ZIP_EOCD_SIG	0x06054b50
+#define ZIP_CDIR_SIG	0x02014b50
+#define ZIP_LOCAL_SIG	0x04034b50
+#define ZIP_EOCD_LEN	22
+#define ZIP_CDIR_LEN	46
+#define ZIP_LOCAL_LEN	30
+#define ZIP_COMMENT_MAX 0xffff
+
+#define IMAGE_READ_CHUNK (64 * 1024) /* from an image_read_fn */
+
+enum ahead_state { AHEAD_IDLE, AHEAD_BUSY, AHEAD_DONE, AHEAD_FAILED };
+
+/* The reader thread of a streamed image: while one part of the image is
+ * sent, it reads and CRCs the next one into the second buffer */
+struct image_ahead {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct image_window* win;
+	uint32_t* crc_at;
+	uint8_t* buf;
+	size_t cap;
+	size_t start; /* image offsets of the part in buf */
+	size_t end;
+	enum ahead_state state;
+	bool quit;
+};
+
+bool zip_map_open(struct zip_map* map, const char* path)
+{
+	struct stat st;
+
+	map->data = NULL;
+	map->len = 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < ZIP_EOCD_LEN) {
+		close(fd);
+		return false;
+	}
+
+	void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return false;
+	}
+
+	map->data = p;
+	map->len = st.st_size;
+	return true;
+}
+
+void zip_map_close(struct zip_map* map)
+{
+	if (map->data) {
+		munmap((void*)map->data, map->len);
+		map->data = NULL;
+		map->len = 0;
+	}
+}
+
+/* find the data of an uncompressed entry in the mapped ZIP file by
+ * walking the central directory. ZIP64 is not handled, such entries are
+ * just read through libzip */
+static const uint8_t* zip_map_find(const struct zip_map* map, const char* name,
+								   size_t size)
+{
+	const uint8_t* d = map->data;
+	size_t len = map->len;
+	size_t namelen = strlen(name);
+	size_t eocd = len - ZIP_EOCD_LEN;
+	size_t min = len > ZIP_EOCD_LEN + ZIP_COMMENT_MAX
+					 ? len - ZIP_EOCD_LEN - ZIP_COMMENT_MAX
+					 : 0;
+
+	while (get_le32(d + eocd) != ZIP_EOCD_SIG) {
+		if (eocd == min) {
+			return NULL;
+		}
+		eocd--;
+	}
+
+	uint16_t entries = get_le16(d + eocd + 10);
+	size_t pos = get_le32(d + eocd + 16);
+
+	for (int i = 0; i < entries; i++) {
+		if (pos + ZIP_CDIR_LEN > len || get_le32(d + pos) != ZIP_CDIR_SIG) {
+			return NULL;
+		}
+		uint16_t method = get_le16(d + pos + 10);
+		uint32_t csize = get_le32(d + pos + 20);
+		uint16_t nlen = get_le16(d + pos + 28);
+		uint16_t xlen = get_le16(d + pos + 30);
+		uint16_t clen = get_le16(d + pos + 32);
+		size_t local = get_le32(d + pos + 42);
+
+		if (pos + ZIP_CDIR_LEN + nlen > len) {
+			return NULL;
+		}
+
+		if (nlen == namelen
+			&& memcmp(d + pos + ZIP_CDIR_LEN, name, namelen) == 0) {
+			if (method != ZIP_CM_STORE || csize != size
+				|| local + ZIP_LOCAL_LEN > len
+				|| get_le32(d + local) != ZIP_LOCAL_SIG) {
+				return NULL;
+			}
+			size_t data = local + ZIP_LOCAL_LEN + get_le16(d + local + 26)
+						  + get_le16(d + local + 28);
+			if (data + size > len) {
+				return NULL;
+			}
+			return d + data;
+		}
+		pos += ZIP_CDIR_LEN + nlen + xlen + clen;
+	}
+	return NULL;
+}
+
+/* inflate the whole entry into a buffer */
+static uint8_t* zip_read_all(zip_t* zip, zip_uint64_t index, size_t size)
+{
+	uint8_t* buf = arena_alloc(size > 0 ? size : 1);
+	if (buf == NULL) {
+		LOG_ERR("Could not allocate %zd bytes", size);
+		return NULL;
+	}
+
+	zip_file_t* zf = zip_fopen_index(zip, index, 0);
+	if (zf == NULL) {
+		arena_release(buf);
+		return NULL;
+	}
+
+	size_t pos = 0;
+	while (pos < size) {
+		zip_int64_t len = zip_fread(zf, buf + pos, size - pos);
+		if (len <= 0) {
+			LOG_ERR("zip_fread error");
+			break;
+		}
+		pos += len;
+	}
+	zip_fclose(zf);
+
+	if (pos < size) {
+		arena_release(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static bool image_crc_prepare(struct dfu_image* img)
+{
+	size_t n = img->size / IMAGE_CRC_BLOCK;
+
+	img->crc_at = arena_alloc((n + 1) * sizeof(uint32_t));
+	if (img->crc_at == NULL) {
+		return false;
+	}
+
+	img->crc_at[0] = 0;
+	for (size_t i = 0; i < n; i++) {
+		img->crc_at[i + 1] = crc_update(img->crc_at[i],
+										img->data + i * IMAGE_CRC_BLOCK,
+										IMAGE_CRC_BLOCK);
+	}
+	return true;
+}
+
+bool image_load(struct dfu_image* img, zip_t* zip, const char* name,
+				const struct zip_map* map)
+{
+	struct zip_stat stat;
+
+	memset(img, 0, sizeof(*img));
+
+	zip_stat_init(&stat);
+	if (zip_stat(zip, name, 0, &stat) < 0) {
+		LOG_ERR("ZIP file does not contain %s", name);
+		return false;
+	}
+	img->size = stat.size;
+
+	if (map && map->data && (stat.valid & ZIP_STAT_COMP_METHOD)
+		&& stat.comp_method == ZIP_CM_STORE) {
+		img->data = zip_map_find(map, name, img->size);
+	}
+
+	if (img->data == NULL) {
+		img->buf = zip_read_all(zip, stat.index, img->size);
+		if (img->buf == NULL) {
+			LOG_ERR("Error reading %s in ZIP file", name);
+			return false;
+		}
+		img->data = img->buf;
+	}
+
+	if (!image_crc_prepare(img)) {
+		LOG_ERR("Could not allocate CRC table for %s", name);
+		image_free(img);
+		return false;
+	}
+
+	if ((stat.valid & ZIP_STAT_CRC) && image_crc(img, img->size) != stat.crc) {
+		LOG_ERR("CRC of %s does not match", name);
+		image_free(img);
+		return false;
+	}
+
+	LOG_INF("Loaded %s (%zd bytes%s)", name, img->size,
+			img->buf ? "" : ", mapped");
+	return true;
+}
+
+/* map a raw .dat or .bin file, which must not change while it is used */
+bool image_from_file(struct dfu_image* img, const char* path)
+{
+	struct stat st;
+
+	memset(img, 0, sizeof(*img));
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		LOG_ERR("Could not open '%s': %s", path, strerror(errno));
+		return false;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		LOG_ERR("File '%s' is empty", path);
+		close(fd);
+		return false;
+	}
+
+	void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		LOG_ERR("Could not map '%s': %s", path, strerror(errno));
+		return false;
+	}
+
+	img->data = p;
+	img->size = img->map_len = st.st_size;
+
+	if (!image_crc_prepare(img)) {
+		LOG_ERR("Could not allocate CRC table for %s", path);
+		image_free(img);
+		return false;
+	}
+
+	LOG_INF("Loaded %s (%zd bytes, mapped)", path, img->size);
+	return true;
+}
+
+/* use data of the caller directly, it has to stay until the image is freed */
+bool image_from_buffer(struct dfu_image* img, const uint8_t* data, size_t size)
+{
+	memset(img, 0, sizeof(*img));
+	img->data = data;
+	img->size = size;
+
+	if (!image_crc_prepare(img)) {
+		LOG_ERR("Could not allocate CRC table");
+		return false;
+	}
+	return true;
+}
+
+/* read the whole image from the source into a buffer, in chunks */
+bool image_from_read(struct dfu_image* img, size_t size, image_read_fn read,
+					 void* user)
+{
+	memset(img, 0, sizeof(*img));
+	img->size = size;
+
+	img->buf = arena_alloc(size > 0 ? size : 1);
+	if (img->buf == NULL) {
+		LOG_ERR("Could not allocate %zd bytes", size);
+		return false;
+	}
+	img->data = img->buf;
+
+	for (size_t pos = 0; pos < size; pos += IMAGE_READ_CHUNK) {
+		size_t n = MIN(size - pos, IMAGE_READ_CHUNK);
+		if (!read(user, pos, img->buf + pos, n)) {
+			LOG_ERR("Error reading image at %zu", pos);
+			image_free(img);
+			return false;
+		}
+	}
+
+	if (!image_crc_prepare(img)) {
+		LOG_ERR("Could not allocate CRC table");
+		image_free(img);
+		return false;
+	}
+	return true;
+}
+
+static void* ahead_run(void* arg)
+{
+	struct image_ahead* a = arg;
+	struct image_window* w = a->win;
+
+	pthread_mutex_lock(&a->lock);
+	for (;;) {
+		while (a->state != AHEAD_BUSY && !a->quit) {
+			pthread_cond_wait(&a->cond, &a->lock);
+		}
+		if (a->quit) {
+			break;
+		}
+		pthread_mutex_unlock(&a->lock);
+
+		/* the blocks before start are done, the sender only uses those */
+		bool ok = w->read(w->user, a->start, a->buf, a->end - a->start);
+		for (size_t i = a->start / IMAGE_CRC_BLOCK;
+			 ok && i < a->end / IMAGE_CRC_BLOCK; i++) {
+			a->crc_at[i + 1] = crc_update(
+				a->crc_at[i], a->buf + (i * IMAGE_CRC_BLOCK - a->start),
+				IMAGE_CRC_BLOCK);
+		}
+
+		pthread_mutex_lock(&a->lock);
+		a->state = ok ? AHEAD_DONE : AHEAD_FAILED;
+		pthread_cond_broadcast(&a->cond);
+	}
+	pthread_mutex_unlock(&a->lock);
+	return NULL;
+}
+
+/* without the thread the image is just read when it is fetched */
+static void ahead_init(struct dfu_image* img)
+{
+	struct image_ahead* a = arena_alloc(sizeof(*a));
+	if (a == NULL) {
+		return;
+	}
+
+	memset(a, 0, sizeof(*a));
+	a->win = img->win;
+	a->crc_at = img->crc_at;
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+	if (pthread_create(&a->thread, NULL, ahead_run, a) != 0) {
+		LOG_WARN("Could not start reader thread, reading while sending");
+		pthread_cond_destroy(&a->cond);
+		pthread_mutex_destroy(&a->lock);
+		arena_release(a);
+		return;
+	}
+	img->win->ahead = a;
+}
+
+static void ahead_fini(struct image_ahead* a)
+{
+	pthread_mutex_lock(&a->lock);
+	a->quit = true;
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+	pthread_join(a->thread, NULL);
+
+	pthread_cond_destroy(&a->cond);
+	pthread_mutex_destroy(&a->lock);
+	arena_release(a->buf);
+	arena_release(a);
+}
+
+/* the fetch starts before the part, which is added to the window */
+static bool ahead_append(struct image_window* w, struct image_ahead* a,
+						 size_t keep)
+{
+	size_t len = a->end - keep;
+
+	if (len > w->cap) {
+		uint8_t* buf = arena_realloc(w->buf, w->cap, len);
+		if (buf == NULL) {
+			return false;
+		}
+		w->buf = buf;
+		w->cap = len;
+	}
+	memmove(w->buf, w->buf + (keep - w->start), w->end - keep);
+	memcpy(w->buf + (w->end - keep), a->buf, a->end - a->start);
+	w->start = keep;
+	w->end = a->end;
+	return true;
+}
+
+/* Wait for the part read ahead and put it into the window for a fetch of
+ * keep to end. A part which is not needed yet, like when an object is sent
+ * again, is kept, one which does not fit any more is dropped */
+static void ahead_take(struct image_window* w, size_t keep, size_t end,
+					   struct image_ahead_stats* st)
+{
+	struct image_ahead* a = w->ahead;
+	bool waited = false;
+
+	pthread_mutex_lock(&a->lock);
+	if (a->state == AHEAD_IDLE) {
+		pthread_mutex_unlock(&a->lock);
+		return;
+	}
+	if (a->state == AHEAD_BUSY) {
+		uint64_t start = stats_now_us();
+		while (a->state == AHEAD_BUSY) {
+			pthread_cond_wait(&a->cond, &a->lock);
+		}
+		waited = true;
+		if (st != NULL) {
+			st->stalls++;
+			st->stall_us += stats_now_us() - start;
+		}
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	if (a->state == AHEAD_DONE && keep >= w->start && end <= w->end) {
+		return;
+	}
+
+	bool fits = a->state == AHEAD_DONE && a->start == w->end
+				&& keep >= w->start;
+	a->state = AHEAD_IDLE;
+	if (fits && keep >= a->start) {
+		/* swap the buffers, the window continues with the part */
+		uint8_t* buf = w->buf;
+		size_t cap = w->cap;
+		w->buf = a->buf;
+		w->cap = a->cap;
+		w->start = a->start;
+		w->end = a->end;
+		a->buf = buf;
+		a->cap = cap;
+	} else if (!fits || !ahead_append(w, a, keep)) {
+		/* read again by the fetch, if the source can */
+		if (st != NULL) {
+			st->dropped++;
+		}
+		return;
+	}
+	if (st != NULL && !waited) {
+		st->ready++;
+	}
+}
+
+/* read the part after the window, of len bytes like the fetch before */
+static void ahead_start(const struct dfu_image* img, size_t offset, size_t len,
+						struct image_ahead_stats* st)
+{
+	struct image_window* w = img->win;
+	struct image_ahead* a = w->ahead;
+
+	if (len == 0 || a->state != AHEAD_IDLE || w->end >= img->size
+		|| w->end % IMAGE_CRC_BLOCK != 0) {
+		return;
+	}
+
+	size_t end = MIN(w->end + len, img->size);
+	if (end - w->end > a->cap) {
+		size_t cap = MAX(end - w->end, MIN(len + IMAGE_CRC_BLOCK, img->size));
+		uint8_t* buf = arena_realloc(a->buf, a->cap, cap);
+		if (buf == NULL) {
+			LOG_WARN("Not reading ahead, reading while sending");
+			ahead_fini(a);
+			w->ahead = NULL;
+			return;
+		}
+		a->buf = buf;
+		a->cap = cap;
+	}
+
+	pthread_mutex_lock(&a->lock);
+	a->start = w->end;
+	a->end = end;
+	a->state = AHEAD_BUSY;
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+
+	if (st != NULL) {
+		st->parts++;
+		st->depth_max = MAX(st->depth_max, end - offset);
+	}
+}
+
+/* stream the image from the source, only the part which is sent next is
+ * kept in memory, see image_fetch(). The next part is read by a thread
+ * while the current one is sent, read is never called from two threads at
+ * the same time */
+bool image_from_stream(struct dfu_image* img, size_t size, image_read_fn read,
+					   void* user)
+{
+	memset(img, 0, sizeof(*img));
+	img->size = size;
+	img->win = arena_alloc(sizeof(*img->win));
+	img->crc_at = arena_alloc((size / IMAGE_CRC_BLOCK + 1) * sizeof(uint32_t));
+	if (img->win == NULL || img->crc_at == NULL) {
+		LOG_ERR("Could not allocate stream of %zd bytes", size);
+		image_free(img);
+		return false;
+	}
+
+	memset(img->win, 0, sizeof(*img->win));
+	img->win->read = read;
+	img->win->user = user;
+	img->crc_at[0] = 0;
+	ahead_init(img);
+	return true;
+}
+
+/* a ZIP entry which is only open while it is read, see image_from_zip() */
+struct zip_entry {
+	zip_t* zip;
+	zip_uint64_t index;
+	const char* name;
+	zip_file_t* zf;
+	size_t pos;
+	size_t size;
+	uint32_t crc;
+	uint32_t want;
+};
+
+static bool zip_entry_read(void* user, size_t offset, uint8_t* buf, size_t len)
+{
+	struct zip_entry* e = user;
+
+	if (e->zf != NULL && offset < e->pos) {
+		zip_fclose(e->zf);
+		e->zf = NULL;
+	}
+	if (e->zf == NULL) {
+		e->zf = zip_fopen_index(e->zip, e->index, 0);
+		if (e->zf == NULL) {
+			LOG_ERR("Could not open %s in ZIP file", e->name);
+			return false;
+		}
+		e->pos = 0;
+		e->crc = 0;
+	}
+
+	/* deflated data can only be skipped by reading it */
+	while (e->pos < offset + len) {
+		uint8_t* p = buf;
+		size_t n = MIN(offset - e->pos, len);
+		if (e->pos >= offset) {
+			p = buf + (e->pos - offset);
+			n = offset + len - e->pos;
+		}
+		zip_int64_t ret = zip_fread(e->zf, p, n);
+		if (ret <= 0) {
+			LOG_ERR("Error reading %s in ZIP file", e->name);
+			return false;
+		}
+		e->crc = crc_update(e->crc, p, ret);
+		e->pos += ret;
+	}
+
+	/* the inflate state is only kept while the entry is read */
+	if (e->pos == e->size) {
+		zip_fclose(e->zf);
+		e->zf = NULL;
+		if (e->crc != e->want) {
+			LOG_ERR("CRC of %s does not match", e->name);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void zip_entry_close(void* user)
+{
+	struct zip_entry* e = user;
+
+	if (e->zf != NULL) {
+		zip_fclose(e->zf);
+	}
+	arena_release(e);
+}
+
+/* stream an entry of the ZIP file while it is sent, it is only open while
+ * it is read and can be read again from the start. The zip has to stay
+ * open while the image is used */
+bool image_from_zip(struct dfu_image* img, zip_t* zip, const char* name)
+{
+	struct zip_stat stat;
+
+	memset(img, 0, sizeof(*img));
+
+	zip_stat_init(&stat);
+	if (zip_stat(zip, name, 0, &stat) < 0 || !(stat.valid & ZIP_STAT_CRC)) {
+		LOG_ERR("ZIP file does not contain %s", name);
+		return false;
+	}
+
+	struct zip_entry* e = arena_alloc(sizeof(*e));
+	if (e == NULL) {
+		return false;
+	}
+	*e = (struct zip_entry){.zip = zip,
+							.index = stat.index,
+							.name = stat.name,
+							.size = stat.size,
+							.want = stat.crc};
+
+	if (!image_from_stream(img, stat.size, zip_entry_read, e)) {
+		arena_release(e);
+		return false;
+	}
+	img->win->close = zip_entry_close;
+	img->win->seek = true;
+
+	LOG_INF("Loaded %s (%zd bytes, streamed)", name, img->size);
+	return true;
+}
+
+/* make len bytes at offset available to image_data(). A streamed image is
+ * read up to there, dropping the data before the CRC block of offset.
+ * Skipping ahead reads the data in between for the CRCs, going back is
+ * only possible if the source can read again. Then the next len bytes are
+ * read ahead, the counters of this are added to st, which can be NULL */
+bool image_fetch(const struct dfu_image* img, size_t offset, size_t len,
+				 struct image_ahead_stats* st)
+{
+	struct image_window* w = img->win;
+
+	if (w == NULL) {
+		return true;
+	}
+
+	size_t keep = offset / IMAGE_CRC_BLOCK * IMAGE_CRC_BLOCK;
+	size_t end = MIN(offset + len, img->size);
+	for (;;) {
+		/* the reader must be done before the source is used here */
+		if (w->ahead != NULL) {
+			ahead_take(w, keep, end, st);
+		}
+		if (keep <= w->end) {
+			break;
+		}
+		if (!image_fetch(img, w->end, IMAGE_CRC_BLOCK, st)) {
+			return false;
+		}
+	}
+	if (keep < w->start && !w->seek) {
+		LOG_ERR("Can't seek to %zu in streamed image", offset);
+		return false;
+	}
+
+	if (keep < w->start) {
+		/* the CRCs up to keep are known already */
+		w->start = w->end = keep;
+	} else {
+		memmove(w->buf, w->buf + (keep - w->start), w->end - keep);
+		w->start = keep;
+	}
+
+	/* the first fetch is of a whole object, with room for the CRC block
+	 * before the next one, so the window does not have to grow later */
+	if (end - w->start > w->cap) {
+		size_t cap = MAX(end - w->start,
+						 MIN(len + IMAGE_CRC_BLOCK, img->size));
+		uint8_t* buf = arena_realloc(w->buf, w->cap, cap);
+		if (buf == NULL) {
+			LOG_ERR("Could not allocate %zd bytes", cap);
+			return false;
+		}
+		w->buf = buf;
+		w->cap = cap;
+	}
+
+	if (w->end < end) {
+		if (!w->read(w->user, w->end, w->buf + (w->end - w->start),
+					 end - w->end)) {
+			return false;
+		}
+
+		/* CRCs of the blocks which are complete now */
+		for (size_t i = w->end / IMAGE_CRC_BLOCK; i < end / IMAGE_CRC_BLOCK;
+			 i++) {
+			img->crc_at[i + 1] = crc_update(
+				img->crc_at[i], image_data(img, i * IMAGE_CRC_BLOCK),
+				IMAGE_CRC_BLOCK);
+		}
+		w->end = end;
+	}
+
+	if (w->ahead != NULL) {
+		ahead_start(img, offset, len, st);
+	}
+	return true;
+}
+
+/* data at offset, of a streamed image only what was fetched last */
+const uint8_t* image_data(const struct dfu_image* img, size_t offset)
+{
+	if (img->win != NULL) {
+		return img->win->buf + (offset - img->win->start);
+	}
+	return img->data + offset;
+}
+
+void image_free(struct dfu_image* img)
+{
+	if (img->map_len > 0) {
+		munmap((void*)img->data, img->map_len);
+	}
+	if (img->win != NULL) {
+		if (img->win->ahead != NULL) {
+			ahead_fini(img->win->ahead);
+		}
+		if (img->win->close != NULL) {
+			img->win->close(img->win->user);
+		}
+		arena_release(img->win->buf);
+		arena_release(img->win);
+	}
+	arena_release(img->buf);
+	arena_release(img->crc_at);
+	memset(img, 0, sizeof(*img));
+}
+
+/* CRC of the first offset bytes of the image */
+uint32_t image_crc(const struct dfu_image* img, size_t offset)
+{
+	offset = MIN(offset, img->size);
+	size_t i = offset / IMAGE_CRC_BLOCK;
+	size_t start = i * IMAGE_CRC_BLOCK;
+	return crc_update(img->crc_at[i], image_data(img, start), offset - start);
+}
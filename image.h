@@ -0,0 +1,99 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zip.h>
+
+/* CRCs are kept for every block of this size. Object sizes are always a
+ * multiple of the flash page size, which is never smaller than this */
+#define IMAGE_CRC_BLOCK 1024
+
+/* An image source which is not in memory: reads len bytes at offset into
+ * buf, returns false on error */
+typedef bool (*image_read_fn)(void* user, size_t offset, uint8_t* buf,
+							  size_t len);
+
+struct image_ahead;
+
+/* counters of reading streamed images ahead, for tuning */
+struct image_ahead_stats {
+	uint32_t parts;	   /* read ahead */
+	uint32_t ready;	   /* parts which were read before needed */
+	uint32_t stalls;   /* fetches which had to wait for the reader */
+	uint32_t dropped;  /* parts which could not be used */
+	uint64_t stall_us; /* waited for the reader */
+	size_t depth_max;  /* most bytes read ahead of a fetch */
+};
+
+/* The part of a streamed image in memory, which is read on demand and
+ * only moves forward */
+struct image_window {
+	image_read_fn read;
+	void* user;
+	uint8_t* buf;
+	size_t cap;
+	size_t start; /* image offset of buf[0] */
+	size_t end;	  /* image offset up to which data has been read */
+	bool seek;	  /* the source can read again from an earlier offset */
+	/* called by image_free(), can be NULL */
+	void (*close)(void* user);
+	struct image_ahead* ahead; /* reader thread, NULL if not running */
+};
+
+/* A firmware file (.dat or .bin) of the package in memory */
+struct dfu_image {
+	const uint8_t* data;
+	size_t size;
+	uint32_t* crc_at; /* CRC of the first n * IMAGE_CRC_BLOCK bytes */
+	uint8_t* buf;	  /* inflated data, NULL when mapped from the file */
+	struct image_window* win; /* streamed, data is NULL */
+	size_t map_len;			  /* data is mapped by image_from_file() */
+};
+
+/* The mapped ZIP file, stored entries are used from it directly */
+struct zip_map {
+	const uint8_t* data;
+	size_t len;
+};
+
+bool zip_map_open(struct zip_map* map, const char* path);
+void zip_map_close(struct zip_map* map);
+
+bool image_load(struct dfu_image* img, zip_t* zip, const char* name,
+				const struct zip_map* map);
+bool image_from_file(struct dfu_image* img, const char* path);
+bool image_from_buffer(struct dfu_image* img, const uint8_t* data,
+					   size_t size);
+bool image_from_read(struct dfu_image* img, size_t size, image_read_fn read,
+					 void* user);
+bool image_from_stream(struct dfu_image* img, size_t size, image_read_fn read,
+					   void* user);
+bool image_from_zip(struct dfu_image* img, zip_t* zip, const char* name);
+bool image_fetch(const struct dfu_image* img, size_t offset, size_t len,
+				 struct image_ahead_stats* st);
+const uint8_t* image_data(const struct dfu_image* img, size_t offset);
+void image_free(struct dfu_image* img);
+uint32_t image_crc(const struct dfu_image* img, size_t offset);
+
+#endif
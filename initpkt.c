@@ -0,0 +1,171 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "initpkt.h"
+
+/*
+ * Just enough protobuf to read the InitCommand from the Init packet:
+ *
+ * Packet { Command command = 1; SignedCommand signed_command = 2; }
+ * SignedCommand { Command command = 1; ... }
+ * Command { OpCode op_code = 1; InitCommand init = 2; ... }
+ */
+
+#define PB_VARINT 0
+#define PB_FIXED64 1
+#define PB_BYTES 2
+#define PB_FIXED32 5
+
+struct pb {
+	const uint8_t* p;
+	const uint8_t* end;
+};
+
+static bool pb_varint(struct pb* b, uint64_t* val)
+{
+	uint64_t v = 0;
+
+	for (int shift = 0; shift < 64 && b->p < b->end; shift += 7) {
+		uint8_t c = *b->p++;
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			*val = v;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* read the next field. returns its wire type or -1 on error. varints are
+ * returned in val, the contents of length delimited fields in sub */
+static int pb_field(struct pb* b, uint32_t* num, uint64_t* val, struct pb* sub)
+{
+	uint64_t key;
+	uint64_t len;
+
+	if (!pb_varint(b, &key)) {
+		return -1;
+	}
+	*num = key >> 3;
+
+	switch (key & 7) {
+	case PB_VARINT:
+		return pb_varint(b, val) ? PB_VARINT : -1;
+	case PB_FIXED64:
+	case PB_FIXED32:
+		len = (key & 7) == PB_FIXED64 ? 8 : 4;
+		break;
+	case PB_BYTES:
+		if (!pb_varint(b, &len)) {
+			return -1;
+		}
+		break;
+	default:
+		return -1;
+	}
+
+	if (len > (uint64_t)(b->end - b->p)) {
+		return -1;
+	}
+	sub->p = b->p;
+	sub->end = b->p + len;
+	b->p += len;
+	return key & 7;
+}
+
+/* the length delimited field num of message b */
+static bool pb_find(struct pb b, uint32_t num, struct pb* sub)
+{
+	uint32_t n;
+	uint64_t val;
+	int type;
+
+	while (b.p < b.end) {
+		type = pb_field(&b, &n, &val, sub);
+		if (type < 0) {
+			return false;
+		}
+		if (type == PB_BYTES && n == num) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/** parse the InitCommand of the Init packet in data */
+bool init_parse(const uint8_t* data, size_t len, struct init_info* ii)
+{
+	struct pb pkt = {data, data + len};
+	struct pb cmd;
+	struct pb init;
+	struct pb sub;
+	uint32_t num;
+	uint64_t val;
+	int type;
+
+	memset(ii, 0, sizeof(*ii));
+
+	if (pb_find(pkt, 2, &sub)) {
+		if (!pb_find(sub, 1, &cmd)) {
+			return false;
+		}
+	} else if (!pb_find(pkt, 1, &cmd)) {
+		return false;
+	}
+
+	if (!pb_find(cmd, 2, &init)) {
+		return false;
+	}
+
+	while (init.p < init.end) {
+		type = pb_field(&init, &num, &val, &sub);
+		if (type < 0) {
+			return false;
+		}
+		if (type != PB_VARINT) {
+			continue; // sd_req, hash, ...
+		}
+		switch (num) {
+		case 1:
+			ii->fw_version = val;
+			break;
+		case 2:
+			ii->hw_version = val;
+			break;
+		case 4:
+			ii->type = val;
+			break;
+		case 5:
+			ii->sd_size = val;
+			break;
+		case 6:
+			ii->bl_size = val;
+			break;
+		case 7:
+			ii->app_size = val;
+			break;
+		case 9:
+			ii->is_debug = val;
+			break;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,49 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef INITPKT_H
+#define INITPKT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* FwType of the Init packet (dfu-cc.proto of the Nordic SDK) */
+enum init_fw_type {
+	INIT_FW_APPLICATION = 0,
+	INIT_FW_SOFTDEVICE = 1,
+	INIT_FW_BOOTLOADER = 2,
+	INIT_FW_SOFTDEVICE_BOOTLOADER = 3,
+	INIT_FW_EXTERNAL_APPLICATION = 4,
+};
+
+/* what we need of the InitCommand, fields which are not present are 0 */
+struct init_info {
+	uint32_t fw_version;
+	uint32_t hw_version;
+	enum init_fw_type type;
+	uint32_t sd_size;
+	uint32_t bl_size;
+	uint32_t app_size;
+	bool is_debug;
+};
+
+bool init_parse(const uint8_t* data, size_t len, struct init_info* ii);
+
+#endif
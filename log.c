@@ -20,23 +20,61 @@
 #include <stdarg.h>
 #include <stdio.h>
 
-#include "conf.h"
 #include "log.h"
 
+enum loglevel log_level = LL_NOTICE;
+
+/* set in threads of parallel sessions, their lines are not continued */
+static __thread const char* log_prefix;
+
+void log_set_prefix(const char* prefix)
+{
+	log_prefix = prefix;
+}
+
+const char* log_get_prefix(void)
+{
+	return log_prefix;
+}
+
 void __attribute__((format(printf, 3, 4)))
 log_out(enum loglevel level, bool nl, const char* format, ...)
 {
 	va_list args;
 
-	if (conf.loglevel < level) {
+	if (log_level < level) {
 		return;
 	}
 
+	if (log_prefix != NULL) {
+		/* the progress of parallel sessions is shown together */
+		if (level == LL_NOTICE && log_level == LL_NOTICE) {
+			return;
+		}
+		while (*format == '\n') {
+			format++;
+		}
+	}
+
 	va_start(args, format);
+	flockfile(stdout);
+	if (log_prefix != NULL) {
+		printf("%s: ", log_prefix);
+	}
 	vprintf(format, args);
-	if (nl || conf.loglevel > level) {
+	if (nl || log_level > level || log_prefix != NULL) {
 		printf("\n");
 	}
+	funlockfile(stdout);
 
 	va_end(args);
 }
+
+/* one dot for every step, unless the log shows more */
+void log_progress(void)
+{
+	if (log_level == LL_NOTICE && log_prefix == NULL) {
+		printf(".");
+		fflush(stdout);
+	}
+}
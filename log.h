@@ -25,8 +25,13 @@
 /* these conincide with syslog levels for convenience */
 enum loglevel { LL_CRIT = 2, LL_ERR, LL_WARN, LL_NOTICE, LL_INFO, LL_DEBUG };
 
+extern enum loglevel log_level;
+
 void __attribute__((format(printf, 3, 4)))
 log_out(enum loglevel ll, bool nl, const char* fmt, ...);
+void log_set_prefix(const char* prefix);
+const char* log_get_prefix(void);
+void log_progress(void);
 
 #ifndef DEBUG
 #define DEBUG 1
@@ -46,11 +51,11 @@ log_out(enum loglevel ll, bool nl, const char* fmt, ...);
 	} while (0)
 #define LOG_DBGL(lvl, ...)                                                     \
 	do {                                                                       \
-		if (DEBUG && conf.loglevel >= lvl)                                     \
+		if (DEBUG && log_level >= lvl)                                     \
 			log_out(LL_DEBUG, true, __VA_ARGS__);                              \
 	} while (0)
 #define LOG_NL(lvl)                                                            \
-	if (conf.loglevel == lvl)                                                  \
+	if (log_level == lvl)                                                  \
 		log_out(lvl, false, "\n");
 
 #endif
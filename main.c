@@ -19,30 +19,62 @@
 
 #define _GNU_SOURCE
 #include <getopt.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <json-c/json.h>
-#include <zip.h>
 
+#include "arena.h"
+#include "campaign.h"
 #include "conf.h"
+#include "crc.h"
+#include "daemon.h"
 #include "dfu.h"
 #include "dfu_ble.h"
 #include "dfu_serial.h"
+#include "evloop.h"
 #include "log.h"
-#include "serialtty.h"
+#include "package.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
-struct config conf;
+#define TRACE_RECORDS	8192 /* about 320 KiB */
+#define TRACE_DUMP_LAST 32
+
+static struct dfu_config conf;
 
 static struct option ser_options[] = {{"help", no_argument, NULL, 'h'},
 									  {"verbose", optional_argument, NULL, 'v'},
 									  {"port", required_argument, NULL, 'p'},
 									  {"baud", required_argument, NULL, 'b'},
+									  {"dfu-baud", required_argument, NULL, 'B'},
 									  {"cmd", required_argument, NULL, 'c'},
 									  {"hexcmd", required_argument, NULL, 'C'},
 									  {"timeout", required_argument, NULL, 't'},
+									  {"prn", required_argument, NULL, 'n'},
+									  {"slip-pack", no_argument, NULL, 'S'},
+									  {"profile", required_argument, NULL, 'P'},
+									  {"resume-stats", no_argument, NULL, 'R'},
+									  {"skip-current", no_argument, NULL, 'k'},
+									  {"stats-json", required_argument, NULL, 'j'},
+									  {"daemon", required_argument, NULL, 'D'},
+									  {"campaign", required_argument, NULL, 'K'},
+									  {"init", required_argument, NULL, 'N'},
+									  {"bin", required_argument, NULL, 'F'},
+									  {"sd-init", required_argument, NULL, 'x'},
+									  {"sd-bin", required_argument, NULL, 'X'},
+									  {"trace", required_argument, NULL, 'T'},
+									  {"retries", required_argument, NULL, 'r'},
+									  {"op-timeout", required_argument, NULL, 'o'},
+									  {"exec-timeout", required_argument, NULL,
+									   'e'},
+									  {"deadline", required_argument, NULL, 'L'},
+									  {"low-mem", required_argument, NULL, 'M'},
 									  {NULL, 0, NULL, 0}};
 
 static struct option ble_options[] = {{"help", no_argument, NULL, 'h'},
@@ -50,6 +82,27 @@ static struct option ble_options[] = {{"help", no_argument, NULL, 'h'},
 									  {"addr", required_argument, NULL, 'a'},
 									  {"atype", optional_argument, NULL, 't'},
 									  {"intf", optional_argument, NULL, 'i'},
+									  {"interval", required_argument, NULL, 'I'},
+									  {"window", required_argument, NULL, 'w'},
+									  {"dfutarg-timeout", required_argument,
+									   NULL, 'd'},
+									  {"prn", required_argument, NULL, 'n'},
+									  {"resume-stats", no_argument, NULL, 'R'},
+									  {"skip-current", no_argument, NULL, 'k'},
+									  {"stats-json", required_argument, NULL, 'j'},
+									  {"daemon", required_argument, NULL, 'D'},
+									  {"campaign", required_argument, NULL, 'K'},
+									  {"init", required_argument, NULL, 'N'},
+									  {"bin", required_argument, NULL, 'F'},
+									  {"sd-init", required_argument, NULL, 'x'},
+									  {"sd-bin", required_argument, NULL, 'X'},
+									  {"trace", required_argument, NULL, 'T'},
+									  {"retries", required_argument, NULL, 'r'},
+									  {"op-timeout", required_argument, NULL, 'o'},
+									  {"exec-timeout", required_argument, NULL,
+									   'e'},
+									  {"deadline", required_argument, NULL, 'L'},
+									  {"low-mem", required_argument, NULL, 'M'},
 									  {NULL, 0, NULL, 0}};
 
 static void usage(void)
@@ -61,22 +114,59 @@ static void usage(void)
 			"Usage: nrfdfu serial [options] DFUPKG.zip\n"
 #endif
 			"Nordic NRF DFU Upgrade with DFUPKG.zip\n"
+			"DFUPKG.zip can be - or a pipe, with a ZIP or TAR stream\n"
 			"Options (all):\n"
 			"  -h, --help\t\tShow help\n"
 			"  -v, --verbose=<level>\tLog level 1 or 2 (-vv)\n"
+			"  -n, --prn <num>\tPipeline writes with receipt notification\n"
+			"\t\t\tevery <num> packets (0 = off, max 255)\n"
+			"  -r, --retries <num>\tSend a failed object again up to <num>\n"
+			"\t\t\ttimes (3)\n"
+			"  -o, --op-timeout <ms>\tWait for responses <ms> (serial 500,\n"
+			"\t\t\tBLE 5000)\n"
+			"  -e, --exec-timeout <ms> Wait for create and execute 2 s\n"
+			"\t\t\tplus <ms> per KiB of the object (500)\n"
+			"  -L, --deadline <sec>\tGive up the update after <sec> seconds\n"
+			"  -R, --resume-stats\tShow how many bytes resuming saved\n"
+			"  -k, --skip-current\tDon't update images the device already has\n"
+			"  -j, --stats-json <file> Write timing statistics to <file>\n"
+			"  -D, --daemon <socket>\tAccept update jobs on Unix <socket>\n"
+			"  -K, --campaign <file>\tUpdate the devices listed in <file>\n"
+			"  -M, --low-mem <KiB>\tUse only one block of <KiB> for buffers\n"
+			"\t\t\tand read the package while sending it\n"
+			"  -T, --trace <file>\tTrace packets to <file> instead of\n"
+			"\t\t\tdumping them, see nrfdfu-trace\n"
+			"  -N, --init <file>\tApplication Init packet (.dat), with -F\n"
+			"  -F, --bin <file>\tApplication firmware (.bin)\n"
+			"  -x, --sd-init <file>\tSD/Bootloader Init packet, with -X\n"
+			"  -X, --sd-bin <file>\tSD/Bootloader firmware\n"
+			"\t\t\t(these raw files are used instead of DFUPKG.zip)\n"
 			"\n"
 			"Options (serial):\n"
 			"  -p, --port <tty>\tSerial port (/dev/ttyUSB0)\n"
+			"\t\t\tor comma separated list to update in parallel\n"
 			"  -b, --baud <num>\tSerial baud rate (115200)\n"
+			"  -B, --dfu-baud <num>\tBaud rate of the Bootloader (115200)\n"
+			"\t\t\tor 'auto' to probe for the fastest one\n"
 			"  -c, --cmd <text>\tCommand to enter DFU mode\n"
 			"  -C, --hexcmd <hex>\tCommand to enter DFU mode in HEX\n"
-			"  -t, --timeout <num>\tTimeout after <num> tries (60)\n"
+			"  -t, --timeout <sec>\tWait for the Bootloader <sec> seconds (10)\n"
+			"  -S, --slip-pack\tFill frames up to the MTU after SLIP escaping\n"
+			"\t\t\t(Bootloader must accept frames of MTU bytes)\n"
+			"  -P, --profile <name>\tSerial port setup: auto, plain, lowlat\n"
+			"\t\t\tor hwfc (auto)\n"
 #ifdef BLE_SUPPORT
 			"\n"
 			"Options (BLE):\n"
 			"  -a, --addr <mac>\tBLE MAC address to connect to\n"
+			"\t\t\tor comma separated list to update in parallel\n"
 			"  -t, --atype public|random\tBLE MAC address type (optional)\n"
 			"  -i, --intf <name>\tBT interface name (hci0)\n"
+			"  -I, --interval <ms>\tConnection interval for the transfer\n"
+			"\t\t\t(7.5 - 4000)\n"
+			"  -w, --window <num>\tWrites in flight before waiting for the\n"
+			"\t\t\tcontroller (0 = its buffer count)\n"
+			"  -d, --dfutarg-timeout <sec> Wait for DfuTarg <sec> seconds (30)\n"
 #endif
 	);
 }
@@ -84,13 +174,8 @@ static void usage(void)
 static void main_options(int argc, char* argv[])
 {
 	/* defaults */
+	dfu_config_init(&conf);
 	conf.serport = "/dev/ttyUSB0";
-	conf.serspeed = 115200;
-	conf.loglevel = LL_NOTICE;
-	conf.timeout = 10;
-	conf.ble_atype = BAT_UNKNOWN;
-	conf.interface = "hci0";
-	conf.dfucmd_hex = false;
 
 	if (argc <= 1) {
 		usage();
@@ -115,9 +200,15 @@ static void main_options(int argc, char* argv[])
 	int n = 0;
 	while (n >= 0) {
 		if (conf.dfu_type == DFU_SERIAL) {
-			n = getopt_long(argc, argv, "hv::p:b:c:C:t:", ser_options, NULL);
+			n = getopt_long(argc, argv,
+							"hv::p:b:B:c:C:t:n:r:o:e:L:SP:"
+							"Rkj:D:K:M:N:F:x:X:T:",
+							ser_options, NULL);
 		} else {
-			n = getopt_long(argc, argv, "hv::a:t:i:", ble_options, NULL);
+			n = getopt_long(argc, argv,
+							"hv::a:t:i:I:w:d:n:r:o:e:L:"
+							"Rkj:D:K:M:N:F:x:X:T:",
+							ble_options, NULL);
 		}
 
 		if (n < 0)
@@ -130,9 +221,9 @@ static void main_options(int argc, char* argv[])
 			exit(EXIT_SUCCESS);
 		case 'v':
 			if (optarg == NULL)
-				conf.loglevel = LL_INFO;
+				log_level = LL_INFO;
 			else if (optarg[0] == 'v' || optarg[0] == '2')
-				conf.loglevel = LL_DEBUG;
+				log_level = LL_DEBUG;
 			break;
 		case 'p':
 			conf.serport = optarg;
@@ -140,6 +231,17 @@ static void main_options(int argc, char* argv[])
 		case 'b':
 			conf.serspeed = atoi(optarg);
 			break;
+		case 'B':
+			if (strcasecmp(optarg, "auto") == 0) {
+				conf.dfuspeed = 0;
+			} else {
+				conf.dfuspeed = atoi(optarg);
+				if (conf.dfuspeed <= 0) {
+					LOG_ERR("Invalid DFU baud rate '%s'", optarg);
+					exit(EXIT_FAILURE);
+				}
+			}
+			break;
 		case 'c':
 			conf.dfucmd = optarg;
 			break;
@@ -147,6 +249,15 @@ static void main_options(int argc, char* argv[])
 			conf.dfucmd = optarg;
 			conf.dfucmd_hex = true;
 			break;
+		case 'S':
+			conf.slip_pack = true;
+			break;
+		case 'P':
+			if (!ser_profile_parse(optarg, &conf.ser_profile)) {
+				LOG_ERR("Unknown serial profile '%s'", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 't':
 			if (conf.dfu_type == DFU_SERIAL) {
 				conf.timeout = atoi(optarg);
@@ -164,7 +275,124 @@ static void main_options(int argc, char* argv[])
 		case 'i':
 			conf.interface = optarg;
 			break;
+		case 'I':
+			conf.ble_interval = atof(optarg) / 1.25 + 0.5;
+			if (conf.ble_interval < 6 || conf.ble_interval > 3200) {
+				LOG_ERR("Connection interval must be between 7.5 and 4000 ms");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'w':
+			conf.ble_window = atoi(optarg);
+			if (conf.ble_window < 0) {
+				LOG_ERR("Window must not be negative");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'd':
+			conf.dfutarg_timeout = atoi(optarg);
+			if (conf.dfutarg_timeout <= 0) {
+				LOG_ERR("DfuTarg timeout must be positive");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			conf.object_retries = atoi(optarg);
+			if (conf.object_retries < 0) {
+				LOG_ERR("Retries must not be negative");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'o':
+			conf.op_timeout_ms = atoi(optarg);
+			if (conf.op_timeout_ms <= 0) {
+				LOG_ERR("Response timeout must be positive");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'e':
+			conf.exec_timeout_ms = atoi(optarg);
+			if (conf.exec_timeout_ms < 0) {
+				LOG_ERR("Execute timeout must not be negative");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'L':
+			conf.deadline = atoi(optarg);
+			if (conf.deadline <= 0) {
+				LOG_ERR("Deadline must be positive");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'R':
+			conf.resume_stats = true;
+			break;
+		case 'k':
+			conf.skip_current = true;
+			break;
+		case 'j':
+			conf.stats_json = optarg;
+			break;
+		case 'D':
+			conf.daemon = optarg;
+			break;
+		case 'K':
+			conf.campaign = optarg;
+			break;
+		case 'M':
+			conf.low_mem = atoi(optarg);
+			if (conf.low_mem <= 0) {
+				LOG_ERR("Low memory size must be positive");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'T':
+			conf.trace = optarg;
+			break;
+		case 'N':
+			conf.raw_init = optarg;
+			break;
+		case 'F':
+			conf.raw_bin = optarg;
+			break;
+		case 'x':
+			conf.raw_sd_init = optarg;
+			break;
+		case 'X':
+			conf.raw_sd_bin = optarg;
+			break;
+		case 'n':
+			conf.prn = atoi(optarg);
+			if (conf.prn < 0 || conf.prn > DFU_PRN_MAX) {
+				LOG_ERR("PRN must be between 0 and %d", DFU_PRN_MAX);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+	}
+
+	/* in daemon and campaign mode the packages come with the devices */
+	if (conf.daemon || conf.campaign) {
+		if (conf.low_mem) {
+			LOG_ERR("Low memory mode can't be used with -D or -K");
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+
+	/* raw files instead of the package, only the DFU type is left in argv
+	 * after getopt */
+	if (conf.raw_init || conf.raw_bin || conf.raw_sd_init || conf.raw_sd_bin) {
+		if (!conf.raw_init != !conf.raw_bin
+			|| !conf.raw_sd_init != !conf.raw_sd_bin) {
+			LOG_ERR("Init packet and firmware have to be given together");
+			exit(EXIT_FAILURE);
+		}
+		if (argc - optind > 1) {
+			LOG_ERR("ZIP file can't be used with raw files");
+			exit(EXIT_FAILURE);
 		}
+		return;
 	}
 
 	/* last non-option argument is ZIP file.
@@ -178,121 +406,210 @@ static void main_options(int argc, char* argv[])
 	}
 }
 
-static zip_file_t* zip_file_open(zip_t* zip, const char* name, size_t* size)
-{
-	struct zip_stat stat;
+enum worker_state { WORKER_RUNNING, WORKER_OK, WORKER_FAILED };
 
-	zip_stat_init(&stat);
-	int ret = zip_stat(zip, name, 0, &stat);
-	if (ret < 0) {
-		LOG_ERR("ZIP file does not contain %s", name);
-		return NULL;
-	}
-	*size = stat.size;
+/* one session for each serial port or BLE device */
+struct worker {
+	struct dfu_session s;
+	const struct dfu_package* pkg;
+	pthread_t thread;
+	bool started;
+	atomic_int state;
+};
+
+static struct worker* workers;
+static int num_workers;
 
-	zip_file_t* zf = zip_fopen_index(zip, stat.index, 0);
-	if (zf == NULL) {
-		LOG_ERR("Error opening %s in ZIP file", name);
-		return NULL;
+static void signal_handler(__attribute__((unused)) int signo)
+{
+	for (int i = 0; i < num_workers; i++) {
+		workers[i].s.terminate = true;
 	}
-	return zf;
 }
 
-/* ap_dat and ap_bin have to be freed by caller */
-static bool read_manifest(zip_t* zip, char** ap_dat, char** ap_bin,
-						  char** sb_dat, char** sb_bin)
+/* flash and time the update of one worker */
+static bool worker_flash(struct worker* w)
 {
-	bool ret = false;
-	char buf[600];
-	json_object* json = NULL;
-	json_object* jobj;
-	json_object* jobj2;
-	json_object* jobj3;
-	enum json_tokener_error json_err;
-
-	zip_file_t* zf = zip_fopen(zip, "manifest.json", 0);
-	if (zf == NULL) {
-		LOG_ERR("ZIP file does not contain manifest");
-		return false;
-	}
+	w->s.stats.start_us = stats_now_us();
+	bool ok = dfu_flash(&w->s, w->pkg);
+	w->s.stats.end_us = stats_now_us();
+	stats_heap(&w->s.stats);
 
-	zip_int64_t len = zip_fread(zf, buf, sizeof(buf));
-	if (len <= 0) {
-		LOG_ERR("Could not read Manifest");
-		goto exit;
+	atomic_store(&w->state, ok ? WORKER_OK : WORKER_FAILED);
+	return ok;
+}
+
+static void* worker_run(void* arg)
+{
+	struct worker* w = arg;
+
+	log_set_prefix(w->s.port);
+	worker_flash(w);
+	dfu_session_fini(&w->s);
+	return NULL;
+}
+
+static void worker_task(void* arg)
+{
+	worker_run(arg);
+}
+
+/* split the comma separated list of serial ports or BLE addresses into
+ * workers */
+static bool workers_init(char* ports, const struct dfu_package* pkg)
+{
+	char* save = NULL;
+	int n = 1;
+
+	for (const char* p = ports; *p; p++) {
+		if (*p == ',') {
+			n++;
+		}
 	}
 
-	/* read JSON */
+	workers = calloc(n, sizeof(*workers));
+	if (workers == NULL) {
+		LOG_ERR("Could not allocate %d sessions", n);
+		return false;
+	}
 
-	json = json_tokener_parse_verbose(buf, &json_err);
-	if (json == NULL) {
-		LOG_ERR("Manifest not valid JSON %d", json_err);
-		goto exit;
+	for (char* p = strtok_r(ports, ",", &save); p != NULL;
+		 p = strtok_r(NULL, ",", &save)) {
+		struct worker* w = &workers[num_workers++];
+		dfu_session_init(&w->s, p, &conf);
+		w->pkg = pkg;
 	}
 
-	if (!json_object_object_get_ex(json, "manifest", &jobj)) {
-		LOG_ERR("Manifest format unknown");
-		goto exit;
+	if (num_workers == 0) {
+		LOG_ERR("No serial port or BLE address");
+		return false;
 	}
+	return true;
+}
 
-	if (json_object_object_get_ex(jobj, "application", &jobj2)) {
-		if (json_object_object_get_ex(jobj2, "dat_file", &jobj3)) {
-			*ap_dat = strdup(json_object_get_string(jobj3));
-		}
-		if (json_object_object_get_ex(jobj2, "bin_file", &jobj3)) {
-			*ap_bin = strdup(json_object_get_string(jobj3));
-		}
-		if (!*ap_dat || !*ap_bin) {
-			LOG_ERR("Manifest missing app files");
-			goto exit;
+/* combined progress of all workers, returns the number still running */
+static int workers_progress(size_t total)
+{
+	size_t done = 0;
+	int running = 0;
+	int failed = 0;
+
+	for (int i = 0; i < num_workers; i++) {
+		int state = atomic_load(&workers[i].state);
+		if (state == WORKER_RUNNING) {
+			done += MIN(atomic_load(&workers[i].s.progress), total);
+			running++;
+		} else {
+			done += total;
+			failed += (state == WORKER_FAILED);
 		}
 	}
 
-	if ((json_object_object_get_ex(jobj, "softdevice_bootloader", &jobj2)
-		 || json_object_object_get_ex(jobj, "bootloader", &jobj2))) {
-		if (json_object_object_get_ex(jobj2, "dat_file", &jobj3)) {
-			*sb_dat = strdup(json_object_get_string(jobj3));
+	LOG_NOTI_("\rProgress: %3zu%% (%d running, %d done, %d failed) ",
+			  total > 0 ? done * 100 / (total * num_workers) : 100, running,
+			  num_workers - running - failed, failed);
+	return running;
+}
+
+/* serial ports are all driven by the event loop of this thread */
+static void workers_run_loop(size_t total)
+{
+	if (!ev_init()) {
+		for (int i = 0; i < num_workers; i++) {
+			atomic_store(&workers[i].state, WORKER_FAILED);
 		}
-		if (json_object_object_get_ex(jobj2, "bin_file", &jobj3)) {
-			*sb_bin = strdup(json_object_get_string(jobj3));
+		return;
+	}
+
+	for (int i = 0; i < num_workers; i++) {
+		struct worker* w = &workers[i];
+		if (!ev_task_start(worker_task, w, w->s.port)) {
+			LOG_ERR("Could not start session for %s", w->s.port);
+			atomic_store(&w->state, WORKER_FAILED);
 		}
-		if (!*sb_dat || !*sb_bin) {
-			LOG_ERR("Manifest missing softdevice/bootloader files");
-			goto exit;
+	}
+
+	while (ev_run(1000)) {
+		workers_progress(total);
+	}
+	workers_progress(total);
+	ev_fini();
+}
+
+/* BLE sessions each run in their own thread */
+static void workers_run_threads(size_t total)
+{
+	for (int i = 0; i < num_workers; i++) {
+		struct worker* w = &workers[i];
+		if (pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+			LOG_ERR("Could not start session for %s", w->s.port);
+			atomic_store(&w->state, WORKER_FAILED);
+			continue;
 		}
+		w->started = true;
 	}
 
-	ret = true;
+	while (workers_progress(total) > 0) {
+		sleep(1);
+	}
 
-exit:
-	json_object_put(json);
-	// no need to json_object_put() the other jobs2/3
-	zip_fclose(zf);
-	return ret;
+	for (int i = 0; i < num_workers; i++) {
+		if (workers[i].started) {
+			pthread_join(workers[i].thread, NULL);
+		}
+	}
 }
 
-static void signal_handler(__attribute__((unused)) int signo)
+/* flash all devices in parallel */
+static bool workers_run(const struct dfu_package* pkg)
 {
+	size_t total = package_size(pkg);
+	int ok = 0;
+
+	LOG_NOTI("Updating %d devices (%zd bytes each):", num_workers, total);
+
 	if (conf.dfu_type == DFU_SERIAL) {
-		ser_fini();
+		workers_run_loop(total);
 	} else {
-		ble_fini();
+		workers_run_threads(total);
+	}
+	LOG_NL(LL_NOTICE);
+
+	for (int i = 0; i < num_workers; i++) {
+		bool success = atomic_load(&workers[i].state) == WORKER_OK;
+		LOG_NOTI("%s: %s", workers[i].s.port, success ? "OK" : "FAILED");
+		ok += success;
 	}
+	LOG_NOTI("%d of %d devices updated", ok, num_workers);
+
+	return ok == num_workers;
+}
+
+/* statistics of all devices, for comparing updates */
+static void workers_stats_json(const char* file)
+{
+	json_object* devs = json_object_new_array();
+	for (int i = 0; i < num_workers; i++) {
+		bool ok = atomic_load(&workers[i].state) == WORKER_OK;
+		json_object_array_add(devs, stats_json(&workers[i].s, ok));
+	}
+
+	json_object* json = json_object_new_object();
+	json_object_object_add(json, "package",
+						   json_object_new_string(conf.zipfile ? conf.zipfile
+															   : conf.raw_bin));
+	json_object_object_add(json, "devices", devs);
+
+	if (json_object_to_file_ext(file, json, JSON_C_TO_STRING_PRETTY) < 0) {
+		LOG_ERR("Could not write statistics to '%s'", file);
+	}
+	json_object_put(json);
 }
 
 int main(int argc, char* argv[])
 {
 	int ret = EXIT_FAILURE;
-	char* ap_dat = NULL;
-	char* ap_bin = NULL;
-	char* sb_dat = NULL;
-	char* sb_bin = NULL;
-	zip_file_t* zf_ap_dat = NULL;
-	zip_file_t* zf_ap_bin = NULL;
-	zip_file_t* zf_sb_dat = NULL;
-	zip_file_t* zf_sb_bin = NULL;
-	size_t zs_ap_dat, zs_ap_bin, zs_sb_dat, zs_sb_bin;
-	enum dfu_ret r;
+	struct dfu_package pkg = {0};
 
 	main_options(argc, argv);
 
@@ -303,130 +620,109 @@ int main(int argc, char* argv[])
 	sigemptyset(&act.sa_mask);
 	sigaction(SIGINT, &act, NULL);
 
+	if (conf.trace && !trace_init(TRACE_RECORDS)) {
+		goto exit;
+	}
+
+	if (conf.daemon) {
+		LOG_INF("CRC32: %s", crc_backend());
+		if (daemon_run(conf.daemon, &conf)) {
+			ret = EXIT_SUCCESS;
+		}
+		goto exit;
+	}
+
+	if (conf.campaign) {
+		LOG_INF("CRC32: %s", crc_backend());
+		if (campaign_run(conf.campaign, &conf)) {
+			ret = EXIT_SUCCESS;
+		}
+		goto exit;
+	}
+
 	if (conf.dfu_type == DFU_SERIAL) {
 		LOG_INF("Serial Port: %s (%d baud)", conf.serport, conf.serspeed);
+		if (!workers_init(conf.serport, &pkg)) {
+			goto exit;
+		}
 	} else {
 		if (conf.ble_addr == NULL) {
 			LOG_ERR("Need BLE Target addr -a");
 			exit(EXIT_FAILURE);
 		}
 		LOG_INF("BLE Target: %s", conf.ble_addr);
+		if (!workers_init(conf.ble_addr, &pkg)) {
+			goto exit;
+		}
 	}
-	LOG_INF("DFU Package: %s", conf.zipfile);
-
-	zip_t* zip = zip_open(conf.zipfile, ZIP_RDONLY, NULL);
-	if (zip == NULL) {
-		LOG_ERR("Could not open ZIP file '%s'", conf.zipfile);
-		goto exit;
-	}
-
-	if (!read_manifest(zip, &ap_dat, &ap_bin, &sb_dat, &sb_bin)) {
-		goto exit;
-	}
+	LOG_INF("CRC32: %s", crc_backend());
 
-	/* open all data files in ZIP file before starting */
-	if (sb_dat && sb_bin) {
-		zf_sb_dat = zip_file_open(zip, sb_dat, &zs_sb_dat);
-		zf_sb_bin = zip_file_open(zip, sb_bin, &zs_sb_bin);
-		if (zf_sb_dat == NULL || zf_sb_bin == NULL) {
-			LOG_ERR("Cannot open SD files in ZIP");
+	/* the buffers of one session come from the arena */
+	if (conf.low_mem) {
+		if (num_workers > 1) {
+			LOG_ERR("Low memory mode updates only one device");
 			goto exit;
 		}
-		LOG_INF("Update contains Softdevice/Bootloader");
-	}
-	if (ap_dat && ap_bin) {
-		zf_ap_dat = zip_file_open(zip, ap_dat, &zs_ap_dat);
-		zf_ap_bin = zip_file_open(zip, ap_bin, &zs_ap_bin);
-		if (zf_ap_dat == NULL || zf_ap_bin == NULL) {
-			LOG_ERR("Cannot open APP files in ZIP");
+		if (!arena_init((size_t)conf.low_mem * 1024)) {
 			goto exit;
 		}
-		LOG_INF("Update contains Application");
 	}
 
-	if (sb_dat) {
-		LOG_NOTI("Updating SoftDevice/Bootloader (%zd bytes):", zs_sb_bin);
+	if (conf.zipfile == NULL) {
+		if (!package_load_raw(&pkg, conf.raw_sd_init, conf.raw_sd_bin,
+							  conf.raw_init, conf.raw_bin)) {
+			goto exit;
+		}
 	} else {
-		LOG_NOTI("Updating Application (%zd bytes):", zs_ap_bin);
-	}
-
-	if (!dfu_bootloader_enter()) {
-		goto exit;
-	}
-
-	if (sb_dat) {
-		r = dfu_upgrade(zf_sb_dat, zs_sb_dat, zf_sb_bin, zs_sb_bin);
-		if (r == DFU_RET_ERROR) {
+		LOG_INF("DFU Package: %s", conf.zipfile);
+		/* a stream can only be sent while reading it to one device */
+		bool open = conf.low_mem
+						? package_open_lean(&pkg, conf.zipfile)
+						: package_open(&pkg, conf.zipfile, num_workers == 1);
+		if (!open) {
 			goto exit;
-		} else if (r == DFU_RET_FW_VERSION) {
-			/* Bootloader update may fail because it already has the same
-			 * version. In this case try updating the Application */
-			LOG_NOTI("SoftDevice/Bootloader not updated!");
-			if (ap_dat) {
-				LOG_NOTI("Updating Application (%zd bytes):", zs_ap_bin);
-				goto update_app;
-			}
 		}
 	}
 
-	if (sb_dat && ap_dat) {
-		LOG_NOTI("Updating Application (%zd bytes):", zs_ap_bin);
-		if (conf.dfu_type == DFU_BLE) {
-			ble_disconnect();
-			if (!ble_connect_dfu_targ(conf.interface, conf.ble_addr,
-									  conf.ble_atype)) {
-				/* if that fails, it may be that the APP is already running,
-				 * try to connect normally */
-				if (!dfu_bootloader_enter()) {
-					goto exit;
-				}
-			}
-		} else {
-			/* Serial: Sleep a bit and then try to ping */
-			sleep(5);
-			bool p = false;
-			int cnt = 0;
-			while (!p && cnt < 3) {
-				p = dfu_ping();
-				cnt++;
-			}
+	if (num_workers > 1) {
+		if (workers_run(&pkg)) {
+			ret = EXIT_SUCCESS;
 		}
+	} else if (worker_flash(&workers[0])) {
+		ret = EXIT_SUCCESS;
 	}
 
-update_app:
-	if (ap_dat) {
-		r = dfu_upgrade(zf_ap_dat, zs_ap_dat, zf_ap_bin, zs_ap_bin);
-		if (r != DFU_RET_SUCCESS) {
-			goto exit;
-		}
+	if (conf.low_mem) {
+		LOG_NOTI("Memory: heap peak %zu KiB, RSS peak %zu KiB, arena %zu "
+				 "of %zu KiB",
+				 workers[0].s.stats.heap_peak / 1024, stats_rss_peak() / 1024,
+				 arena_peak() / 1024, arena_size() / 1024);
+	}
+	if (conf.stats_json) {
+		workers_stats_json(conf.stats_json);
 	}
-
-	ret = EXIT_SUCCESS;
 
 exit:
-	free(ap_bin);
-	free(ap_dat);
-	free(sb_bin);
-	free(sb_dat);
-	if (zf_ap_dat) {
-		zip_fclose(zf_ap_dat);
-	}
-	if (zf_ap_bin) {
-		zip_fclose(zf_ap_bin);
-	}
-	if (zf_sb_dat) {
-		zip_fclose(zf_sb_dat);
+	if (conf.trace) {
+		/* what led to the failure */
+		if (ret != EXIT_SUCCESS) {
+			LOG_ERR("Last records of the trace:");
+			trace_dump(stdout, TRACE_DUMP_LAST);
+		}
+		trace_write(conf.trace);
+		trace_free();
 	}
-	if (zf_sb_bin) {
-		zip_fclose(zf_sb_bin);
+	package_free(&pkg);
+	for (int i = 0; i < num_workers; i++) {
+		dfu_session_fini(&workers[i].s);
 	}
-	if (zip) {
-		zip_close(zip);
+	if (conf.dfu_type == DFU_BLE) {
+		ble_ctx_fini();
 	}
-	if (conf.dfu_type == DFU_SERIAL) {
-		ser_fini();
-	} else {
-		ble_fini();
+	for (int i = 0; i < num_workers; i++) {
+		stats_free(&workers[i].s.stats);
 	}
+	free(workers);
+	arena_free();
 	return ret;
 }
@@ -0,0 +1,376 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * nrfdfu-microbench: times the per byte hot paths of nrfdfu, SLIP coding,
+ * CRC32 and reading from the ZIP package, at the sizes nrfdfu uses them.
+ * The CRC backend is checked against zlib first.
+ *
+ * Cycles are counted with perf events. Where these are not available,
+ * e.g. on many ARM boards without PMU support in the kernel, give the
+ * clock frequency with -f to get an estimate.
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zip.h>
+#include <zlib.h>
+
+#include "crc.h"
+#include "slip.h"
+#include "util.h"
+
+#define BENCH_DATA	 (64 * 1024) /* like a firmware image */
+#define BENCH_REPEAT 3			 /* the best run counts */
+
+typedef size_t (*bench_fn)(size_t chunk);
+
+static size_t total = 16 * 1024 * 1024; /* bytes per run */
+static double mhz;
+static int cycles_fd = -1;
+
+static uint8_t data[BENCH_DATA];
+static uint8_t enc[BENCH_DATA * 2 + BENCH_DATA / 16];
+static size_t enc_len;
+static uint8_t out[BENCH_DATA * 2 + 1];
+static zip_t* zip;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void cycles_open(void)
+{
+	struct perf_event_attr pe = {
+		.type = PERF_TYPE_HARDWARE,
+		.size = sizeof(pe),
+		.config = PERF_COUNT_HW_CPU_CYCLES,
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+	};
+	cycles_fd = syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static uint64_t cycles_read(void)
+{
+	uint64_t c = 0;
+	if (cycles_fd >= 0 && read(cycles_fd, &c, sizeof(c)) != sizeof(c)) {
+		c = 0;
+	}
+	return c;
+}
+
+/* firmware-like data: compresses somewhat and has a few bytes to escape */
+static void data_init(void)
+{
+	srand(1);
+	for (size_t i = 0; i < sizeof(data); i++) {
+		if (i < 16 || rand() % 4 == 0) {
+			data[i] = rand();
+		} else {
+			data[i] = data[i - 1 - rand() % 16];
+		}
+	}
+}
+
+/* SLIP frames of chunk bytes each, for decoding */
+static void enc_init(size_t chunk)
+{
+	uint32_t len;
+
+	enc_len = 0;
+	for (size_t i = 0; i < sizeof(data); i += chunk) {
+		size_t n = MIN(chunk, sizeof(data) - i);
+		slip_encode_bulk(enc + enc_len, data + i, n, &len);
+		enc_len += len;
+	}
+}
+
+static size_t run_slip_encode(size_t chunk)
+{
+	uint32_t len;
+
+	for (size_t i = 0; i < sizeof(data); i += chunk) {
+		slip_encode(out, data + i, MIN(chunk, sizeof(data) - i), &len);
+	}
+	return sizeof(data);
+}
+
+static size_t run_slip_encode_bulk(size_t chunk)
+{
+	uint32_t len;
+
+	for (size_t i = 0; i < sizeof(data); i += chunk) {
+		slip_encode_bulk(out, data + i, MIN(chunk, sizeof(data) - i), &len);
+	}
+	return sizeof(data);
+}
+
+static size_t run_slip_decode(size_t chunk)
+{
+	slip_t slip = {.p_buffer = out, .buffer_len = sizeof(out)};
+
+	for (size_t i = 0; i < enc_len; i++) {
+		if (slip_decode_add_byte(&slip, enc[i]) == 1) {
+			slip.current_index = 0;
+		}
+	}
+	return sizeof(data);
+}
+
+static size_t run_slip_decode_bulk(size_t chunk)
+{
+	slip_t slip = {.p_buffer = out, .buffer_len = sizeof(out)};
+	uint32_t used;
+
+	for (size_t i = 0; i < enc_len; i += used) {
+		if (slip_decode_bulk(&slip, enc + i, enc_len - i, &used) == 1) {
+			slip.current_index = 0;
+		}
+	}
+	return sizeof(data);
+}
+
+static size_t run_crc32(size_t chunk)
+{
+	static uLong crc;
+
+	for (size_t i = 0; i < sizeof(data); i += chunk) {
+		crc = crc32(crc, data + i, MIN(chunk, sizeof(data) - i));
+	}
+	return sizeof(data);
+}
+
+static size_t run_crc_update(size_t chunk)
+{
+	static uint32_t crc;
+
+	for (size_t i = 0; i < sizeof(data); i += chunk) {
+		crc = crc_update(crc, data + i, MIN(chunk, sizeof(data) - i));
+	}
+	return sizeof(data);
+}
+
+/* the fast CRC has to be the same as zlib, also when split and combined */
+static bool crc_check(void)
+{
+	for (size_t len = 0; len < 2048; len += len < 256 ? 1 : 61) {
+		for (size_t off = 0; off < 16; off++) {
+			const uint8_t* p = data + off;
+			uint32_t crc = crc32(0, p, len);
+			uint32_t a = crc_update(0, p, len / 3);
+			uint32_t b = crc_update(0, p + len / 3, len - len / 3);
+			if (crc_update(0, p, len) != crc
+				|| crc32_combine(a, b, len - len / 3) != crc) {
+				fprintf(stderr, "CRC mismatch at %zu len %zu\n", off, len);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static size_t zip_read(const char* name, size_t chunk)
+{
+	size_t n = 0;
+	zip_int64_t len;
+
+	zip_file_t* zf = zip_fopen(zip, name, 0);
+	if (zf == NULL) {
+		return sizeof(data); // don't loop forever
+	}
+	while ((len = zip_fread(zf, out, chunk)) > 0) {
+		n += len;
+	}
+	zip_fclose(zf);
+	return MAX(n, 1);
+}
+
+static size_t run_zip_stored(size_t chunk)
+{
+	return zip_read("stored.bin", chunk);
+}
+
+static size_t run_zip_deflated(size_t chunk)
+{
+	return zip_read("deflated.bin", chunk);
+}
+
+/* a ZIP file with the data stored and deflated */
+static bool zip_init(char* path)
+{
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		return false;
+	}
+	close(fd);
+
+	zip_t* z = zip_open(path, ZIP_CREATE | ZIP_TRUNCATE, NULL);
+	if (z == NULL) {
+		return false;
+	}
+	const char* names[] = {"stored.bin", "deflated.bin"};
+	const int methods[] = {ZIP_CM_STORE, ZIP_CM_DEFLATE};
+	for (int i = 0; i < 2; i++) {
+		zip_source_t* src = zip_source_buffer(z, data, sizeof(data), 0);
+		zip_int64_t idx = zip_file_add(z, names[i], src, ZIP_FL_OVERWRITE);
+		if (idx < 0) {
+			zip_source_free(src);
+			zip_discard(z);
+			return false;
+		}
+		/* the archive owns src now */
+		if (zip_set_file_compression(z, idx, methods[i], 0) < 0) {
+			zip_discard(z);
+			return false;
+		}
+	}
+	if (zip_close(z) < 0) {
+		return false;
+	}
+
+	zip = zip_open(path, ZIP_RDONLY, NULL);
+	return zip != NULL;
+}
+
+static void bench(const char* name, size_t chunk, bench_fn fn)
+{
+	double best_ns = 0;
+	double best_cyc = 0;
+
+	for (int r = 0; r < BENCH_REPEAT; r++) {
+		size_t bytes = 0;
+		uint64_t c = cycles_read();
+		uint64_t t = now_ns();
+		while (bytes < total) {
+			bytes += fn(chunk);
+		}
+		double ns = (double)(now_ns() - t) / bytes;
+		double cyc = (double)(cycles_read() - c) / bytes;
+		if (r == 0 || ns < best_ns) {
+			best_ns = ns;
+			best_cyc = cyc;
+		}
+	}
+
+	if (cycles_fd < 0) {
+		best_cyc = best_ns * mhz / 1000;
+	}
+	printf("%-22s %6zu %9.3f ", name, chunk, best_ns);
+	if (best_cyc > 0) {
+		printf("%9.3f", best_cyc);
+	} else {
+		printf("%9s", "n/a");
+	}
+	printf(" %9.1f\n", 1000 / best_ns);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"Usage: nrfdfu-microbench [options]\n"
+			"Time SLIP, CRC32 and ZIP reading per byte\n"
+			"Options:\n"
+			"  -h, --help\t\tShow help\n"
+			"  -s, --size <MiB>\tBytes per run (16)\n"
+			"  -f, --freq <MHz>\tCPU clock, when cycles can't be counted\n");
+}
+
+static struct option options[] = {{"help", no_argument, NULL, 'h'},
+								  {"size", required_argument, NULL, 's'},
+								  {"freq", required_argument, NULL, 'f'},
+								  {NULL, 0, NULL, 0}};
+
+int main(int argc, char* argv[])
+{
+	/* the sizes of one write over Serial (default, packed) and BLE (244
+	 * and the largest ATT MTU) and of the CRC table steps */
+	const size_t mtus[] = {64, 129, 244, 509};
+	const size_t crcs[] = {64, 129, 244, 509, 1024};
+	const size_t reads[] = {200, 64, 244};
+	char path[] = "/tmp/nrfdfu-microbench-XXXXXX";
+	char crc_name[32];
+	int n;
+
+	while ((n = getopt_long(argc, argv, "hs:f:", options, NULL)) >= 0) {
+		switch (n) {
+		case 's':
+			total = atof(optarg) * 1024 * 1024;
+			break;
+		case 'f':
+			mhz = atof(optarg);
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	data_init();
+	snprintf(crc_name, sizeof(crc_name), "crc_update %s", crc_backend());
+	cycles_open();
+	if (cycles_fd < 0) {
+		fprintf(stderr, "Can't count cycles%s\n",
+				mhz > 0 ? ", estimating from -f" : ", use -f");
+	}
+
+	printf("%-22s %6s %9s %9s %9s\n", "", "chunk", "ns/byte", "cyc/byte",
+		   "MB/s");
+
+	for (int i = 0; i < ARRAY_SIZE(mtus); i++) {
+		bench("slip_encode", mtus[i], run_slip_encode);
+		bench("slip_encode_bulk", mtus[i], run_slip_encode_bulk);
+	}
+	for (int i = 0; i < ARRAY_SIZE(mtus); i++) {
+		enc_init(mtus[i]);
+		bench("slip_decode_add_byte", mtus[i], run_slip_decode);
+		bench("slip_decode_bulk", mtus[i], run_slip_decode_bulk);
+	}
+	if (!crc_check()) {
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < ARRAY_SIZE(crcs); i++) {
+		bench("crc32 zlib", crcs[i], run_crc32);
+		bench(crc_name, crcs[i], run_crc_update);
+	}
+
+	if (zip_init(path)) {
+		for (int i = 0; i < ARRAY_SIZE(reads); i++) {
+			bench("zip_fread stored", reads[i], run_zip_stored);
+			bench("zip_fread deflated", reads[i], run_zip_deflated);
+		}
+		zip_close(zip);
+	} else {
+		fprintf(stderr, "Could not create ZIP file '%s'\n", path);
+	}
+	unlink(path);
+
+	return EXIT_SUCCESS;
+}
@@ -138,7 +138,7 @@ typedef struct
     uint32_t version;             //!< Firmware version.
     uint32_t addr;                //!< Firmware address in flash.
     uint32_t len;                 //!< Firmware length in bytes.
-} nrf_dfu_response_firmware_t;
+} __attribute__((packed)) nrf_dfu_response_firmware_t;
 
 /**
  * @brief @ref NRF_DFU_OP_OBJECT_SELECT response details.
@@ -0,0 +1,55 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef NRFDFU_H
+#define NRFDFU_H
+
+/*
+ * libnrfdfu: the DFU engine of nrfdfu, for programs which update devices
+ * themselves instead of running nrfdfu. The images can come from a DFU
+ * package, from memory or from any other source:
+ *
+ *	struct dfu_config conf;
+ *	struct dfu_package pkg = {0};
+ *	struct dfu_session s;
+ *
+ *	dfu_config_init(&conf);
+ *	image_from_buffer(&pkg.ap_dat, dat, dat_len);
+ *	image_from_read(&pkg.ap_bin, bin_len, my_read, my_file);
+ *	pkg.ap = true;
+ *
+ *	dfu_session_init(&s, "/dev/ttyUSB0", &conf);
+ *	s.cb.progress = my_progress;
+ *	bool ok = dfu_flash(&s, &pkg);
+ *	dfu_session_fini(&s);
+ *	stats_free(&s.stats);
+ *
+ * Several sessions can run in parallel threads with the same config and
+ * package. Messages are printed according to log_level.
+ */
+
+#include "arena.h"
+#include "conf.h"
+#include "dfu.h"
+#include "image.h"
+#include "log.h"
+#include "package.h"
+#include "stats.h"
+
+#endif
@@ -0,0 +1,623 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zip.h>
+
+#include "log.h"
+#include "package.h"
+#include "stream.h"
+#include "util.h"
+
+#define PKG_NAME_MAX	256
+#define MANIFEST_CHUNK	256 /* read at once */
+#define MANIFEST_NEST	32	/* of objects and arrays */
+#define MANIFEST_KEY	32
+#define MANIFEST_LEVELS 3 /* manifest, section, file */
+
+/* the file names of the manifest, empty if not there */
+struct pkg_names {
+	char ap_dat[PKG_NAME_MAX];
+	char ap_bin[PKG_NAME_MAX];
+	char sb_dat[PKG_NAME_MAX];
+	char sb_bin[PKG_NAME_MAX];
+	bool ap; /* sections which are there */
+	bool sb;
+	bool sb_combined; /* softdevice_bootloader, before bootloader */
+	bool known;
+};
+
+/* An incremental JSON tokenizer, which only keeps the strings of
+ * manifest.<section>.<key>, so the manifest is never in memory as a whole */
+struct manifest_tok {
+	struct pkg_names* n;
+	int depth;
+	uint32_t arrays; /* bit per depth: this level is an array */
+	bool want_key;
+	bool is_key;
+	bool in_str;
+	bool esc;
+	bool trunc;
+	size_t len;
+	char str[PKG_NAME_MAX];
+	char keys[MANIFEST_LEVELS][MANIFEST_KEY];
+};
+
+/* an entry of a stream which came before the manifest */
+struct pkg_entry {
+	char* name;
+	struct dfu_image img;
+};
+
+static char* manifest_field(struct pkg_names* n, const char* section,
+							const char* key)
+{
+	bool dat = strcmp(key, "dat_file") == 0;
+
+	if (!dat && strcmp(key, "bin_file") != 0) {
+		return NULL;
+	}
+	if (strcmp(section, "application") == 0) {
+		return dat ? n->ap_dat : n->ap_bin;
+	}
+	if (strcmp(section, "softdevice_bootloader") == 0
+		|| (strcmp(section, "bootloader") == 0 && !n->sb_combined)) {
+		return dat ? n->sb_dat : n->sb_bin;
+	}
+	return NULL;
+}
+
+static void manifest_key(struct manifest_tok* t, const char* key)
+{
+	struct pkg_names* n = t->n;
+
+	/* longer keys are none we look for, they just must not match */
+	if (t->depth <= MANIFEST_LEVELS) {
+		size_t len = MIN(strlen(key), MANIFEST_KEY - 1);
+		memcpy(t->keys[t->depth - 1], key, len);
+		t->keys[t->depth - 1][len] = '\0';
+	}
+	if (t->depth == 1 && strcmp(key, "manifest") == 0) {
+		n->known = true;
+	}
+	if (t->depth != 2 || strcmp(t->keys[0], "manifest") != 0) {
+		return;
+	}
+	if (strcmp(key, "application") == 0) {
+		n->ap = true;
+	} else if (strcmp(key, "softdevice_bootloader") == 0) {
+		if (!n->sb_combined) {
+			/* a bootloader section before is not used */
+			n->sb_dat[0] = n->sb_bin[0] = '\0';
+		}
+		n->sb = n->sb_combined = true;
+	} else if (strcmp(key, "bootloader") == 0) {
+		n->sb = true;
+	}
+}
+
+static bool manifest_string(struct manifest_tok* t)
+{
+	t->str[t->len] = '\0';
+
+	if (t->is_key) {
+		manifest_key(t, t->str);
+		return true;
+	}
+
+	/* a value of manifest.<section>.<key> */
+	if (t->depth != MANIFEST_LEVELS || (t->arrays & (1u << t->depth))
+		|| strcmp(t->keys[0], "manifest") != 0) {
+		return true;
+	}
+	char* f = manifest_field(t->n, t->keys[1], t->keys[2]);
+	if (f == NULL) {
+		return true;
+	}
+	if (t->trunc) {
+		LOG_ERR("File name in manifest too long");
+		return false;
+	}
+	memcpy(f, t->str, t->len + 1);
+	return true;
+}
+
+/* the next part of the manifest, it does not have to end at a token */
+static bool manifest_feed(struct manifest_tok* t, const char* buf,
+						  size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		char c = buf[i];
+
+		if (t->in_str) {
+			if (!t->esc && c == '"') {
+				t->in_str = false;
+				if (!manifest_string(t)) {
+					return false;
+				}
+				continue;
+			}
+			if (!t->esc && c == '\\') {
+				t->esc = true;
+				continue;
+			}
+			/* escapes are kept as the character, file names don't have
+			 * \u sequences */
+			t->esc = false;
+			if (t->len < sizeof(t->str) - 1) {
+				t->str[t->len++] = c;
+			} else {
+				t->trunc = true;
+			}
+			continue;
+		}
+
+		switch (c) {
+		case '{':
+		case '[':
+			if (++t->depth >= MANIFEST_NEST) {
+				LOG_ERR("Manifest nested too deep");
+				return false;
+			}
+			if (c == '[') {
+				t->arrays |= 1u << t->depth;
+			} else {
+				t->arrays &= ~(1u << t->depth);
+			}
+			t->want_key = c == '{';
+			break;
+		case '}':
+		case ']':
+			if (t->depth == 0) {
+				LOG_ERR("Manifest not valid JSON");
+				return false;
+			}
+			t->depth--;
+			t->want_key = false;
+			break;
+		case ',':
+			t->want_key = t->depth > 0 && !(t->arrays & (1u << t->depth));
+			break;
+		case ':':
+			t->want_key = false;
+			break;
+		case '"':
+			t->in_str = true;
+			t->is_key = t->want_key;
+			t->len = 0;
+			t->trunc = false;
+			break;
+		default:
+			/* white space, numbers, true, false and null */
+			break;
+		}
+	}
+	return true;
+}
+
+static bool manifest_done(struct manifest_tok* t)
+{
+	struct pkg_names* n = t->n;
+
+	if (t->depth != 0 || t->in_str) {
+		LOG_ERR("Manifest not valid JSON");
+		return false;
+	}
+	if (!n->known) {
+		LOG_ERR("Manifest format unknown");
+		return false;
+	}
+	if (n->ap && (!n->ap_dat[0] || !n->ap_bin[0])) {
+		LOG_ERR("Manifest missing app files");
+		return false;
+	}
+	if (n->sb && (!n->sb_dat[0] || !n->sb_bin[0])) {
+		LOG_ERR("Manifest missing softdevice/bootloader files");
+		return false;
+	}
+	return true;
+}
+
+static bool read_manifest(zip_t* zip, struct pkg_names* n)
+{
+	struct manifest_tok t = {.n = n};
+	char buf[MANIFEST_CHUNK];
+	zip_int64_t len;
+
+	zip_file_t* zf = zip_fopen(zip, "manifest.json", 0);
+	if (zf == NULL) {
+		LOG_ERR("ZIP file does not contain manifest");
+		return false;
+	}
+
+	while ((len = zip_fread(zf, buf, sizeof(buf))) > 0) {
+		if (!manifest_feed(&t, buf, len)) {
+			zip_fclose(zf);
+			return false;
+		}
+	}
+	zip_fclose(zf);
+	if (len < 0) {
+		LOG_ERR("Could not read Manifest");
+		return false;
+	}
+	return manifest_done(&t);
+}
+
+/* read the files of the manifest, from the file at map_path if it is
+ * given and can be mapped */
+static bool package_read(struct dfu_package* pkg, zip_t* zip,
+						 const char* map_path)
+{
+	struct pkg_names n = {0};
+
+	if (!read_manifest(zip, &n)) {
+		return false;
+	}
+
+	/* uncompressed files are used directly from the mapped ZIP file, if
+	 * mapping fails they are just read */
+	if (map_path != NULL) {
+		zip_map_open(&pkg->map, map_path);
+	}
+
+	/* read all data files in ZIP file before starting */
+	if (n.sb) {
+		if (!image_load(&pkg->sb_dat, zip, n.sb_dat, &pkg->map)
+			|| !image_load(&pkg->sb_bin, zip, n.sb_bin, &pkg->map)) {
+			LOG_ERR("Cannot read SD files in ZIP");
+			return false;
+		}
+		pkg->sb = true;
+		LOG_INF("Update contains Softdevice/Bootloader");
+	}
+	if (n.ap) {
+		if (!image_load(&pkg->ap_dat, zip, n.ap_dat, &pkg->map)
+			|| !image_load(&pkg->ap_bin, zip, n.ap_bin, &pkg->map)) {
+			LOG_ERR("Cannot read APP files in ZIP");
+			return false;
+		}
+		pkg->ap = true;
+		LOG_INF("Update contains Application");
+	}
+	return true;
+}
+
+bool package_load(struct dfu_package* pkg, const char* path, bool map)
+{
+	zip_t* zip = zip_open(path, ZIP_RDONLY, NULL);
+	if (zip == NULL) {
+		LOG_ERR("Could not open ZIP file '%s'", path);
+		return false;
+	}
+
+	bool ret = package_read(pkg, zip, map ? path : NULL);
+	zip_close(zip);
+	return ret;
+}
+
+bool package_load_mem(struct dfu_package* pkg, const uint8_t* data,
+					  size_t len)
+{
+	zip_error_t err;
+	zip_t* zip = NULL;
+
+	zip_error_init(&err);
+	zip_source_t* src = zip_source_buffer_create(data, len, 0, &err);
+	if (src != NULL) {
+		zip = zip_open_from_source(src, ZIP_RDONLY, &err);
+	}
+	if (zip == NULL) {
+		LOG_ERR("Could not open ZIP data: %s", zip_error_strerror(&err));
+		zip_source_free(src);
+		zip_error_fini(&err);
+		return false;
+	}
+	zip_error_fini(&err);
+
+	bool ret = package_read(pkg, zip, NULL);
+	zip_close(zip);
+	return ret;
+}
+
+/* entries of a stream are matched by their file name without directory */
+static const char* file_base(const char* name)
+{
+	const char* base = strrchr(name, '/');
+	return base != NULL ? base + 1 : name;
+}
+
+/* the image for an entry of the stream, NULL if it is not in the manifest */
+static struct dfu_image* package_slot(struct dfu_package* pkg,
+									  const struct pkg_names* n,
+									  const char* name)
+{
+	const char* names[] = {n->sb_dat, n->sb_bin, n->ap_dat, n->ap_bin};
+	struct dfu_image* imgs[] = {&pkg->sb_dat, &pkg->sb_bin, &pkg->ap_dat,
+								&pkg->ap_bin};
+	for (int i = 0; i < ARRAY_SIZE(names); i++) {
+		if (names[i][0] != '\0' && strcmp(file_base(name), names[i]) == 0) {
+			return imgs[i];
+		}
+	}
+	return NULL;
+}
+
+/* number of files of the manifest which have not been read yet */
+static int package_missing(const struct dfu_package* pkg,
+						   const struct pkg_names* n, const char** name)
+{
+	const char* names[] = {n->sb_dat, n->sb_bin, n->ap_dat, n->ap_bin};
+	const struct dfu_image* imgs[] = {&pkg->sb_dat, &pkg->sb_bin,
+									  &pkg->ap_dat, &pkg->ap_bin};
+	int cnt = 0;
+
+	for (int i = 0; i < ARRAY_SIZE(names); i++) {
+		if (names[i][0] != '\0' && imgs[i]->crc_at == NULL) {
+			*name = names[i];
+			cnt++;
+		}
+	}
+	return cnt;
+}
+
+static bool stream_manifest(struct pkg_stream* st, size_t size,
+							struct pkg_names* n)
+{
+	struct manifest_tok t = {.n = n};
+	char buf[MANIFEST_CHUNK];
+
+	for (size_t pos = 0; pos < size; pos += sizeof(buf)) {
+		size_t len = MIN(size - pos, sizeof(buf));
+		if (!stream_read(st, pos, (uint8_t*)buf, len)
+			|| !manifest_feed(&t, buf, len)) {
+			return false;
+		}
+	}
+	return manifest_done(&t);
+}
+
+/* Read the package in the order of the archive. Files before the manifest
+ * are kept until it tells what they are. With stream the last firmware
+ * file is not read here but while it is sent */
+static bool package_load_stream(struct dfu_package* pkg, int fd, bool stream)
+{
+	bool ret = false;
+	bool have_manifest = false;
+	struct pkg_names n = {0};
+	struct pkg_entry* early = NULL;
+	int num_early = 0;
+	const char* name;
+	size_t size;
+
+	struct pkg_stream* st = stream_open(fd);
+	if (st == NULL) {
+		return false;
+	}
+
+	for (;;) {
+		if (!stream_next(st, &name, &size)) {
+			goto exit;
+		}
+		if (name == NULL) {
+			break;
+		}
+
+		if (!have_manifest && strcmp(file_base(name), "manifest.json") == 0) {
+			if (!stream_manifest(st, size, &n)) {
+				goto exit;
+			}
+			have_manifest = true;
+			for (int i = 0; i < num_early; i++) {
+				struct dfu_image* img = package_slot(pkg, &n, early[i].name);
+				if (img != NULL && img->crc_at == NULL) {
+					*img = early[i].img;
+					memset(&early[i].img, 0, sizeof(early[i].img));
+				}
+			}
+			continue;
+		}
+
+		if (!have_manifest) {
+			struct pkg_entry* e = realloc(early, (num_early + 1) * sizeof(*e));
+			if (e == NULL) {
+				LOG_ERR("Could not allocate entry");
+				goto exit;
+			}
+			early = e;
+			e = &early[num_early++];
+			memset(e, 0, sizeof(*e));
+			e->name = strdup(name);
+			if (e->name == NULL
+				|| !image_from_read(&e->img, size, stream_read, st)) {
+				LOG_ERR("Cannot read '%s' from stream", name);
+				goto exit;
+			}
+			continue;
+		}
+
+		struct dfu_image* img = package_slot(pkg, &n, name);
+		if (img == NULL || img->crc_at != NULL) {
+			continue;
+		}
+		if (stream && package_missing(pkg, &n, &name) == 1
+			&& (img == &pkg->sb_bin || img == &pkg->ap_bin)) {
+			if (!image_from_stream(img, size, stream_read, st)) {
+				goto exit;
+			}
+			LOG_INF("Streaming '%s' while sending", name);
+			pkg->stream = st;
+			st = NULL;
+			break;
+		}
+		if (!image_from_read(img, size, stream_read, st)) {
+			LOG_ERR("Cannot read '%s' from stream", name);
+			goto exit;
+		}
+	}
+
+	if (!have_manifest) {
+		LOG_ERR("Package stream does not contain manifest");
+		goto exit;
+	}
+	if (package_missing(pkg, &n, &name) > 0) {
+		LOG_ERR("Package stream does not contain '%s'", name);
+		goto exit;
+	}
+
+	pkg->sb = n.sb;
+	pkg->ap = n.ap;
+	if (pkg->sb) {
+		LOG_INF("Update contains Softdevice/Bootloader");
+	}
+	if (pkg->ap) {
+		LOG_INF("Update contains Application");
+	}
+	ret = true;
+
+exit:
+	for (int i = 0; i < num_early; i++) {
+		free(early[i].name);
+		image_free(&early[i].img);
+	}
+	free(early);
+	stream_close(st);
+	return ret;
+}
+
+bool package_open(struct dfu_package* pkg, const char* path, bool stream)
+{
+	struct stat sb;
+	int fd;
+
+	if (strcmp(path, "-") == 0) {
+		/* the stream closes it, keep stdin open */
+		fd = dup(STDIN_FILENO);
+	} else if (stat(path, &sb) == 0 && !S_ISREG(sb.st_mode)) {
+		fd = open(path, O_RDONLY);
+	} else {
+		return package_load(pkg, path, true);
+	}
+
+	if (fd < 0) {
+		LOG_ERR("Could not open '%s': %s", path, strerror(errno));
+		return false;
+	}
+	return package_load_stream(pkg, fd, stream);
+}
+
+bool package_open_lean(struct dfu_package* pkg, const char* path)
+{
+	struct pkg_names n = {0};
+	struct stat sb;
+
+	if (strcmp(path, "-") == 0
+		|| (stat(path, &sb) == 0 && !S_ISREG(sb.st_mode))) {
+		return package_open(pkg, path, true);
+	}
+
+	pkg->zip = zip_open(path, ZIP_RDONLY, NULL);
+	if (pkg->zip == NULL) {
+		LOG_ERR("Could not open ZIP file '%s'", path);
+		return false;
+	}
+
+	if (!read_manifest(pkg->zip, &n)) {
+		return false;
+	}
+
+	/* the Init packets are small and parsed as a whole */
+	if (n.sb) {
+		if (!image_load(&pkg->sb_dat, pkg->zip, n.sb_dat, NULL)
+			|| !image_from_zip(&pkg->sb_bin, pkg->zip, n.sb_bin)) {
+			LOG_ERR("Cannot read SD files in ZIP");
+			return false;
+		}
+		pkg->sb = true;
+		LOG_INF("Update contains Softdevice/Bootloader");
+	}
+	if (n.ap) {
+		if (!image_load(&pkg->ap_dat, pkg->zip, n.ap_dat, NULL)
+			|| !image_from_zip(&pkg->ap_bin, pkg->zip, n.ap_bin)) {
+			LOG_ERR("Cannot read APP files in ZIP");
+			return false;
+		}
+		pkg->ap = true;
+		LOG_INF("Update contains Application");
+	}
+	return true;
+}
+
+bool package_load_raw(struct dfu_package* pkg, const char* sb_dat,
+					  const char* sb_bin, const char* ap_dat,
+					  const char* ap_bin)
+{
+	if (sb_dat && sb_bin) {
+		if (!image_from_file(&pkg->sb_dat, sb_dat)
+			|| !image_from_file(&pkg->sb_bin, sb_bin)) {
+			return false;
+		}
+		pkg->sb = true;
+		LOG_INF("Update contains Softdevice/Bootloader");
+	}
+	if (ap_dat && ap_bin) {
+		if (!image_from_file(&pkg->ap_dat, ap_dat)
+			|| !image_from_file(&pkg->ap_bin, ap_bin)) {
+			return false;
+		}
+		pkg->ap = true;
+		LOG_INF("Update contains Application");
+	}
+	return true;
+}
+
+void package_free(struct dfu_package* pkg)
+{
+	image_free(&pkg->ap_dat);
+	image_free(&pkg->ap_bin);
+	image_free(&pkg->sb_dat);
+	image_free(&pkg->sb_bin);
+	zip_map_close(&pkg->map);
+	stream_close(pkg->stream);
+	pkg->stream = NULL;
+	if (pkg->zip != NULL) {
+		zip_close(pkg->zip);
+		pkg->zip = NULL;
+	}
+}
+
+/* bytes sent for a complete update */
+size_t package_size(const struct dfu_package* pkg)
+{
+	size_t total = 0;
+
+	if (pkg->sb) {
+		total += pkg->sb_dat.size + pkg->sb_bin.size;
+	}
+	if (pkg->ap) {
+		total += pkg->ap_dat.size + pkg->ap_bin.size;
+	}
+	return total;
+}
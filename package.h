@@ -0,0 +1,64 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKAGE_H
+#define PACKAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+
+struct pkg_stream;
+
+/* the decoded DFU package, shared by all sessions */
+struct dfu_package {
+	struct dfu_image sb_dat;
+	struct dfu_image sb_bin;
+	struct dfu_image ap_dat;
+	struct dfu_image ap_bin;
+	bool sb;
+	bool ap;
+	struct zip_map map;
+	struct pkg_stream* stream; /* the last firmware file is read from it */
+	zip_t* zip; /* the firmware files are read from it while they are sent */
+};
+
+/* with map uncompressed files are used from the mapped ZIP file, which
+ * must then not change while the package is used */
+bool package_load(struct dfu_package* pkg, const char* path, bool map);
+/* like package_load from a ZIP file in memory, the files are copied */
+bool package_load_mem(struct dfu_package* pkg, const uint8_t* data,
+					  size_t len);
+/* like package_load, but "-" is stdin and files which are not regular,
+ * like pipes, are read as a stream. With stream the last firmware file is
+ * read while it is sent, so the package can only be used once */
+bool package_open(struct dfu_package* pkg, const char* path, bool stream);
+/* like package_open with stream, but a ZIP file is kept open and each
+ * firmware file is only read while it is sent, for the low memory mode */
+bool package_open_lean(struct dfu_package* pkg, const char* path);
+/* the .dat and .bin files given directly, either pair can be NULL */
+bool package_load_raw(struct dfu_package* pkg, const char* sb_dat,
+					  const char* sb_bin, const char* ap_dat,
+					  const char* ap_bin);
+void package_free(struct dfu_package* pkg);
+size_t package_size(const struct dfu_package* pkg);
+
+#endif
@@ -20,43 +20,62 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/serial.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "evloop.h"
 #include "log.h"
 #include "serialtty.h"
+#include "util.h"
 
 #define MAX_CONF_LEN 200
 
-static struct termios tty;
-static struct termios otty;
+/* look for the port again at least this often, in case inotify misses it,
+ * e.g. when its directory is created as well */
+#define PORT_POLL_MS 100
 
-static void serial_set_tty_speed(int baud)
+/* how many directories up from the tty the USB device can be */
+#define USB_DEV_DEPTH 4
+
+/* returns false if baud is not one of the standard rates and has to be set
+ * with serial_set_custom_speed() after tcsetattr() */
+static bool serial_set_tty_speed(struct termios* tty, int baud)
 {
 	// clang-format off
 	switch (baud) {
-		case 57600:		tty.c_cflag |= B57600; break;
-		case 115200:	tty.c_cflag |= B115200; break;
-		case 230400:	tty.c_cflag |= B230400; break;
-		case 460800:	tty.c_cflag |= B460800; break;
-		case 500000:	tty.c_cflag |= B500000; break;
-		case 576000:	tty.c_cflag |= B576000; break;
-		case 921600:	tty.c_cflag |= B921600; break;
-		case 1000000:	tty.c_cflag |= B1000000; break;
-		default:		LOG_ERR("Unknown baudrate %d", baud);
+		case 57600:		tty->c_cflag |= B57600; break;
+		case 115200:	tty->c_cflag |= B115200; break;
+		case 230400:	tty->c_cflag |= B230400; break;
+		case 460800:	tty->c_cflag |= B460800; break;
+		case 500000:	tty->c_cflag |= B500000; break;
+		case 576000:	tty->c_cflag |= B576000; break;
+		case 921600:	tty->c_cflag |= B921600; break;
+		case 1000000:	tty->c_cflag |= B1000000; break;
+		case 2000000:	tty->c_cflag |= B2000000; break;
+		case 3000000:	tty->c_cflag |= B3000000; break;
+		default:		tty->c_cflag |= B38400; return false;
 	}
 	// clang-format on
+	return true;
 }
-int serial_init(const char* dev, int baud)
+
+/* the original attributes are saved in otty for serial_fini(). rtscts
+ * enables hardware flow control */
+int serial_init(const char* dev, int baud, bool rtscts, struct termios* otty)
 {
+	struct termios tty;
+
 	int fd = open(dev, O_RDWR | O_NOCTTY | O_NDELAY);
 	if (fd < 0) {
 		LOG_ERR("Couldn't open serial device '%s'", dev);
@@ -65,9 +84,9 @@ int serial_init(const char* dev, int baud)
 
 	/* set necessary serial port attributes */
 	memset(&tty, 0, sizeof tty);
-	memset(&otty, 0, sizeof tty);
+	memset(otty, 0, sizeof tty);
 
-	if (tcgetattr(fd, &otty) != 0) {
+	if (tcgetattr(fd, otty) != 0) {
 		LOG_ERR("Couldn't get termio attrs");
 		close(fd);
 		return -1;
@@ -81,9 +100,9 @@ int serial_init(const char* dev, int baud)
 
 	tty.c_iflag = IGNPAR;
 	tty.c_oflag = 0;
-	tty.c_cflag = CLOCAL | CREAD | CS8;
+	tty.c_cflag = CLOCAL | CREAD | CS8 | (rtscts ? CRTSCTS : 0);
 	tty.c_lflag = 0;
-	serial_set_tty_speed(baud);
+	bool std_speed = serial_set_tty_speed(&tty, baud);
 
 	tcflush(fd, TCIFLUSH);
 
@@ -93,10 +112,15 @@ int serial_init(const char* dev, int baud)
 		return -1;
 	}
 
+	if (!std_speed && !serial_set_custom_speed(fd, baud)) {
+		close(fd);
+		return -1;
+	}
+
 	return fd;
 }
 
-void serial_fini(int sock)
+void serial_fini(int sock, const struct termios* otty)
 {
 	if (sock < 0) {
 		return;
@@ -109,45 +133,34 @@ void serial_fini(int sock)
 	ioctl(sock, TIOCMSET, &serialLines);
 
 	/* reset terminal settings to original */
-	if (tcsetattr(sock, TCSANOW, &otty) != 0) {
+	if (tcsetattr(sock, TCSANOW, otty) != 0) {
 		LOG_ERR("Couldn't reset termio attrs");
 	}
 
+	ev_forget(sock);
 	close(sock);
 }
 
-bool serial_wait_read_ready(int fd, int sec)
+bool serial_wait_read_ready(int fd, int timeout_ms)
 {
 	if (fd < 0) {
 		return false;
 	}
 
-	struct timeval tv = {};
-	fd_set fds = {};
-	tv.tv_sec = sec;
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
-	int ret = select(fd + 1, &fds, NULL, NULL, &tv);
-	return ret <= 0; // error or timeout
+	return ev_wait(fd, POLLIN, timeout_ms) <= 0; // error or timeout
 }
 
-bool serial_wait_write_ready(int fd, int sec)
+bool serial_wait_write_ready(int fd, int timeout_ms)
 {
 	if (fd < 0) {
 		return false;
 	}
 
-	struct timeval tv = {};
-	fd_set fds = {};
-	tv.tv_sec = sec;
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
-	int ret = select(fd + 1, NULL, &fds, NULL, &tv);
-	return ret <= 0; // error or timeout
+	return ev_wait(fd, POLLOUT, timeout_ms) <= 0; // error or timeout
 }
 
 /* write to serial handling blocking case */
-bool serial_write(int fd, const char* buf, size_t len, int timeout_sec)
+bool serial_write(int fd, const char* buf, size_t len, int timeout_ms)
 {
 	ssize_t ret;
 	size_t pos = 0;
@@ -161,7 +174,7 @@ bool serial_write(int fd, const char* buf, size_t len, int timeout_sec)
 		if (ret == -1) {
 			if (errno == EAGAIN) {
 				/* write would block, wait until ready again */
-				serial_wait_write_ready(fd, timeout_sec);
+				serial_wait_write_ready(fd, timeout_ms);
 				continue;
 			} else {
 				/* grave error */
@@ -171,7 +184,7 @@ bool serial_write(int fd, const char* buf, size_t len, int timeout_sec)
 		} else if ((size_t)ret < len - pos) {
 			/* partial writes usually mean next write would return
 			 * EAGAIN, so just wait until it's ready again */
-			serial_wait_write_ready(fd, timeout_sec);
+			serial_wait_write_ready(fd, timeout_ms);
 		}
 		pos += ret;
 	} while (pos < len);
@@ -181,16 +194,200 @@ bool serial_write(int fd, const char* buf, size_t len, int timeout_sec)
 
 bool serial_set_baudrate(int fd, int baud)
 {
+	struct termios tty;
+
 	if (fd < 0) {
 		return false;
 	}
 
-	tty.c_cflag = CLOCAL | CREAD | CS8;
-	serial_set_tty_speed(baud);
+	if (tcgetattr(fd, &tty) != 0) {
+		LOG_ERR("Couldn't get termio attrs");
+		return false;
+	}
+
+	tty.c_cflag = CLOCAL | CREAD | CS8 | (tty.c_cflag & CRTSCTS);
+	bool std_speed = serial_set_tty_speed(&tty, baud);
 
 	if (tcsetattr(fd, TCSAFLUSH, &tty) != 0) {
 		LOG_ERR("Couldn't set termio attrs baudrate");
 		return false;
 	}
+
+	if (!std_speed) {
+		return serial_set_custom_speed(fd, baud);
+	}
 	return true;
 }
+
+/* true if the device node at path is not the one open as fd anymore, e.g.
+ * because a USB CDC device re-enumerated when it reset */
+bool serial_port_changed(int fd, const char* path)
+{
+	struct stat a;
+	struct stat b;
+
+	if (fstat(fd, &a) < 0 || stat(path, &b) < 0) {
+		return true;
+	}
+	return a.st_rdev != b.st_rdev || a.st_ino != b.st_ino;
+}
+
+/* wait until the device node at path exists and we may open it. The
+ * directory is watched with inotify so we know as soon as udev created it
+ * and set its permissions */
+bool serial_wait_port(const char* path, int timeout_ms)
+{
+	uint64_t end = ev_now_ms() + timeout_ms;
+	char dir[PATH_MAX];
+	char ev[sizeof(struct inotify_event) + NAME_MAX + 1];
+	bool ret;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	char* slash = strrchr(dir, '/');
+	if (slash == NULL) {
+		strcpy(dir, ".");
+	} else {
+		slash[slash == dir ? 1 : 0] = '\0';
+	}
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd >= 0
+		&& inotify_add_watch(fd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO)
+			   < 0) {
+		close(fd);
+		fd = -1;
+	}
+
+	while (!(ret = access(path, R_OK | W_OK) == 0)) {
+		uint64_t now = ev_now_ms();
+		if (now >= end) {
+			break;
+		}
+		int ms = MIN(end - now, PORT_POLL_MS);
+		if (fd >= 0 && ev_wait(fd, POLLIN, ms) > 0) {
+			while (read(fd, ev, sizeof(ev)) > 0) {
+				; // just a reason to look again
+			}
+		} else if (fd < 0) {
+			ev_sleep(ms);
+		}
+	}
+
+	if (fd >= 0) {
+		ev_forget(fd);
+		close(fd);
+	}
+	return ret;
+}
+
+/* the kernel name of the tty at path, e.g. ttyUSB0 for a udev symlink */
+static bool serial_tty_name(const char* path, char* name, size_t len)
+{
+	char real[PATH_MAX];
+
+	if (realpath(path, real) == NULL) {
+		return false;
+	}
+	snprintf(name, len, "%s", basename(real));
+	return true;
+}
+
+static bool sysfs_read(const char* path, char* buf, size_t len)
+{
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		return false;
+	}
+	bool ret = fgets(buf, len, f) != NULL;
+	fclose(f);
+	return ret;
+}
+
+/* USB vendor and product ID of the bridge or CDC device behind the tty at
+ * path. False for ports which are not on USB */
+bool serial_usb_id(const char* path, uint16_t* vid, uint16_t* pid)
+{
+	char name[NAME_MAX + 1];
+	char dir[PATH_MAX];
+	char file[PATH_MAX + 16];
+	char buf[16];
+
+	if (!serial_tty_name(path, name, sizeof(name))) {
+		return false;
+	}
+	snprintf(file, sizeof(file), "/sys/class/tty/%s/device", name);
+	if (realpath(file, dir) == NULL) {
+		return false;
+	}
+
+	/* the tty belongs to an interface, the IDs are in its USB device */
+	for (int i = 0; i < USB_DEV_DEPTH && strlen(dir) > 1; i++) {
+		snprintf(file, sizeof(file), "%s/idVendor", dir);
+		if (sysfs_read(file, buf, sizeof(buf))) {
+			*vid = strtoul(buf, NULL, 16);
+			snprintf(file, sizeof(file), "%s/idProduct", dir);
+			if (!sysfs_read(file, buf, sizeof(buf))) {
+				return false;
+			}
+			*pid = strtoul(buf, NULL, 16);
+			return true;
+		}
+		*strrchr(dir, '/') = '\0';
+	}
+	return false;
+}
+
+/* ASYNC_LOW_LATENCY makes the driver pass received bytes on at once. The
+ * previous setting is returned in old */
+bool serial_set_low_latency(int fd, bool on, bool* old)
+{
+	struct serial_struct ss;
+
+	if (ioctl(fd, TIOCGSERIAL, &ss) < 0) {
+		return false;
+	}
+	if (old != NULL) {
+		*old = ss.flags & ASYNC_LOW_LATENCY;
+	}
+	if (on) {
+		ss.flags |= ASYNC_LOW_LATENCY;
+	} else {
+		ss.flags &= ~ASYNC_LOW_LATENCY;
+	}
+	return ioctl(fd, TIOCSSERIAL, &ss) == 0;
+}
+
+/* USB serial bridges like FTDI send what they received when their buffer
+ * is full or after the latency timer, 16 ms by default. Only drivers which
+ * have it show it in sysfs, and writing it usually needs root. The previous
+ * value in ms is returned in old */
+bool serial_set_latency_timer(const char* path, int ms, int* old)
+{
+	char name[NAME_MAX + 1];
+	char file[PATH_MAX];
+	char buf[16];
+
+	if (!serial_tty_name(path, name, sizeof(name))) {
+		return false;
+	}
+	snprintf(file, sizeof(file), "/sys/bus/usb-serial/devices/%s/latency_timer",
+			 name);
+	if (!sysfs_read(file, buf, sizeof(buf))) {
+		return false;
+	}
+	if (old != NULL) {
+		*old = atoi(buf);
+	}
+	if (atoi(buf) == ms) {
+		return true;
+	}
+
+	FILE* f = fopen(file, "w");
+	if (f == NULL) {
+		LOG_INF("Couldn't set latency timer of %s: %s", name, strerror(errno));
+		return false;
+	}
+	bool ret = fprintf(f, "%d\n", ms) > 0;
+	ret = fclose(f) == 0 && ret;
+	return ret;
+}
@@ -21,12 +21,25 @@
 #define LIBI_SERIALTTY_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
-int serial_init(const char* device_name, int baud);
-void serial_fini(int sock);
-bool serial_wait_read_ready(int fd, int sec);
-bool serial_wait_write_ready(int fd, int sec);
-bool serial_write(int fd, const char* buf, size_t len, int timeout_sec);
+/* not including <termios.h> here, it clashes with the kernel headers in
+ * serialtty_baud.c */
+struct termios;
+
+int serial_init(const char* device_name, int baud, bool rtscts,
+				struct termios* otty);
+void serial_fini(int sock, const struct termios* otty);
+bool serial_wait_read_ready(int fd, int timeout_ms);
+bool serial_wait_write_ready(int fd, int timeout_ms);
+bool serial_write(int fd, const char* buf, size_t len, int timeout_ms);
 bool serial_set_baudrate(int fd, int baud);
+bool serial_set_custom_speed(int fd, int baud);
+bool serial_port_changed(int fd, const char* path);
+bool serial_wait_port(const char* path, int timeout_ms);
+bool serial_usb_id(const char* path, uint16_t* vid, uint16_t* pid);
+bool serial_set_low_latency(int fd, bool on, bool* old);
+bool serial_set_latency_timer(const char* path, int ms, int* old);
 
 #endif
@@ -0,0 +1,63 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Arbitrary baud rates with termios2 and BOTHER. The kernel definitions
+ * needed for this clash with <termios.h>, so this has its own file */
+
+#include <stdbool.h>
+
+#include "log.h"
+#include "serialtty.h"
+
+#ifdef __linux__
+
+#include <asm/ioctls.h>
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+bool serial_set_custom_speed(int fd, int baud)
+{
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) != 0) {
+		LOG_ERR("Couldn't get termios2 attrs");
+		return false;
+	}
+
+	tio.c_cflag &= ~CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_ispeed = baud;
+	tio.c_ospeed = baud;
+
+	if (ioctl(fd, TCSETS2, &tio) != 0) {
+		LOG_ERR("Couldn't set baudrate %d", baud);
+		return false;
+	}
+	return true;
+}
+
+#else
+
+bool serial_set_custom_speed(int fd, int baud)
+{
+	LOG_ERR("Unknown baudrate %d", baud);
+	return false;
+}
+
+#endif
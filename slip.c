@@ -48,6 +48,34 @@
 #define SLIP_BYTE_ESC_END 0334 /* ESC ESC_END means END data byte */
 #define SLIP_BYTE_ESC_ESC 0335 /* ESC ESC_ESC means ESC data byte */
 
+/* Word-at-a-time scanning for the two special bytes: a word contains the
+ * byte c if (w ^ c...c) has a zero byte */
+typedef uintptr_t slip_word_t;
+#define SLIP_WORD_ONES	 ((slip_word_t)-1 / 0xFF)
+#define SLIP_WORD_HIGH	 (SLIP_WORD_ONES * 0x80)
+#define SLIP_HAS_ZERO(w) (((w)-SLIP_WORD_ONES) & ~(w)&SLIP_WORD_HIGH)
+#define SLIP_HAS_BYTE(w, c) SLIP_HAS_ZERO((w) ^ (SLIP_WORD_ONES * (c)))
+
+uint32_t slip_scan(const uint8_t* p, uint32_t len)
+{
+	uint32_t i = 0;
+	slip_word_t w;
+
+	for (; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, p + i, sizeof(w));
+		if (SLIP_HAS_BYTE(w, SLIP_BYTE_END)
+			|| SLIP_HAS_BYTE(w, SLIP_BYTE_ESC)) {
+			break;
+		}
+	}
+	for (; i < len; i++) {
+		if (p[i] == SLIP_BYTE_END || p[i] == SLIP_BYTE_ESC) {
+			break;
+		}
+	}
+	return i;
+}
+
 int slip_encode(uint8_t* p_output, uint8_t* p_input, uint32_t input_length,
 				uint32_t* p_output_buffer_length)
 {
@@ -79,6 +107,64 @@ int slip_encode(uint8_t* p_output, uint8_t* p_input, uint32_t input_length,
 	return 1;
 }
 
+int slip_encode_bulk(uint8_t* p_output, const uint8_t* p_input,
+					 uint32_t input_length, uint32_t* p_output_buffer_length)
+{
+	if (p_output == NULL || p_input == NULL || p_output_buffer_length == NULL) {
+		return 0;
+	}
+
+	uint32_t out = 0;
+	uint32_t in = 0;
+
+	while (in < input_length) {
+		uint32_t run = slip_scan(p_input + in, input_length - in);
+		memcpy(p_output + out, p_input + in, run);
+		out += run;
+		in += run;
+
+		if (in < input_length) {
+			p_output[out++] = SLIP_BYTE_ESC;
+			p_output[out++] = p_input[in++] == SLIP_BYTE_END
+								  ? SLIP_BYTE_ESC_END
+								  : SLIP_BYTE_ESC_ESC;
+		}
+	}
+	p_output[out++] = SLIP_BYTE_END;
+	*p_output_buffer_length = out;
+
+	return 1;
+}
+
+uint32_t slip_encode_fit(const uint8_t* p_input, uint32_t input_length,
+						 uint32_t max_output_length)
+{
+	if (p_input == NULL || max_output_length == 0) {
+		return 0;
+	}
+
+	uint32_t out = 1; /* END */
+	uint32_t in = 0;
+
+	while (in < input_length) {
+		uint32_t run = slip_scan(p_input + in, input_length - in);
+		if (out + run > max_output_length) {
+			return in + (max_output_length - out);
+		}
+		out += run;
+		in += run;
+
+		if (in < input_length) {
+			if (out + 2 > max_output_length) {
+				return in;
+			}
+			out += 2;
+			in++;
+		}
+	}
+	return in;
+}
+
 int slip_decode_add_byte(slip_t* p_slip, uint8_t c)
 {
 	if (p_slip == NULL) {
@@ -137,3 +223,59 @@ int slip_decode_add_byte(slip_t* p_slip, uint8_t c)
 
 	return -3;
 }
+
+int slip_decode_bulk(slip_t* p_slip, const uint8_t* p_input,
+					 uint32_t input_length, uint32_t* p_consumed)
+{
+	if (p_slip == NULL || p_input == NULL || p_consumed == NULL) {
+		return 0;
+	}
+
+	uint32_t in = 0;
+	int ret = -3;
+
+	while (in < input_length) {
+		if (p_slip->current_index == p_slip->buffer_len) {
+			/* no more room, every further byte is dropped */
+			in = input_length;
+			ret = -1;
+			break;
+		}
+
+		if (p_slip->state == SLIP_STATE_DECODING) {
+			/* copy the run of normal bytes in one go */
+			uint32_t run = slip_scan(p_input + in, input_length - in);
+			uint32_t room = p_slip->buffer_len - p_slip->current_index;
+			if (run > room) {
+				run = room;
+			}
+			if (run > 0) {
+				memcpy(p_slip->p_buffer + p_slip->current_index, p_input + in,
+					   run);
+				p_slip->current_index += run;
+				in += run;
+				ret = -3;
+				continue;
+			}
+		} else if (p_slip->state == SLIP_STATE_CLEARING_INVALID_PACKET) {
+			/* skip everything up to the next END */
+			const uint8_t* end
+				= memchr(p_input + in, SLIP_BYTE_END, input_length - in);
+			if (end == NULL) {
+				in = input_length;
+				ret = -3;
+				break;
+			}
+			in = end - p_input;
+		}
+
+		/* END, ESC and escaped bytes are handled by the byte-wise decoder */
+		ret = slip_decode_add_byte(p_slip, p_input[in++]);
+		if (ret == 1) {
+			break;
+		}
+	}
+
+	*p_consumed = in;
+	return ret;
+}
@@ -98,6 +98,41 @@ typedef struct {
 int slip_encode(uint8_t* p_output, uint8_t* p_input, uint32_t input_length,
 				uint32_t* p_output_buffer_length);
 
+/**@brief Function for encoding a SLIP packet, many bytes at a time.
+ *
+ * Produces exactly the same output as @ref slip_encode, but scans the input
+ * for END and ESC bytes a word at a time and copies the runs in between with
+ * memcpy. The same size requirements for the output buffer apply.
+ *
+ * @retval  1   If the input was successfully encoded into output.
+ * @retval  0   If one of the provided parameters is NULL.
+ */
+int slip_encode_bulk(uint8_t* p_output, const uint8_t* p_input,
+					 uint32_t input_length, uint32_t* p_output_buffer_length);
+
+/**@brief Function for finding the first byte which needs escaping.
+ *
+ * @param[in]   p       The bytes to scan, need not be aligned.
+ * @param[in]   len     Number of bytes in @p p.
+ *
+ * @return The number of bytes before the first END or ESC byte, @p len if
+ * there is none.
+ */
+uint32_t slip_scan(const uint8_t* p, uint32_t len);
+
+/**@brief Function for finding how much input fits into an encoded packet.
+ *
+ * @param[in]   p_input             The buffer to be encoded.
+ * @param[in]   input_length        The length of the input buffer.
+ * @param[in]   max_output_length   Maximum length of the encoded packet,
+ * including the END byte.
+ *
+ * @return The number of bytes from the start of @p p_input which can be
+ * encoded into at most @p max_output_length bytes.
+ */
+uint32_t slip_encode_fit(const uint8_t* p_input, uint32_t input_length,
+						 uint32_t max_output_length);
+
 /**@brief Function for decoding a SLIP packet.
  *
  * The decoded packet is put into @p p_slip::p_buffer. The index and buffer
@@ -122,6 +157,24 @@ int slip_encode(uint8_t* p_output, uint8_t* p_input, uint32_t input_length,
  */
 int slip_decode_add_byte(slip_t* p_slip, uint8_t c);
 
+/**@brief Function for decoding many bytes of a SLIP packet at once.
+ *
+ * Equivalent to calling @ref slip_decode_add_byte for each byte of
+ * @p p_input and stopping after the first byte for which it returns 1, but
+ * runs of bytes which need no decoding are copied with memcpy.
+ *
+ * @param[in,out]   p_slip        State of the decoding process.
+ * @param[in]       p_input       Bytes to decode.
+ * @param[in]       input_length  Number of bytes in @p p_input.
+ * @param[out]      p_consumed    Number of bytes of @p p_input used. Bytes
+ * after the end of a packet are not used.
+ *
+ * @return The return value of @ref slip_decode_add_byte for the last byte
+ * used, that is 1 if a packet has been parsed, or -3 if no byte was used.
+ */
+int slip_decode_bulk(slip_t* p_slip, const uint8_t* p_input,
+					 uint32_t input_length, uint32_t* p_consumed);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,378 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * nrfdfu-sliptest: checks that the word at a time SLIP code, slip_scan,
+ * slip_encode_bulk, slip_encode_fit and slip_decode_bulk, gives the same
+ * results as the byte by byte slip_encode and slip_decode_add_byte.
+ *
+ * The buffers are placed at every offset into a word and have END and ESC
+ * bytes at and around word boundaries, in runs and at random, and streams
+ * are cut into chunks in the middle of escapes.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slip.h"
+#include "util.h"
+
+#define END		0300
+#define ESC		0333
+#define ESC_END 0334
+#define ESC_ESC 0335
+
+#define MAX_LEN	 4096
+#define MAX_PKTS 64
+
+/* the bytes which matter to SLIP and two which don't */
+static const uint8_t specials[] = {END, ESC, ESC_END, ESC_ESC, 0x00, 0x41};
+
+/* word aligned, so a buffer can start at every offset into a word */
+static uint64_t in_words[MAX_LEN / 8 + 2];
+static uint8_t* const in = (uint8_t*)in_words;
+static uint8_t enc_ref[MAX_LEN * 2 + 16];
+static uint8_t enc_bulk[MAX_LEN * 2 + 16];
+
+static uint32_t seed = 1;
+static int failed;
+static int checks;
+
+/* xorshift, so runs are the same everywhere */
+static uint32_t rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static void fail(const char* what, const char* name, size_t off, size_t len)
+{
+	if (failed++ < 20) {
+		fprintf(stderr, "FAIL %s: %s, offset %zu, length %zu\n", what, name,
+				off, len);
+	}
+}
+
+static uint32_t scan_ref(const uint8_t* p, uint32_t len)
+{
+	uint32_t i = 0;
+	while (i < len && p[i] != END && p[i] != ESC) {
+		i++;
+	}
+	return i;
+}
+
+/* encoded length of the first len bytes, with END */
+static uint32_t encoded_len(const uint8_t* p, uint32_t len)
+{
+	uint32_t n = 1;
+	for (uint32_t i = 0; i < len; i++) {
+		n += (p[i] == END || p[i] == ESC) ? 2 : 1;
+	}
+	return n;
+}
+
+/* slip_encode_fit has to give the longest start which fits, and at least
+ * one byte when there is room for an escaped byte and END */
+static void check_fit(const char* name, const uint8_t* p, size_t off,
+					  size_t len)
+{
+	const uint32_t maxs[] = {1, 2, 3, 4, 5, 8, len / 2 + 1, len + 1,
+							 len * 2 + 1};
+
+	for (size_t m = 0; m < ARRAY_SIZE(maxs); m++) {
+		uint32_t fit = slip_encode_fit(p, len, maxs[m]);
+		checks++;
+		if (fit > len || encoded_len(p, fit) > maxs[m]
+			|| (fit < len && encoded_len(p, fit + 1) <= maxs[m])
+			|| (fit == 0 && len > 0 && maxs[m] >= 3)) {
+			fail("slip_encode_fit", name, off, len);
+		}
+	}
+}
+
+/* what a decoder ends up with after a stream */
+struct decoded {
+	uint8_t pkt[MAX_PKTS][MAX_LEN];
+	uint32_t pkt_len[MAX_PKTS];
+	int npkts;
+	int last_ret;
+	slip_read_state_t state;
+	uint32_t index;
+};
+
+static struct decoded dec_ref;
+static struct decoded dec_bulk;
+static uint8_t dec_buf[MAX_LEN];
+
+static void packet_done(struct decoded* d, slip_t* slip)
+{
+	if (d->npkts < MAX_PKTS) {
+		memcpy(d->pkt[d->npkts], slip->p_buffer, slip->current_index);
+		d->pkt_len[d->npkts] = slip->current_index;
+	}
+	d->npkts++;
+	slip->current_index = 0;
+}
+
+static void decode_ref(struct decoded* d, const uint8_t* p, size_t len,
+					   uint32_t buffer_len)
+{
+	slip_t slip = {.p_buffer = dec_buf, .buffer_len = buffer_len};
+
+	d->npkts = 0;
+	d->last_ret = -3;
+	for (size_t i = 0; i < len; i++) {
+		d->last_ret = slip_decode_add_byte(&slip, p[i]);
+		if (d->last_ret == 1) {
+			packet_done(d, &slip);
+		}
+	}
+	d->state = slip.state;
+	d->index = slip.current_index;
+}
+
+/* chunks of at most max_chunk bytes, 0 cuts after every ESC as well */
+static void decode_bulk(struct decoded* d, const uint8_t* p, size_t len,
+						uint32_t buffer_len, size_t max_chunk)
+{
+	slip_t slip = {.p_buffer = dec_buf, .buffer_len = buffer_len};
+	size_t i = 0;
+
+	d->npkts = 0;
+	d->last_ret = -3;
+	while (i < len) {
+		size_t n;
+		if (max_chunk > 0) {
+			n = 1 + rnd() % max_chunk;
+			n = MIN(n, len - i);
+		} else {
+			n = 1;
+			while (i + n < len && p[i + n - 1] != ESC) {
+				n++;
+			}
+		}
+		while (n > 0) {
+			uint32_t used = 0;
+			int ret = slip_decode_bulk(&slip, p + i, n, &used);
+			if (used == 0 || used > n) {
+				/* bulk has to make progress and stay in the chunk */
+				d->last_ret = 99;
+				i = len;
+				break;
+			}
+			d->last_ret = ret;
+			i += used;
+			n -= used;
+			if (ret == 1) {
+				packet_done(d, &slip);
+			}
+		}
+	}
+	d->state = slip.state;
+	d->index = slip.current_index;
+}
+
+static bool decoded_equal(const struct decoded* a, const struct decoded* b)
+{
+	if (a->npkts != b->npkts || a->last_ret != b->last_ret
+		|| a->state != b->state || a->index != b->index) {
+		return false;
+	}
+	for (int i = 0; i < MIN(a->npkts, MAX_PKTS); i++) {
+		if (a->pkt_len[i] != b->pkt_len[i]
+			|| memcmp(a->pkt[i], b->pkt[i], a->pkt_len[i]) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* feed a stream to both decoders, in large and small chunks and with a
+ * cut after each ESC, into a buffer which fits and one which doesn't */
+static void check_decode(const char* name, const uint8_t* p, size_t len,
+						 size_t off)
+{
+	const uint32_t buffer_lens[] = {MAX_LEN, 7};
+	const size_t chunks[] = {MAX_LEN, 9, 0};
+
+	for (size_t b = 0; b < ARRAY_SIZE(buffer_lens); b++) {
+		decode_ref(&dec_ref, p, len, buffer_lens[b]);
+		for (size_t c = 0; c < ARRAY_SIZE(chunks); c++) {
+			decode_bulk(&dec_bulk, p, len, buffer_lens[b], chunks[c]);
+			checks++;
+			if (!decoded_equal(&dec_ref, &dec_bulk)) {
+				fail("slip_decode_bulk", name, off, len);
+			}
+		}
+	}
+}
+
+/* in + off, len bytes: scan, encode, decode the encoding and the raw bytes
+ * as if they came from the wire */
+static void check_buf(const char* name, size_t off, size_t len)
+{
+	uint8_t* p = in + off;
+	uint32_t len_ref = 0;
+	uint32_t len_bulk = 0;
+
+	for (size_t i = 0; i <= len; i += (i < 24 ? 1 : 1 + len / 16)) {
+		checks++;
+		if (slip_scan(p + i, len - i) != scan_ref(p + i, len - i)) {
+			fail("slip_scan", name, off + i, len - i);
+		}
+	}
+
+	checks++;
+	if (!slip_encode(enc_ref, p, len, &len_ref)
+		|| !slip_encode_bulk(enc_bulk, p, len, &len_bulk)
+		|| len_ref != len_bulk || memcmp(enc_ref, enc_bulk, len_ref) != 0) {
+		fail("slip_encode_bulk", name, off, len);
+	}
+
+	check_fit(name, p, off, len);
+	check_decode(name, enc_ref, len_ref, off);
+	check_decode(name, p, len, off);
+
+	/* the packet without its END: the stream ends in the packet or, when
+	 * the last byte was escaped, in the middle of the escape */
+	if (len_ref >= 2) {
+		check_decode(name, enc_ref, len_ref - 1, off);
+		check_decode(name, enc_ref, len_ref - 2, off);
+	}
+}
+
+static void fill(size_t len, uint8_t filler)
+{
+	memset(in, filler, len);
+}
+
+/* all combinations of the special bytes up to 4 bytes, random ones up to
+ * 16, at all offsets into a word */
+static void test_short(void)
+{
+	for (size_t len = 0; len <= 4; len++) {
+		size_t combos = 1;
+		for (size_t i = 0; i < len; i++) {
+			combos *= ARRAY_SIZE(specials);
+		}
+		for (size_t c = 0; c < combos; c++) {
+			for (size_t off = 0; off < 8; off++) {
+				size_t v = c;
+				for (size_t i = 0; i < len; i++) {
+					in[off + i] = specials[v % ARRAY_SIZE(specials)];
+					v /= ARRAY_SIZE(specials);
+				}
+				check_buf("short combination", off, len);
+			}
+		}
+	}
+	for (size_t len = 0; len <= 16; len++) {
+		for (int r = 0; r < 200; r++) {
+			size_t off = rnd() % 8;
+			for (size_t i = 0; i < len; i++) {
+				in[off + i] = rnd() % 2 ? specials[rnd() % ARRAY_SIZE(specials)]
+										: rnd();
+			}
+			check_buf("short random", off, len);
+		}
+	}
+}
+
+/* one END or ESC at every position of a buffer, so also just before, at
+ * and after each word boundary */
+static void test_boundaries(void)
+{
+	const uint8_t bytes[] = {END, ESC};
+
+	for (size_t b = 0; b < ARRAY_SIZE(bytes); b++) {
+		for (size_t off = 0; off < 8; off++) {
+			for (size_t len = 1; len <= 40; len++) {
+				for (size_t pos = 0; pos < len; pos++) {
+					fill(off + len, 0x55);
+					in[off + pos] = bytes[b];
+					check_buf("special at boundary", off, len);
+				}
+			}
+		}
+	}
+}
+
+/* runs of END, of ESC and of both mixed, at varying positions */
+static void test_runs(void)
+{
+	for (int kind = 0; kind < 3; kind++) {
+		for (size_t run = 1; run <= 24; run++) {
+			for (size_t pos = 0; pos < 16; pos++) {
+				size_t off = (run + pos) % 8;
+				size_t len = pos + run + 17;
+				fill(off + len, 0xAA);
+				for (size_t i = 0; i < run; i++) {
+					in[off + pos + i] = kind == 0	? END
+										: kind == 1 ? ESC
+										: i % 2		? ESC
+													: END;
+				}
+				check_buf("run of specials", off, len);
+			}
+		}
+	}
+}
+
+/* random data with no, few and many bytes to escape, up to firmware
+ * object sizes */
+static void test_random(void)
+{
+	const uint32_t density[] = {0, 2, 16, 256};
+
+	for (int r = 0; r < 400; r++) {
+		size_t off = rnd() % 8;
+		size_t len = rnd() % (MAX_LEN - 8);
+		uint32_t d = density[r % ARRAY_SIZE(density)];
+		for (size_t i = 0; i < len; i++) {
+			uint8_t c = rnd();
+			if (d > 0 && rnd() % d == 0) {
+				c = specials[rnd() % 2];
+			} else if (d == 0 && (c == END || c == ESC)) {
+				c = 0;
+			}
+			in[off + i] = c;
+		}
+		check_buf("random", off, len);
+	}
+}
+
+int main(void)
+{
+	test_short();
+	test_boundaries();
+	test_runs();
+	test_random();
+
+	if (failed > 0) {
+		fprintf(stderr, "%d of %d checks failed\n", failed, checks);
+		return EXIT_FAILURE;
+	}
+	printf("All %d checks passed\n", checks);
+	return EXIT_SUCCESS;
+}
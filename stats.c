@@ -0,0 +1,231 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <json-c/json.h>
+
+#include "arena.h"
+#include "conf.h"
+#include "dfu.h"
+#include "nrf_dfu_req_handler.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+
+static const char* op_names[STATS_OP_MAX] = {
+	[STATS_ENTER] = "enter",   [STATS_PING] = "ping",
+	[STATS_SETUP] = "setup",   [STATS_SELECT] = "select",
+	[STATS_CREATE] = "create", [STATS_WRITE] = "write",
+	[STATS_CRC] = "crc",	   [STATS_PRN] = "prn",
+	[STATS_EXECUTE] = "execute",
+};
+
+uint64_t stats_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+const char* stats_op_name(enum stats_op op)
+{
+	return op < STATS_OP_MAX ? op_names[op] : "?";
+}
+
+/* account for one operation which started at start_us */
+void stats_op(struct dfu_stats* st, enum stats_op op, uint64_t start_us,
+			  size_t bytes, bool ok)
+{
+	struct stats_op_time* o = &st->op[op];
+	uint64_t t = stats_now_us() - start_us;
+
+	o->count++;
+	o->failed += !ok;
+	o->time_us += t;
+	o->max_us = MAX(o->max_us, t);
+	o->bytes += bytes;
+	trace_op(op, t, bytes, ok);
+}
+
+/* an object has been executed, returns its entry or NULL */
+const struct stats_object* stats_object(struct dfu_stats* st, uint8_t type,
+										uint32_t size, uint64_t start_us)
+{
+	if (st->num_obj == st->max_obj) {
+		size_t n = st->max_obj ? st->max_obj * 2 : 16;
+		struct stats_object* o = realloc(st->obj, n * sizeof(*o));
+		if (o == NULL) {
+			return NULL; // just not in the statistics
+		}
+		st->obj = o;
+		st->max_obj = n;
+	}
+
+	struct stats_object* o = &st->obj[st->num_obj++];
+	o->type = type;
+	o->size = size;
+	o->time_us = stats_now_us() - start_us;
+	stats_heap(st);
+	return o;
+}
+
+/* sample the heap in use, of the whole process. Only glibc can tell */
+void stats_heap(struct dfu_stats* st)
+{
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+	struct mallinfo2 mi = mallinfo2();
+	st->heap_peak = MAX(st->heap_peak, mi.uordblks + mi.hblkhd);
+#endif
+#endif
+}
+
+/* the most memory the process had, in bytes */
+size_t stats_rss_peak(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0) {
+		return 0;
+	}
+	return (size_t)ru.ru_maxrss * 1024;
+}
+
+static json_object* json_ms(uint64_t us)
+{
+	return json_object_new_double(us / 1000.0);
+}
+
+static json_object* json_rate(uint64_t bytes, uint64_t us)
+{
+	return json_object_new_int64(us > 0 ? bytes * 1000000 / us : 0);
+}
+
+/** all we know about the update of session s, ok is its result */
+json_object* stats_json(const struct dfu_session* s, bool ok)
+{
+	const struct dfu_stats* st = &s->stats;
+	uint64_t bytes = st->op[STATS_WRITE].bytes;
+	uint64_t total = st->end_us - st->start_us;
+
+	json_object* j = json_object_new_object();
+	json_object_object_add(j, "port", json_object_new_string(s->port));
+	json_object_object_add(j, "result",
+						   json_object_new_string(ok ? "ok" : "failed"));
+	json_object_object_add(j, "time_ms", json_ms(total));
+	json_object_object_add(j, "bytes", json_object_new_int64(bytes));
+	json_object_object_add(j, "bytes_per_sec", json_rate(bytes, total));
+	json_object_object_add(j, "mtu", json_object_new_int(s->mtu));
+	if (s->conf->dfu_type == DFU_SERIAL) {
+		json_object_object_add(j, "baud",
+							   json_object_new_int(s->ser.dfu_speed));
+	}
+	json_object_object_add(j, "prn", json_object_new_int(s->conf->prn));
+
+	json_object* ops = json_object_new_object();
+	for (int i = 0; i < STATS_OP_MAX; i++) {
+		const struct stats_op_time* o = &st->op[i];
+		if (o->count == 0) {
+			continue;
+		}
+		json_object* jo = json_object_new_object();
+		json_object_object_add(jo, "count", json_object_new_int(o->count));
+		json_object_object_add(jo, "failed", json_object_new_int(o->failed));
+		json_object_object_add(jo, "total_ms", json_ms(o->time_us));
+		json_object_object_add(jo, "avg_ms", json_ms(o->time_us / o->count));
+		json_object_object_add(jo, "max_ms", json_ms(o->max_us));
+		if (o->bytes > 0) {
+			json_object_object_add(jo, "bytes",
+								   json_object_new_int64(o->bytes));
+			json_object_object_add(jo, "bytes_per_sec",
+								   json_rate(o->bytes, o->time_us));
+		}
+		json_object_object_add(ops, op_names[i], jo);
+	}
+	json_object_object_add(j, "ops", ops);
+
+	json_object* objs = json_object_new_array();
+	for (size_t i = 0; i < st->num_obj; i++) {
+		const struct stats_object* o = &st->obj[i];
+		json_object* jo = json_object_new_object();
+		json_object_object_add(
+			jo, "type",
+			json_object_new_string(o->type == NRF_DFU_OBJ_TYPE_COMMAND
+									   ? "command"
+									   : "data"));
+		json_object_object_add(jo, "size", json_object_new_int64(o->size));
+		json_object_object_add(jo, "time_ms", json_ms(o->time_us));
+		json_object_object_add(jo, "bytes_per_sec",
+							   json_rate(o->size, o->time_us));
+		json_object_array_add(objs, jo);
+	}
+	json_object_object_add(j, "objects", objs);
+
+	json_object* r = json_object_new_object();
+	json_object_object_add(r, "entry", json_object_new_int(st->entry_retries));
+	json_object_object_add(r, "write", json_object_new_int(st->write_retries));
+	json_object_object_add(r, "restart", json_object_new_int(st->restarts));
+	json_object_object_add(r, "object",
+						   json_object_new_int(st->object_retries));
+	json_object_object_add(j, "retries", r);
+
+	json_object* res = json_object_new_object();
+	json_object_object_add(res, "skipped",
+						   json_object_new_int64(s->resume_skipped));
+	json_object_object_add(res, "resent",
+						   json_object_new_int64(s->resume_resent));
+	json_object_object_add(j, "resume", res);
+
+	const struct image_ahead_stats* a = &st->ahead;
+	if (a->parts > 0) {
+		json_object* ja = json_object_new_object();
+		json_object_object_add(ja, "parts", json_object_new_int(a->parts));
+		json_object_object_add(ja, "ready", json_object_new_int(a->ready));
+		json_object_object_add(ja, "stalls", json_object_new_int(a->stalls));
+		json_object_object_add(ja, "stall_ms", json_ms(a->stall_us));
+		json_object_object_add(ja, "dropped", json_object_new_int(a->dropped));
+		json_object_object_add(ja, "depth_max",
+							   json_object_new_int64(a->depth_max));
+		json_object_object_add(j, "read_ahead", ja);
+	}
+
+	json_object* mem = json_object_new_object();
+	json_object_object_add(mem, "heap_peak",
+						   json_object_new_int64(st->heap_peak));
+	json_object_object_add(mem, "rss_peak",
+						   json_object_new_int64(stats_rss_peak()));
+	json_object_object_add(mem, "arena_size",
+						   json_object_new_int64(arena_size()));
+	json_object_object_add(mem, "arena_peak",
+						   json_object_new_int64(arena_peak()));
+	json_object_object_add(j, "memory", mem);
+
+	return j;
+}
+
+void stats_free(struct dfu_stats* st)
+{
+	free(st->obj);
+	st->obj = NULL;
+	st->num_obj = st->max_obj = 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+
+struct dfu_session;
+struct json_object;
+
+/* protocol operations which are timed */
+enum stats_op {
+	STATS_ENTER,   /* entering the Bootloader and connecting */
+	STATS_PING,	   /* serial only */
+	STATS_SETUP,   /* PRN and MTU requests */
+	STATS_SELECT,  /* object select */
+	STATS_CREATE,  /* object create */
+	STATS_WRITE,   /* writing the data of an object, including PRN waits */
+	STATS_CRC,	   /* CRC requests */
+	STATS_PRN,	   /* waiting for packet receipt notifications */
+	STATS_EXECUTE, /* object execute, when the Bootloader writes flash */
+	STATS_OP_MAX
+};
+
+struct stats_op_time {
+	uint32_t count;
+	uint32_t failed;
+	uint64_t time_us;
+	uint64_t max_us;
+	uint64_t bytes;
+};
+
+/* one object from create to execute */
+struct stats_object {
+	uint8_t type;
+	uint32_t size;
+	uint64_t time_us;
+};
+
+struct dfu_stats {
+	uint64_t start_us;
+	uint64_t end_us;
+	struct stats_op_time op[STATS_OP_MAX];
+
+	struct stats_object* obj;
+	size_t num_obj;
+	size_t max_obj;
+
+	uint32_t entry_retries;	 /* pings or connections until it answered */
+	uint32_t write_retries;	 /* BLE writes BlueZ could not queue */
+	uint32_t restarts;		 /* starting over with a new Init packet */
+	uint32_t object_retries; /* objects sent again after an error */
+
+	size_t heap_peak; /* most heap in use when sampled, 0 if unknown */
+	/* reading streamed images ahead while sending */
+	struct image_ahead_stats ahead;
+};
+
+uint64_t stats_now_us(void);
+const char* stats_op_name(enum stats_op op);
+void stats_op(struct dfu_stats* st, enum stats_op op, uint64_t start_us,
+			  size_t bytes, bool ok);
+const struct stats_object* stats_object(struct dfu_stats* st, uint8_t type,
+										uint32_t size, uint64_t start_us);
+void stats_heap(struct dfu_stats* st);
+size_t stats_rss_peak(void);
+struct json_object* stats_json(const struct dfu_session* s, bool ok);
+void stats_free(struct dfu_stats* st);
+
+#endif
@@ -0,0 +1,336 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "crc.h"
+#include "log.h"
+#include "stream.h"
+#include "util.h"
+
+#define STREAM_BUF (16 * 1024)
+
+#define ZIP_LOCAL_SIG	 0x04034b50
+#define ZIP_CENTRAL_SIG	 0x02014b50
+#define ZIP_END_SIG		 0x06054b50
+#define ZIP_LOCAL_LEN	 30
+#define ZIP_FL_ENCRYPTED 0x01
+#define ZIP_FL_DATA_DESC 0x08
+
+#define TAR_BLOCK 512
+
+enum stream_fmt { STREAM_ZIP, STREAM_TAR };
+
+struct pkg_stream {
+	int fd;
+	enum stream_fmt fmt;
+	uint8_t in[STREAM_BUF];
+	size_t in_pos;
+	size_t in_len;
+
+	/* the current entry */
+	char name[257]; /* long enough for TAR prefix and name */
+	size_t size;   /* uncompressed */
+	size_t pos;	   /* uncompressed bytes read */
+	size_t remain; /* bytes of the entry left in the input */
+	size_t pad;	   /* TAR padding after the entry */
+	bool deflated;
+	bool zinit;
+	z_stream z;
+	uint32_t crc;
+	uint32_t crc_want;
+};
+
+/* read more input, false at the end of the stream */
+static bool in_fill(struct pkg_stream* st)
+{
+	ssize_t n;
+
+	if (st->in_pos > 0) {
+		memmove(st->in, st->in + st->in_pos, st->in_len - st->in_pos);
+		st->in_len -= st->in_pos;
+		st->in_pos = 0;
+	}
+
+	do {
+		n = read(st->fd, st->in + st->in_len, sizeof(st->in) - st->in_len);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		LOG_ERR("Could not read package stream: %s", strerror(errno));
+		return false;
+	}
+	st->in_len += n;
+	return n > 0;
+}
+
+/* read len input bytes to buf, or skip them if buf is NULL */
+static bool in_read(struct pkg_stream* st, uint8_t* buf, size_t len)
+{
+	while (len > 0) {
+		if (st->in_pos == st->in_len && !in_fill(st)) {
+			LOG_ERR("Package stream ended early");
+			return false;
+		}
+		size_t n = MIN(len, st->in_len - st->in_pos);
+		if (buf != NULL) {
+			memcpy(buf, st->in + st->in_pos, n);
+			buf += n;
+		}
+		st->in_pos += n;
+		len -= n;
+	}
+	return true;
+}
+
+struct pkg_stream* stream_open(int fd)
+{
+	struct pkg_stream* st = calloc(1, sizeof(*st));
+	if (st == NULL) {
+		LOG_ERR("Could not allocate stream");
+		close(fd);
+		return NULL;
+	}
+	st->fd = fd;
+
+	/* enough to recognize the format */
+	while (st->in_len < TAR_BLOCK && in_fill(st)) {
+	}
+
+	if (st->in_len >= 4 && get_le32(st->in) == ZIP_LOCAL_SIG) {
+		st->fmt = STREAM_ZIP;
+	} else if (st->in_len >= TAR_BLOCK
+			   && memcmp(st->in + 257, "ustar", 5) == 0) {
+		st->fmt = STREAM_TAR;
+	} else {
+		LOG_ERR("Package stream is neither ZIP nor TAR");
+		stream_close(st);
+		return NULL;
+	}
+	return st;
+}
+
+static bool zip_next(struct pkg_stream* st, const char** name)
+{
+	uint8_t h[ZIP_LOCAL_LEN];
+
+	if (!in_read(st, h, 4)) {
+		return false;
+	}
+	uint32_t sig = get_le32(h);
+	if (sig == ZIP_CENTRAL_SIG || sig == ZIP_END_SIG) {
+		*name = NULL;
+		return true;
+	}
+	if (sig != ZIP_LOCAL_SIG) {
+		LOG_ERR("Unknown ZIP header 0x%08X", sig);
+		return false;
+	}
+	if (!in_read(st, h + 4, sizeof(h) - 4)) {
+		return false;
+	}
+
+	uint16_t flags = get_le16(h + 6);
+	uint16_t method = get_le16(h + 8);
+	uint32_t csize = get_le32(h + 18);
+	uint32_t usize = get_le32(h + 22);
+	uint16_t nlen = get_le16(h + 26);
+	uint16_t xlen = get_le16(h + 28);
+
+	size_t n = MIN(nlen, sizeof(st->name) - 1);
+	if (!in_read(st, (uint8_t*)st->name, n)
+		|| !in_read(st, NULL, nlen - n + xlen)) {
+		return false;
+	}
+	st->name[n] = '\0';
+
+	if (flags & (ZIP_FL_ENCRYPTED | ZIP_FL_DATA_DESC)) {
+		LOG_ERR("ZIP entry '%s' can't be streamed (flags 0x%X)", st->name,
+				flags);
+		return false;
+	}
+	if (csize == UINT32_MAX || usize == UINT32_MAX) {
+		LOG_ERR("ZIP64 entry '%s' can't be streamed", st->name);
+		return false;
+	}
+	if (method != 0 && method != Z_DEFLATED) {
+		LOG_ERR("ZIP entry '%s' has unknown compression %d", st->name,
+				method);
+		return false;
+	}
+	if (method == 0 && csize != usize) {
+		LOG_ERR("ZIP entry '%s' has wrong size", st->name);
+		return false;
+	}
+
+	st->size = usize;
+	st->remain = csize;
+	st->crc_want = get_le32(h + 14);
+	st->deflated = method == Z_DEFLATED;
+	if (st->deflated) {
+		int r = st->zinit ? inflateReset(&st->z)
+						  : inflateInit2(&st->z, -MAX_WBITS);
+		if (r != Z_OK) {
+			LOG_ERR("Could not initialize inflate");
+			return false;
+		}
+		st->zinit = true;
+	}
+	*name = st->name;
+	return true;
+}
+
+static size_t tar_octal(const uint8_t* p, size_t len)
+{
+	size_t v = 0;
+
+	for (; len > 0 && (*p == ' ' || *p == '0'); p++, len--) {
+	}
+	for (; len > 0 && *p >= '0' && *p <= '7'; p++, len--) {
+		v = v * 8 + (*p - '0');
+	}
+	return v;
+}
+
+static bool tar_next(struct pkg_stream* st, const char** name)
+{
+	uint8_t h[TAR_BLOCK];
+
+	for (;;) {
+		if (!in_read(st, h, sizeof(h))) {
+			return false;
+		}
+		if (h[0] == '\0') {
+			*name = NULL;
+			return true;
+		}
+
+		st->size = st->remain = tar_octal(h + 124, 12);
+		st->pad = (TAR_BLOCK - st->size % TAR_BLOCK) % TAR_BLOCK;
+		st->deflated = false;
+
+		/* only regular files, also skips PAX and GNU long name headers */
+		if (h[156] == '0' || h[156] == '\0') {
+			break;
+		}
+		if (!in_read(st, NULL, st->remain + st->pad)) {
+			return false;
+		}
+	}
+
+	if (h[345] != '\0') {
+		snprintf(st->name, sizeof(st->name), "%.155s/%.100s", h + 345, h);
+	} else {
+		snprintf(st->name, sizeof(st->name), "%.100s", h);
+	}
+	*name = st->name;
+	return true;
+}
+
+bool stream_next(struct pkg_stream* st, const char** name, size_t* size)
+{
+	/* the rest of the current entry */
+	if (!in_read(st, NULL, st->remain + st->pad)) {
+		return false;
+	}
+	st->remain = st->pad = st->pos = 0;
+	st->crc = 0;
+
+	bool ret = st->fmt == STREAM_ZIP ? zip_next(st, name) : tar_next(st, name);
+	*size = st->size;
+	return ret;
+}
+
+static bool stream_inflate(struct pkg_stream* st, uint8_t* buf, size_t len)
+{
+	st->z.next_out = buf;
+	st->z.avail_out = len;
+
+	while (st->z.avail_out > 0) {
+		if (st->in_pos == st->in_len && !in_fill(st)) {
+			LOG_ERR("Package stream ended early");
+			return false;
+		}
+		size_t avail = MIN(st->in_len - st->in_pos, st->remain);
+		st->z.next_in = st->in + st->in_pos;
+		st->z.avail_in = avail;
+
+		int r = inflate(&st->z, Z_NO_FLUSH);
+		size_t used = avail - st->z.avail_in;
+		st->in_pos += used;
+		st->remain -= used;
+
+		if ((r != Z_OK && r != Z_STREAM_END)
+			|| (r == Z_STREAM_END && st->z.avail_out > 0)
+			|| (avail == 0 && st->z.avail_out > 0)) {
+			LOG_ERR("Could not inflate '%s'", st->name);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool stream_read(void* user, size_t offset, uint8_t* buf, size_t len)
+{
+	struct pkg_stream* st = user;
+
+	if (offset != st->pos || len > st->size - st->pos) {
+		LOG_ERR("Stream '%s' read out of order at %zu", st->name, offset);
+		return false;
+	}
+
+	if (st->deflated) {
+		if (!stream_inflate(st, buf, len)) {
+			return false;
+		}
+	} else {
+		if (!in_read(st, buf, len)) {
+			return false;
+		}
+		st->remain -= len;
+	}
+	st->pos += len;
+
+	if (st->fmt == STREAM_ZIP) {
+		st->crc = crc_update(st->crc, buf, len);
+		if (st->pos == st->size && st->crc != st->crc_want) {
+			LOG_ERR("CRC error in '%s'", st->name);
+			return false;
+		}
+	}
+	return true;
+}
+
+void stream_close(struct pkg_stream* st)
+{
+	if (st == NULL) {
+		return;
+	}
+	if (st->zinit) {
+		inflateEnd(&st->z);
+	}
+	close(st->fd);
+	free(st);
+}
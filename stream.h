@@ -0,0 +1,40 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A ZIP or TAR package read from a pipe, entry by entry in the order of
+ * the archive. Only ZIP entries which have their sizes in the local header
+ * can be streamed, not those with a data descriptor */
+struct pkg_stream;
+
+/* the stream owns fd and closes it */
+struct pkg_stream* stream_open(int fd);
+/* skip to the next entry, name is NULL at the end of the archive */
+bool stream_next(struct pkg_stream* st, const char** name, size_t* size);
+/* an image_read_fn for the current entry, which has to be read in order */
+bool stream_read(void* user, size_t offset, uint8_t* buf, size_t len);
+void stream_close(struct pkg_stream* st);
+
+#endif
@@ -0,0 +1,233 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+
+#define TRACE_SESSIONS 64
+
+static struct trace_rec* ring;
+static size_t ring_size; /* power of two */
+static atomic_uint ring_seq;
+static uint64_t ring_start_us;
+
+/* sessions by their log prefix, sid 0 is the one without prefix */
+static char sessions[TRACE_SESSIONS][TRACE_DATA + 1];
+static int num_sessions = 1;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread const char* last_prefix;
+static __thread uint8_t last_sid;
+
+static const char* type_names[] = {
+	[TRACE_TX] = "TX", [TRACE_RX] = "RX",	  [TRACE_CP] = "CP",
+	[TRACE_OP] = "OP", [TRACE_NAME] = "NAME",
+};
+
+/* same as before there was the trace */
+static const char* dump_names[] = {
+	[TRACE_TX] = "TX: ",
+	[TRACE_RX] = "RX: ",
+	[TRACE_CP] = "CP: ",
+};
+
+bool trace_init(size_t records)
+{
+	for (ring_size = 1; ring_size < records; ring_size <<= 1) {
+	}
+
+	ring = calloc(ring_size, sizeof(*ring));
+	if (ring == NULL) {
+		LOG_ERR("Could not allocate trace of %zu records", ring_size);
+		return false;
+	}
+	ring_start_us = stats_now_us();
+	return true;
+}
+
+void trace_free(void)
+{
+	free(ring);
+	ring = NULL;
+}
+
+static uint8_t trace_sid(void)
+{
+	const char* prefix = log_get_prefix();
+	int i;
+
+	if (prefix == NULL) {
+		return 0;
+	}
+	if (prefix == last_prefix
+		&& strncmp(sessions[last_sid], prefix, TRACE_DATA) == 0) {
+		return last_sid;
+	}
+
+	pthread_mutex_lock(&sessions_lock);
+	for (i = 1; i < num_sessions; i++) {
+		if (strncmp(sessions[i], prefix, TRACE_DATA) == 0) {
+			break;
+		}
+	}
+	if (i == num_sessions && num_sessions < TRACE_SESSIONS) {
+		strncpy(sessions[i], prefix, TRACE_DATA);
+		num_sessions++;
+	} else if (i == num_sessions) {
+		i = 0; /* too many, they are shown without name */
+	}
+	pthread_mutex_unlock(&sessions_lock);
+
+	last_prefix = prefix;
+	last_sid = i;
+	return i;
+}
+
+static void trace_add(enum trace_type type, const void* data, size_t len)
+{
+	uint32_t seq
+		= atomic_fetch_add_explicit(&ring_seq, 1, memory_order_relaxed);
+	struct trace_rec* r = &ring[seq & (ring_size - 1)];
+
+	r->time_us = stats_now_us();
+	r->seq = seq;
+	r->len = MIN(len, UINT16_MAX);
+	r->type = type;
+	r->sid = trace_sid();
+	memcpy(r->data, data, MIN(len, TRACE_DATA));
+}
+
+/* a packet goes into the trace if there is one, otherwise it is dumped at
+ * debug level */
+void trace_packet(enum trace_type type, const uint8_t* data, size_t len)
+{
+	if (ring != NULL) {
+		trace_add(type, data, len);
+	} else if (log_level >= LL_DEBUG) {
+		dump_data(dump_names[type], data, len);
+	}
+}
+
+void trace_op(uint8_t op, uint64_t time_us, size_t bytes, bool ok)
+{
+	if (ring == NULL) {
+		return;
+	}
+
+	struct trace_op o = {
+		.time_us = MIN(time_us, UINT32_MAX),
+		.bytes = MIN(bytes, UINT32_MAX),
+		.op = op,
+		.ok = ok,
+	};
+	trace_add(TRACE_OP, &o, sizeof(o));
+}
+
+void trace_print(FILE* f, const struct trace_rec* r, uint64_t start_us,
+				 const char* name)
+{
+	fprintf(f, "%11.6f ", (double)(r->time_us - start_us) / 1000000);
+	if (name != NULL) {
+		fprintf(f, "%s ", name);
+	}
+	fprintf(f, "%s", r->type < ARRAY_SIZE(type_names) ? type_names[r->type]
+													  : "?");
+
+	if (r->type == TRACE_OP) {
+		struct trace_op o;
+		memcpy(&o, r->data, sizeof(o));
+		fprintf(f, " %s %s %u us %u bytes\n", stats_op_name(o.op),
+				o.ok ? "ok" : "failed", o.time_us, o.bytes);
+		return;
+	}
+
+	fprintf(f, " [%u]", r->len);
+	for (int i = 0; i < MIN(r->len, TRACE_DATA); i++) {
+		fprintf(f, " %d", r->data[i]);
+	}
+	fprintf(f, "%s\n", r->len > TRACE_DATA ? " ..." : "");
+}
+
+/* the last records, oldest first */
+void trace_dump(FILE* f, size_t last)
+{
+	if (ring == NULL) {
+		return;
+	}
+
+	uint32_t end = atomic_load(&ring_seq);
+	uint32_t n = MIN(MIN(end, ring_size), last);
+	for (uint32_t seq = end - n; seq != end; seq++) {
+		const struct trace_rec* r = &ring[seq & (ring_size - 1)];
+		if (r->seq == seq) {
+			trace_print(f, r, ring_start_us,
+						r->sid > 0 ? sessions[r->sid] : NULL);
+		}
+	}
+}
+
+/* the session names and then the ring, oldest first */
+bool trace_write(const char* path)
+{
+	if (ring == NULL) {
+		return true;
+	}
+
+	FILE* f = fopen(path, "wb");
+	if (f == NULL) {
+		LOG_ERR("Could not write trace to '%s'", path);
+		return false;
+	}
+
+	uint32_t end = atomic_load(&ring_seq);
+	uint32_t n = MIN(end, ring_size);
+	struct trace_file_hdr hdr = {
+		.magic = TRACE_MAGIC,
+		.rec_size = sizeof(struct trace_rec),
+		.num_rec = num_sessions - 1 + n,
+	};
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+
+	for (int i = 1; i < num_sessions && ok; i++) {
+		struct trace_rec r = {
+			.time_us = ring_start_us,
+			.len = strlen(sessions[i]),
+			.type = TRACE_NAME,
+			.sid = i,
+		};
+		memcpy(r.data, sessions[i], r.len);
+		ok = fwrite(&r, sizeof(r), 1, f) == 1;
+	}
+	for (uint32_t seq = end - n; seq != end && ok; seq++) {
+		ok = fwrite(&ring[seq & (ring_size - 1)], sizeof(*ring), 1, f) == 1;
+	}
+
+	if (fclose(f) != 0 || !ok) {
+		LOG_ERR("Could not write trace to '%s'", path);
+		return false;
+	}
+	LOG_INF("Trace of %u records written to '%s'", hdr.num_rec, path);
+	return true;
+}
@@ -0,0 +1,76 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Binary trace of the packets and protocol operations. Records go into a
+ * preallocated ring and are only formatted when it is dumped, or written
+ * to a file and decoded later with nrfdfu-trace */
+
+#define TRACE_MAGIC "NRFDFUT1"
+#define TRACE_DATA	24 /* bytes of each packet which are kept */
+
+enum trace_type {
+	TRACE_TX,	/* serial frame or BLE data write */
+	TRACE_RX,	/* response or notification */
+	TRACE_CP,	/* BLE control point write */
+	TRACE_OP,	/* a protocol operation, see struct trace_op */
+	TRACE_NAME, /* names the session of sid, only in files */
+};
+
+struct trace_rec {
+	uint64_t time_us;
+	uint32_t seq;
+	uint16_t len; /* whole packet, only TRACE_DATA bytes are kept */
+	uint8_t type; /* enum trace_type */
+	uint8_t sid;  /* session, the log prefix */
+	uint8_t data[TRACE_DATA];
+};
+
+/* data of TRACE_OP */
+struct trace_op {
+	uint32_t time_us;
+	uint32_t bytes;
+	uint8_t op; /* enum stats_op */
+	uint8_t ok;
+};
+
+/* the file starts with this, then come records in native byte order */
+struct trace_file_hdr {
+	char magic[8];
+	uint32_t rec_size;
+	uint32_t num_rec;
+};
+
+bool trace_init(size_t records);
+void trace_free(void);
+void trace_packet(enum trace_type type, const uint8_t* data, size_t len);
+void trace_op(uint8_t op, uint64_t time_us, size_t bytes, bool ok);
+void trace_print(FILE* f, const struct trace_rec* r, uint64_t start_us,
+				 const char* name);
+void trace_dump(FILE* f, size_t last);
+bool trace_write(const char* path);
+
+#endif
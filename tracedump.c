@@ -0,0 +1,103 @@
+/*
+ * nrfdfu - Nordic DFU Upgrade Utility
+ *
+ * Copyright (C) 2019 Bruno Randolf (br1@einfach.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * nrfdfu-trace: prints a binary trace written by nrfdfu -T, one line for
+ * every packet and protocol operation, with the time since the start.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "util.h"
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"Usage: nrfdfu-trace [options] TRACEFILE\n"
+			"Print a trace written by nrfdfu -T\n"
+			"Options:\n"
+			"  -h, --help\t\tShow help\n"
+			"  -s, --session <name>\tOnly the port or BLE address <name>\n");
+}
+
+static struct option options[] = {{"help", no_argument, NULL, 'h'},
+								  {"session", required_argument, NULL, 's'},
+								  {NULL, 0, NULL, 0}};
+
+int main(int argc, char* argv[])
+{
+	static char names[256][TRACE_DATA + 1];
+	const char* session = NULL;
+	struct trace_file_hdr hdr;
+	struct trace_rec r;
+	uint64_t start_us = 0;
+	int n;
+
+	while ((n = getopt_long(argc, argv, "hs:", options, NULL)) >= 0) {
+		switch (n) {
+		case 's':
+			session = optarg;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	FILE* f = fopen(argv[optind], "rb");
+	if (f == NULL) {
+		fprintf(stderr, "Could not open '%s'\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1
+		|| memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0
+		|| hdr.rec_size != sizeof(r)) {
+		fprintf(stderr, "'%s' is not a trace of this version\n",
+				argv[optind]);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+
+	for (uint32_t i = 0; i < hdr.num_rec && fread(&r, sizeof(r), 1, f) == 1;
+		 i++) {
+		if (r.type == TRACE_NAME) {
+			memcpy(names[r.sid], r.data, MIN(r.len, TRACE_DATA));
+			continue;
+		}
+		if (start_us == 0) {
+			start_us = r.time_us;
+		}
+		if (session != NULL && strcmp(names[r.sid], session) != 0) {
+			continue;
+		}
+		trace_print(stdout, &r, start_us, r.sid > 0 ? names[r.sid] : NULL);
+	}
+
+	fclose(f);
+	return EXIT_SUCCESS;
+}
@@ -23,6 +23,16 @@
 
 #include "util.h"
 
+uint16_t get_le16(const uint8_t* p)
+{
+	return p[0] | p[1] << 8;
+}
+
+uint32_t get_le32(const uint8_t* p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
 /* dump data in same format as nrfutil (integer) */
 void dump_data(const char* txt, const uint8_t* data, size_t len)
 {
@@ -33,7 +33,11 @@
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
+uint16_t get_le16(const uint8_t* p);
+uint32_t get_le32(const uint8_t* p);
 void dump_data(const char* txt, const uint8_t* data, size_t len);
 bool hex_to_bin(const char* hex, uint8_t* bin, size_t len);
 